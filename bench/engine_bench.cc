@@ -0,0 +1,233 @@
+/*
+ * Latency, CPU and syscalls per request of the session engines: the
+ * callback session, the coroutine coro_session and the io_uring
+ * uring_session. Each benchmark starts a server on a loopback port with
+ * its own thread and sends keep-alive requests for a range of a 64 KiB
+ * file from one blocking client.
+ * Real time per iteration is the round trip; server_cpu_us is the CPU
+ * time the server thread spent per request and syscalls_per_req the
+ * syscalls it made, counted through the raw_syscalls:sys_enter
+ * tracepoint when tracefs is mounted and perf events are allowed.
+ *
+ *   ./engine_bench --benchmark_out=engines.json --benchmark_out_format=json
+ */
+#include "../lib/server.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <benchmark/benchmark.h>
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+    using boost::asio::ip::tcp;
+
+    const std::string &servedFile()
+    {
+        static const std::string path = [] {
+            char name[] = "/tmp/engine_benchXXXXXX";
+            int fd = ::mkstemp(name);
+            std::string block(64 * 1024, 'x');
+            if (fd < 0 || ::write(fd, block.data(), block.size()) != ssize_t(block.size())) {
+                std::perror("engine_bench");
+                std::exit(EXIT_FAILURE);
+            }
+            ::close(fd);
+            std::atexit([] { ::unlink(servedFile().c_str()); });
+            return std::string(name);
+        }();
+        return path;
+    }
+
+    /* Counts the syscalls one thread enters */
+    class syscall_counter {
+    public:
+        explicit syscall_counter(pid_t tid)
+        {
+            for (const char *path : {"/sys/kernel/tracing/events/raw_syscalls/sys_enter/id",
+                                     "/sys/kernel/debug/tracing/events/raw_syscalls/sys_enter/id"}) {
+                std::ifstream id(path);
+                perf_event_attr attr{};
+                if (id >> attr.config) {
+                    attr.type = PERF_TYPE_TRACEPOINT;
+                    attr.size = sizeof(attr);
+                    fd_ = static_cast<int>(::syscall(__NR_perf_event_open, &attr, tid, -1, -1, 0));
+                    break;
+                }
+            }
+        }
+
+        ~syscall_counter()
+        {
+            if (fd_ >= 0) {
+                ::close(fd_);
+            }
+        }
+
+        /* @return: syscalls so far, -1 if they can't be counted */
+        long long count() const
+        {
+            std::uint64_t n;
+            if (fd_ < 0 || ::read(fd_, &n, sizeof(n)) != sizeof(n)) {
+                return -1;
+            }
+            return static_cast<long long>(n);
+        }
+
+    private:
+        int fd_ = -1;
+    };
+
+    /* A server on an ephemeral port, run by its own thread */
+    class loopback_server {
+    public:
+        explicit loopback_server(webServer::session_engine engine)
+        {
+            auto conf = std::make_shared<webServer::settings>();
+            conf->file = servedFile();
+            conf->engine = engine;
+            conf->maxRequests = std::size_t(-1);
+            conf->idleTimeout = std::chrono::seconds(60);
+            webServer::router::instance().rebuild(conf->file, "");
+            webServer::config::instance().publish(conf);
+            server_ = std::make_unique<webServer::server>(io_, conf);
+            server_->listen(0);
+            std::promise<pid_t> tid;
+            thread_ = std::thread([this, &tid] {
+                tid.set_value(static_cast<pid_t>(::syscall(SYS_gettid)));
+                io_.run();
+            });
+            pthread_getcpuclockid(thread_.native_handle(), &clock_);
+            syscalls_ = std::make_unique<syscall_counter>(tid.get_future().get());
+        }
+
+        ~loopback_server()
+        {
+            io_.stop();
+            thread_.join();
+        }
+
+        unsigned short port() const
+        {
+            return server_->port();
+        }
+
+        long long syscalls() const
+        {
+            return syscalls_->count();
+        }
+
+        double cpuSeconds() const
+        {
+            timespec ts;
+            clock_gettime(clock_, &ts);
+            return ts.tv_sec + ts.tv_nsec / 1e9;
+        }
+
+    private:
+        boost::asio::io_context io_{1};
+        std::unique_ptr<webServer::server> server_;
+        std::thread thread_;
+        clockid_t clock_;
+        std::unique_ptr<syscall_counter> syscalls_;
+    };
+
+    /*
+     * Sends one request and reads the response to it
+     * @param: connected socket, request, buffer for the response
+     */
+    void roundTrip(tcp::socket &socket, const std::string &request, std::string &response)
+    {
+        boost::asio::write(socket, boost::asio::buffer(request));
+        response.clear();
+        std::size_t headerEnd = std::string::npos;
+        std::size_t length = 0;
+        char buf[16384];
+        for (;;) {
+            std::size_t n = socket.read_some(boost::asio::buffer(buf));
+            response.append(buf, n);
+            if (headerEnd == std::string::npos) {
+                headerEnd = response.find("\r\n\r\n");
+                if (headerEnd == std::string::npos) {
+                    continue;
+                }
+                headerEnd += 4;
+                auto at = response.find("Content-Length: ");
+                length = std::stoul(response.substr(at + 16));
+            }
+            if (response.size() >= headerEnd + length) {
+                return;
+            }
+        }
+    }
+}
+
+/*
+ * @param: state.range(0) is the session_engine, state.range(1) the bytes requested
+ */
+static void BM_Engine(benchmark::State &state)
+{
+    static const char *const names[] = {"callbacks", "coroutines", "uring"};
+    loopback_server server(static_cast<webServer::session_engine>(state.range(0)));
+    boost::asio::io_context io;
+    tcp::socket socket(io);
+    socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(), server.port()));
+    socket.set_option(tcp::no_delay(true));
+    const std::string request = "GET / HTTP/1.1\r\nHost: bench\r\nRange: bytes=0-"
+            + std::to_string(state.range(1) - 1) + "\r\n\r\n";
+    std::string response;
+    roundTrip(socket, request, response);   // the session is set up before timing
+
+    double cpu = server.cpuSeconds();
+    long long syscalls = server.syscalls();
+    for (auto _ : state) {
+        roundTrip(socket, request, response);
+    }
+    cpu = server.cpuSeconds() - cpu;
+
+    state.SetLabel(names[state.range(0)]);
+    state.SetItemsProcessed(state.iterations());
+    state.SetBytesProcessed(state.iterations() * state.range(1));
+    state.counters["server_cpu_us"] = benchmark::Counter(cpu * 1e6 / state.iterations());
+    if (syscalls >= 0) {
+        state.counters["syscalls_per_req"] = benchmark::Counter(
+                double(server.syscalls() - syscalls) / state.iterations());
+    }
+}
+BENCHMARK(BM_Engine)->ArgsProduct({{
+        int(webServer::session_engine::callbacks),
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+        int(webServer::session_engine::coroutines),
+#endif
+#if defined(WEBSERVER_HAS_IO_URING)
+        int(webServer::session_engine::uring),
+#endif
+    }, {100, 16384}})->UseRealTime();
+
+int main(int argc, char **argv)
+{
+    // The router reports every rebuild on std::cout; keep the
+    // report on the real stdout and send the rest to /dev/null
+    std::ostream report(std::cout.rdbuf());
+    std::ofstream devNull("/dev/null");
+    std::cout.rdbuf(devNull.rdbuf());
+    std::clog.rdbuf(devNull.rdbuf());
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::ConsoleReporter reporter;
+    reporter.SetOutputStream(&report);
+    reporter.SetErrorStream(&std::cerr);
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    return 0;
+}
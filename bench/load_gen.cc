@@ -0,0 +1,480 @@
+/*
+ * Load generator for a running server. Opens `connections` connections
+ * spread over `threads` threads, and every connection sends requests for
+ * random `range`-byte ranges of `path` back to back. After `warmup`
+ * seconds it measures for `duration` seconds and prints a JSON report:
+ * latency percentiles, requests and bytes per second, and the CPU time
+ * spent per byte received by the generator and, given the server's
+ * --pid, by the server.
+ *
+ * With --keep-alive=0 every request gets a new connection and its
+ * latency includes the connect. --range=0 requests the whole file.
+ *
+ *   ./load_gen --port=31645 --connections=64 --range=65536 --duration=10 \
+ *              --pid=$(pidof parallel_downloading) > run.json
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <strings.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace {
+    using boost::asio::ip::tcp;
+    using clock_type = std::chrono::steady_clock;
+
+    struct options {
+        std::string host = "127.0.0.1";
+        unsigned short port = 31645;
+        std::string path = "/";
+        std::size_t connections = 16;
+        std::size_t threads = 1;
+        std::size_t range = 4096;       // 0 requests the whole file
+        bool keepAlive = true;
+        double warmup = 1;              // seconds before measuring
+        double duration = 5;            // seconds measured
+        long pid = 0;                   // server process, 0 doesn't measure its CPU
+        std::size_t fileSize = 0;       // learnt from the server
+    };
+
+    enum phase { warmingUp, measuring, stopping };
+    std::atomic<int> currentPhase{warmingUp};
+
+    /* What the connections of one thread saw while measuring */
+    struct thread_stats {
+        std::vector<std::uint64_t> latencies;  // nanoseconds
+        std::uint64_t requests = 0;
+        std::uint64_t errors = 0;
+        std::uint64_t bytes = 0;               // body bytes
+    };
+
+    /*
+     * Value of a header in a response header, matched without case
+     * @return: the value, empty if the header isn't there
+     */
+    std::string_view headerValue(std::string_view header, std::string_view name)
+    {
+        std::size_t at = header.find("\r\n");
+        while (at != std::string_view::npos && at + 2 < header.size()) {
+            std::size_t begin = at + 2;
+            std::size_t end = header.find("\r\n", begin);
+            std::string_view line = header.substr(begin, end - begin);
+            if (line.size() > name.size() && line[name.size()] == ':'
+                    && ::strncasecmp(line.data(), name.data(), name.size()) == 0) {
+                auto value = line.substr(name.size() + 1);
+                return value.substr(std::min(value.find_first_not_of(' '), value.size()));
+            }
+            at = end;
+        }
+        return {};
+    }
+
+    /*
+     * One connection sending a request, reading the whole response and
+     * sending the next one, until the run is over
+     */
+    class client {
+    public:
+        client(boost::asio::io_context &io, const options &opt, const tcp::endpoint &endpoint,
+               thread_stats &stats, unsigned seed)
+            : opt_(opt), endpoint_(endpoint), stats_(stats), socket_(io), retry_(io),
+              rng_(seed), buf_(64 * 1024)
+        {}
+
+        void start()
+        {
+            connect();
+        }
+
+    private:
+        const options &opt_;
+        tcp::endpoint endpoint_;
+        thread_stats &stats_;
+        tcp::socket socket_;
+        boost::asio::steady_timer retry_;
+        std::mt19937_64 rng_;
+        std::vector<char> buf_;
+        std::string request_;
+        std::string header_;            // response header read so far
+        bool inBody_ = false;
+        std::size_t bodyLeft_ = 0;
+        bool ok_ = false;               // 2xx status
+        bool close_ = false;            // the server closes after this response
+        clock_type::time_point begin_;
+
+        void connect()
+        {
+            if (currentPhase.load(std::memory_order_relaxed) == stopping) {
+                return;
+            }
+            if (!opt_.keepAlive) {
+                begin_ = clock_type::now();
+            }
+            socket_.async_connect(endpoint_, [this](const boost::system::error_code &ec) {
+                if (ec) {
+                    fail();
+                    return;
+                }
+                socket_.set_option(tcp::no_delay(true));
+                sendRequest();
+            });
+        }
+
+        void sendRequest()
+        {
+            if (currentPhase.load(std::memory_order_relaxed) == stopping) {
+                boost::system::error_code ignored;
+                socket_.close(ignored);
+                return;
+            }
+            request_ = "GET ";
+            request_ += opt_.path;
+            request_ += " HTTP/1.1\r\nHost: ";
+            request_ += opt_.host;
+            request_ += "\r\n";
+            if (opt_.range > 0 && opt_.range < opt_.fileSize) {
+                std::size_t first = rng_() % (opt_.fileSize - opt_.range + 1);
+                request_ += "Range: bytes=";
+                request_ += std::to_string(first);
+                request_ += '-';
+                request_ += std::to_string(first + opt_.range - 1);
+                request_ += "\r\n";
+            }
+            request_ += opt_.keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+            if (opt_.keepAlive) {
+                begin_ = clock_type::now();
+            }
+            header_.clear();
+            inBody_ = false;
+            boost::asio::async_write(socket_, boost::asio::buffer(request_),
+                    [this](const boost::system::error_code &ec, std::size_t) {
+                        if (ec) {
+                            fail();
+                        } else {
+                            readResponse();
+                        }
+                    });
+        }
+
+        void readResponse()
+        {
+            socket_.async_read_some(boost::asio::buffer(buf_),
+                    [this](const boost::system::error_code &ec, std::size_t n) {
+                        if (ec) {
+                            fail();
+                        } else {
+                            onData(n);
+                        }
+                    });
+        }
+
+        void onData(std::size_t n)
+        {
+            std::size_t body = n;
+            if (!inBody_) {
+                header_.append(buf_.data(), n);
+                auto end = header_.find("\r\n\r\n");
+                if (end == std::string::npos) {
+                    if (header_.size() > 64 * 1024) {
+                        fail();
+                    } else {
+                        readResponse();
+                    }
+                    return;
+                }
+                std::string_view header(header_.data(), end + 2);
+                ok_ = header.size() > 9 && header[9] == '2';
+                auto connection = headerValue(header, "Connection");
+                close_ = connection.size() >= 5 && ::strncasecmp(connection.data(), "close", 5) == 0;
+                auto length = headerValue(header, "Content-Length");
+                bodyLeft_ = length.empty() ? 0 : std::strtoull(std::string(length).c_str(), nullptr, 10);
+                body = header_.size() - end - 4;
+                inBody_ = true;
+            }
+            if (body > bodyLeft_) {
+                fail();     // more than the response, requests aren't pipelined
+                return;
+            }
+            bodyLeft_ -= body;
+            if (currentPhase.load(std::memory_order_relaxed) == measuring) {
+                stats_.bytes += body;
+            }
+            if (bodyLeft_ > 0) {
+                readResponse();
+                return;
+            }
+            onResponse();
+        }
+
+        void onResponse()
+        {
+            if (currentPhase.load(std::memory_order_relaxed) == measuring) {
+                if (ok_) {
+                    ++stats_.requests;
+                    stats_.latencies.push_back(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            clock_type::now() - begin_).count());
+                } else {
+                    ++stats_.errors;
+                }
+            }
+            if (opt_.keepAlive && !close_) {
+                sendRequest();
+                return;
+            }
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+            connect();
+        }
+
+        /* Counts the error and starts over on a new connection a little later */
+        void fail()
+        {
+            if (currentPhase.load(std::memory_order_relaxed) == measuring) {
+                ++stats_.errors;
+            }
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+            retry_.expires_after(std::chrono::milliseconds(10));
+            retry_.async_wait([this](const boost::system::error_code &) {
+                connect();
+            });
+        }
+    };
+
+    /*
+     * Asks the server for the first byte of the file to learn its size
+     * from the Content-Range of the answer
+     * @return: the size, 0 if the server didn't say
+     */
+    std::size_t probeFileSize(const options &opt, const tcp::endpoint &endpoint)
+    {
+        boost::asio::io_context io;
+        tcp::socket socket(io);
+        socket.connect(endpoint);
+        std::string request = "GET " + opt.path + " HTTP/1.1\r\nHost: " + opt.host
+                + "\r\nRange: bytes=0-0\r\nConnection: close\r\n\r\n";
+        boost::asio::write(socket, boost::asio::buffer(request));
+        std::string response;
+        boost::system::error_code ec;
+        char buf[4096];
+        while (response.find("\r\n\r\n") == std::string::npos) {
+            std::size_t n = socket.read_some(boost::asio::buffer(buf), ec);
+            if (ec) {
+                return 0;
+            }
+            response.append(buf, n);
+        }
+        auto range = headerValue(response, "Content-Range");
+        auto slash = range.find('/');
+        return slash == std::string_view::npos ? 0
+                : std::strtoull(std::string(range.substr(slash + 1)).c_str(), nullptr, 10);
+    }
+
+    /* @return: user + system CPU seconds of this process */
+    double selfCpuSeconds()
+    {
+        rusage usage{};
+        ::getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    }
+
+    /* @return: user + system CPU seconds of another process, -1 if it can't be read */
+    double processCpuSeconds(long pid)
+    {
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string line;
+        if (!std::getline(stat, line)) {
+            return -1;
+        }
+        // The command name in parentheses may contain spaces, fields are counted after it
+        std::istringstream fields(line.substr(line.rfind(')') + 2));
+        std::string field;
+        unsigned long long utime = 0, stime = 0;
+        for (int i = 3; i <= 15 && fields >> field; ++i) {
+            if (i == 14) {
+                utime = std::stoull(field);
+            } else if (i == 15) {
+                stime = std::stoull(field);
+            }
+        }
+        return double(utime + stime) / ::sysconf(_SC_CLK_TCK);
+    }
+
+    void usage()
+    {
+        std::cerr << "usage: load_gen [--host=127.0.0.1] [--port=31645] [--path=/]\n"
+                     "                [--connections=16] [--threads=1] [--range=4096]\n"
+                     "                [--keep-alive=1] [--warmup=1] [--duration=5] [--pid=0]\n";
+    }
+
+    bool parseOptions(int argc, char **argv, options &opt)
+    {
+        for (int i = 1; i < argc; ++i) {
+            std::string_view arg = argv[i];
+            auto eq = arg.find('=');
+            if (arg.substr(0, 2) != "--" || eq == std::string_view::npos) {
+                return false;
+            }
+            auto name = arg.substr(2, eq - 2);
+            std::string value(arg.substr(eq + 1));
+            try {
+                if (name == "host") {
+                    opt.host = value;
+                } else if (name == "port") {
+                    opt.port = static_cast<unsigned short>(std::stoul(value));
+                } else if (name == "path") {
+                    opt.path = value;
+                } else if (name == "connections") {
+                    opt.connections = std::max<std::size_t>(1, std::stoul(value));
+                } else if (name == "threads") {
+                    opt.threads = std::max<std::size_t>(1, std::stoul(value));
+                } else if (name == "range") {
+                    opt.range = std::stoul(value);
+                } else if (name == "keep-alive") {
+                    opt.keepAlive = value != "0" && value != "false";
+                } else if (name == "warmup") {
+                    opt.warmup = std::stod(value);
+                } else if (name == "duration") {
+                    opt.duration = std::stod(value);
+                } else if (name == "pid") {
+                    opt.pid = std::stol(value);
+                } else {
+                    return false;
+                }
+            }
+            catch (std::exception &) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    double percentile(const std::vector<std::uint64_t> &sorted, double p)
+    {
+        if (sorted.empty()) {
+            return 0;
+        }
+        std::size_t i = std::min(sorted.size() - 1, static_cast<std::size_t>(p * sorted.size()));
+        return sorted[i] / 1e3;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    options opt;
+    if (!parseOptions(argc, argv, opt)) {
+        usage();
+        return 1;
+    }
+    tcp::endpoint endpoint;
+    try {
+        boost::asio::io_context io;
+        endpoint = *tcp::resolver(io).resolve(opt.host, std::to_string(opt.port)).begin();
+        opt.fileSize = probeFileSize(opt, endpoint);
+    }
+    catch (std::exception &e) {
+        std::cerr << "load_gen: " << opt.host << ':' << opt.port << ": " << e.what() << '\n';
+        return 1;
+    }
+    if (opt.fileSize == 0) {
+        std::cerr << "load_gen: " << opt.path << " doesn't answer ranges, requesting the whole file\n";
+    }
+
+    const auto end = clock_type::now() + std::chrono::duration_cast<clock_type::duration>(
+            std::chrono::duration<double>(opt.warmup + opt.duration));
+    std::vector<thread_stats> stats(opt.threads);
+    std::vector<std::thread> threads;
+    for (std::size_t t = 0; t < opt.threads; ++t) {
+        threads.emplace_back([&, t] {
+            boost::asio::io_context io(1);
+            std::vector<std::unique_ptr<client>> clients;
+            for (std::size_t c = t; c < opt.connections; c += opt.threads) {
+                clients.push_back(std::make_unique<client>(io, opt, endpoint, stats[t], unsigned(c)));
+                clients.back()->start();
+            }
+            // Connections still waiting for a response long after the end are dropped
+            io.run_until(end + std::chrono::seconds(5));
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::duration<double>(opt.warmup));
+    double clientCpu = selfCpuSeconds();
+    double serverCpu = opt.pid > 0 ? processCpuSeconds(opt.pid) : -1;
+    auto begin = clock_type::now();
+    currentPhase = measuring;
+    std::this_thread::sleep_until(end);
+    currentPhase = stopping;
+    double elapsed = std::chrono::duration<double>(clock_type::now() - begin).count();
+    clientCpu = selfCpuSeconds() - clientCpu;
+    if (serverCpu >= 0) {
+        double now = processCpuSeconds(opt.pid);
+        serverCpu = now >= 0 ? now - serverCpu : -1;
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    thread_stats total;
+    for (auto &s : stats) {
+        total.requests += s.requests;
+        total.errors += s.errors;
+        total.bytes += s.bytes;
+        total.latencies.insert(total.latencies.end(), s.latencies.begin(), s.latencies.end());
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    double mean = 0;
+    for (auto l : total.latencies) {
+        mean += l / 1e3;
+    }
+    mean = total.latencies.empty() ? 0 : mean / total.latencies.size();
+    auto perByte = [&total](double seconds) {
+        std::ostringstream out;
+        if (seconds < 0 || total.bytes == 0) {
+            out << "null";
+        } else {
+            out << seconds * 1e9 / total.bytes;
+        }
+        return out.str();
+    };
+
+    std::cout << std::fixed << std::setprecision(3)
+              << "{\n"
+              << "  \"config\": {\"host\": \"" << opt.host << "\", \"port\": " << opt.port
+              << ", \"path\": \"" << opt.path << "\", \"connections\": " << opt.connections
+              << ", \"threads\": " << opt.threads << ", \"range\": " << opt.range
+              << ", \"file_size\": " << opt.fileSize
+              << ", \"keep_alive\": " << (opt.keepAlive ? "true" : "false")
+              << ", \"duration_s\": " << elapsed << "},\n"
+              << "  \"requests\": " << total.requests << ",\n"
+              << "  \"errors\": " << total.errors << ",\n"
+              << "  \"bytes\": " << total.bytes << ",\n"
+              << "  \"requests_per_second\": " << total.requests / elapsed << ",\n"
+              << "  \"bytes_per_second\": " << total.bytes / elapsed << ",\n"
+              << "  \"latency_us\": {\"mean\": " << mean
+              << ", \"p50\": " << percentile(total.latencies, 0.5)
+              << ", \"p90\": " << percentile(total.latencies, 0.9)
+              << ", \"p99\": " << percentile(total.latencies, 0.99)
+              << ", \"p999\": " << percentile(total.latencies, 0.999)
+              << ", \"max\": " << (total.latencies.empty() ? 0 : total.latencies.back() / 1e3) << "},\n"
+              << "  \"cpu_ns_per_byte\": {\"client\": " << perByte(clientCpu)
+              << ", \"server\": " << perByte(serverCpu) << "}\n"
+              << "}\n";
+    return total.requests > 0 ? 0 : 1;
+}
@@ -0,0 +1,158 @@
+/*
+ * Request parsing before and after the hand written parser, and parsing
+ * of Range headers. Reports requests/sec (items_per_second) and heap
+ * allocations per request.
+ *
+ *   ./parser_bench --benchmark_format=json
+ */
+#include "../lib/http_parser.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <istream>
+#include <map>
+#include <new>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <benchmark/benchmark.h>
+#include <boost/asio/streambuf.hpp>
+#include <boost/lexical_cast.hpp>
+
+static std::atomic<std::size_t> allocations{0};
+
+void *operator new(std::size_t n)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(n ? n : 1)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+    const std::string request =
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost:31645\r\n"
+        "User-Agent: parallel-downloader/1.0\r\n"
+        "Accept: */*\r\n"
+        "Accept-Encoding: gzip, deflate\r\n"
+        "Connection: keep-alive\r\n"
+        "Range: bytes=1048576-2097151\r\n"
+        "\r\n";
+
+    void reportAllocations(benchmark::State &state, std::size_t before)
+    {
+        state.SetItemsProcessed(state.iterations());
+        state.counters["allocs_per_request"] = benchmark::Counter(
+                double(allocations.load() - before) / state.iterations());
+    }
+}
+
+/*
+ * The session used to do one read per header line, copy it through
+ * std::istream/std::stringstream into a std::map and match the Range
+ * header with a std::regex compiled for every request.
+ */
+static void BM_StreambufRegexParse(benchmark::State &state)
+{
+    std::size_t before = allocations.load();
+    for (auto _ : state) {
+        boost::asio::streambuf buff;
+        std::ostream(&buff) << request;
+
+        std::string method, url, version, line, ignore;
+        std::map<std::string, std::string> headers;
+        std::istream stream{&buff};
+        std::getline(stream, line, '\r');
+        std::getline(stream, ignore, '\n');
+        std::stringstream ssRequestLine(line);
+        ssRequestLine >> method >> url >> version;
+        while (std::getline(stream, line, '\r')) {
+            std::getline(stream, ignore, '\n');
+            if (line.empty()) {
+                break;
+            }
+            std::stringstream ssHeader(line);
+            std::string headerName, value;
+            std::getline(ssHeader, headerName, ':');
+            std::getline(ssHeader, value);
+            headers.insert({headerName, value});
+        }
+        std::regex rgx(R"(bytes=([0-9]*[.]?[0-9]+)-([0-9]*[.]?[0-9]+))");
+        std::smatch match;
+        std::regex_search(headers["Range"], match, rgx);
+        unsigned start = std::ceil(boost::lexical_cast<float>(std::string(match[1])));
+        benchmark::DoNotOptimize(start);
+    }
+    reportAllocations(state, before);
+}
+BENCHMARK(BM_StreambufRegexParse);
+
+static void BM_RequestParser(benchmark::State &state)
+{
+    std::size_t before = allocations.load();
+    webServer::http::request req;
+    webServer::http::byte_range ranges[8];
+    std::size_t count;
+    for (auto _ : state) {
+        webServer::http::request_parser parser;
+        auto result = parser.parse(request.data(), request.size(), req);
+        auto range = webServer::http::parseRanges(req.find("range"), 1 << 30, ranges, 8, count);
+        benchmark::DoNotOptimize(result);
+        benchmark::DoNotOptimize(range);
+    }
+    reportAllocations(state, before);
+}
+BENCHMARK(BM_RequestParser);
+
+/*
+ * The request arriving a few bytes at a time, parse() is called after every read
+ */
+static void BM_RequestParserIncremental(benchmark::State &state)
+{
+    std::size_t before = allocations.load();
+    webServer::http::request req;
+    const std::size_t step = state.range(0);
+    for (auto _ : state) {
+        webServer::http::request_parser parser;
+        auto result = webServer::http::parse_result::incomplete;
+        for (std::size_t len = step; result == webServer::http::parse_result::incomplete; len += step) {
+            result = parser.parse(request.data(), std::min(len, request.size()), req);
+        }
+        benchmark::DoNotOptimize(result);
+    }
+    reportAllocations(state, before);
+}
+BENCHMARK(BM_RequestParserIncremental)->Arg(16)->Arg(64);
+
+/*
+ * @param: state.range(0) picks the Range header: one range, a suffix
+ *         range or eight ranges to be sorted and merged
+ */
+static void BM_ParseRanges(benchmark::State &state)
+{
+    static const char *const headers[] = {
+        "bytes=1048576-2097151",
+        "bytes=-65536",
+        "bytes=700-799, 0-99, 100-199, 5000-, 300-399, 200-299, 900-999, 600-699",
+    };
+    static const char *const labels[] = {"single", "suffix", "multiple"};
+    std::size_t before = allocations.load();
+    const std::string_view header = headers[state.range(0)];
+    webServer::http::byte_range ranges[16];
+    std::size_t count;
+    for (auto _ : state) {
+        auto result = webServer::http::parseRanges(header, 1 << 30, ranges, 16, count);
+        benchmark::DoNotOptimize(result);
+        benchmark::DoNotOptimize(ranges);
+    }
+    state.SetLabel(labels[state.range(0)]);
+    reportAllocations(state, before);
+}
+BENCHMARK(BM_ParseRanges)->DenseRange(0, 2);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,104 @@
+/*
+ * Building response headers: connection::buildResponseHeader for a
+ * whole file, one range, a multipart/byteranges answer and a 404.
+ * The request is parsed and routed once, every iteration builds the
+ * header and the list of body parts again. Reports headers/sec
+ * (items_per_second) and the size of the header built.
+ *
+ *   ./response_bench --benchmark_out=headers.json --benchmark_out_format=json
+ */
+#include "../lib/connection.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <benchmark/benchmark.h>
+#include <unistd.h>
+
+namespace {
+    const std::string &servedFile()
+    {
+        static const std::string path = [] {
+            char name[] = "/tmp/response_benchXXXXXX";
+            int fd = ::mkstemp(name);
+            std::string block(1 << 20, 'x');
+            if (fd < 0 || ::write(fd, block.data(), block.size()) != ssize_t(block.size())) {
+                std::perror("response_bench");
+                std::exit(EXIT_FAILURE);
+            }
+            ::close(fd);
+            std::atexit([] { ::unlink(servedFile().c_str()); });
+            return std::string(name);
+        }();
+        return path;
+    }
+
+    /* A connection holding one parsed and routed request */
+    class header_builder : public webServer::connection {
+    public:
+        header_builder(boost::asio::io_context &io, const std::string &request)
+            : connection(io)
+        {
+            readLen_ = request.copy(readBuf_.data(), readBuf_.size());
+            parser_.parse(readBuf_.data(), readLen_, request_);
+            keepAlive_ = true;
+            stats_ = &webServer::metrics::local();
+            resolveRoute();
+        }
+
+        /* @return: size of the header built */
+        std::size_t build()
+        {
+            parts_.clear();
+            buildResponseHeader();
+            return header_.size();
+        }
+    };
+}
+
+/*
+ * @param: state.range(0) picks the request: whole file, one range,
+ *         four ranges or a file that isn't served
+ */
+static void BM_BuildResponseHeader(benchmark::State &state)
+{
+    static const char *const requests[] = {
+        "GET / HTTP/1.1\r\nHost: bench\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: bench\r\nRange: bytes=1024-65535\r\n\r\n",
+        "GET / HTTP/1.1\r\nHost: bench\r\nRange: bytes=0-99, 1000-1999, 4096-8191, -512\r\n\r\n",
+        "GET /nothing-here HTTP/1.1\r\nHost: bench\r\n\r\n",
+    };
+    static const char *const labels[] = {"200", "206", "206 multipart", "404"};
+    webServer::router::instance().rebuild(servedFile(), "");
+    boost::asio::io_context io;
+    header_builder builder(io, requests[state.range(0)]);
+    std::size_t size = 0;
+    for (auto _ : state) {
+        size = builder.build();
+        benchmark::DoNotOptimize(size);
+    }
+    state.SetLabel(labels[state.range(0)]);
+    state.SetItemsProcessed(state.iterations());
+    state.counters["header_bytes"] = benchmark::Counter(double(size));
+}
+BENCHMARK(BM_BuildResponseHeader)->DenseRange(0, 3);
+
+int main(int argc, char **argv)
+{
+    // The router reports every rebuild on std::cout; keep the
+    // report on the real stdout and send the rest to /dev/null
+    std::ostream report(std::cout.rdbuf());
+    std::ofstream devNull("/dev/null");
+    std::cout.rdbuf(devNull.rdbuf());
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::ConsoleReporter reporter;
+    reporter.SetOutputStream(&report);
+    reporter.SetErrorStream(&std::cerr);
+    benchmark::RunSpecifiedBenchmarks(&reporter);
+    return 0;
+}
@@ -0,0 +1,301 @@
+#ifndef LIB_ACCESS_LOG_H
+#define LIB_ACCESS_LOG_H
+
+#include "spsc_ring.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace webServer {
+
+    /*
+     * One line of the access log. It has a fixed size so it can be
+     * copied into the ring without allocating; longer fields are cut.
+     */
+    struct access_record {
+        std::int64_t time = 0;          // nanoseconds since the epoch when the response ended
+        std::uint64_t bytes = 0;        // bytes of the response written
+        std::uint64_t durationUs = 0;   // from the parsed request to the end of the response
+        std::uint16_t status = 0;
+        std::uint8_t methodLength = 0;
+        std::uint8_t rangeLength = 0;
+        std::uint8_t peerLength = 0;
+        std::uint16_t urlLength = 0;
+        char method[16];
+        char range[64];
+        char peer[56];
+        char url[352];
+
+        template <std::size_t N, typename Length>
+        static void copy(char (&to)[N], Length &length, std::string_view from)
+        {
+            length = static_cast<Length>(std::min(from.size(), N));
+            std::memcpy(to, from.data(), length);
+        }
+    };
+
+    /*
+     * Access log written by a background thread. The I/O threads push
+     * their records into rings of their own and never wait: when a ring
+     * is full the record is dropped and the caller counts it. The writer
+     * drains all rings, formats the records as JSON lines and writes
+     * them out in large batches. The file is rotated to path.1, path.2...
+     * once it grows past maxSize, and reopened on reopen() so it can be
+     * moved away by an external logrotate as well.
+     */
+    class access_log {
+    public:
+        static constexpr std::size_t ringSize = 4096;   // records per thread
+
+        static access_log &instance()
+        {
+            static access_log log;
+            return log;
+        }
+
+        ~access_log()
+        {
+            configure("", 0, 0);
+        }
+
+        /*
+         * Starts writing to path, or stops logging when path is empty.
+         * Records already queued are written to the previous file.
+         * @param: path of the log, size at which it is rotated,
+         *         rotated files kept
+         * @return: None
+         */
+        void configure(const std::string &path, std::size_t maxSize, std::size_t keep)
+        {
+            std::lock_guard<std::mutex> configuring(configure_);
+            if (writer_.joinable()) {
+                enabled_ = false;
+                {
+                    std::lock_guard<std::mutex> lock(mutex_);
+                    stop_ = true;
+                }
+                wake_.notify_one();
+                writer_.join();
+                stop_ = false;
+            }
+            path_ = path;
+            maxSize_ = maxSize;
+            keep_ = keep;
+            if (!path_.empty()) {
+                writer_ = std::thread([this]() { write(); });
+                enabled_ = true;
+            }
+        }
+
+        /* Lets the hot path skip building records nobody writes */
+        bool enabled() const
+        {
+            return enabled_.load(std::memory_order_relaxed);
+        }
+
+        /*
+         * Queues a record. Only ever blocks the first time a thread logs,
+         * to register the thread's ring.
+         * @param: the record
+         * @return: false if it was dropped because the ring is full
+         */
+        bool push(const access_record &record)
+        {
+            thread_local ring *mine = addRing();
+            return mine->push(record);
+        }
+
+        /* Makes the writer reopen the file, after it was moved away */
+        void reopen()
+        {
+            reopen_ = true;
+        }
+
+    private:
+        using ring = spsc_ring<access_record, ringSize>;
+
+        std::mutex configure_;
+        std::mutex mutex_;                  // guards rings_ and stop_
+        std::condition_variable wake_;
+        std::vector<std::unique_ptr<ring>> rings_;
+        std::thread writer_;
+        std::atomic<bool> enabled_{false};
+        std::atomic<bool> reopen_{false};
+        bool stop_ = false;
+        std::string path_;
+        std::size_t maxSize_ = 0;
+        std::size_t keep_ = 0;
+        int fd_ = -1;
+        std::size_t size_ = 0;              // bytes in the file
+
+        // A batch is written once it is this big or this old
+        static constexpr std::size_t batchSize = 256 * 1024;
+        static constexpr std::chrono::milliseconds batchAge{100};
+        static constexpr std::chrono::milliseconds idleSleep{10};
+
+        ring *addRing()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            rings_.push_back(std::make_unique<ring>());
+            return rings_.back().get();
+        }
+
+        /* Body of the writer thread */
+        void write()
+        {
+            open();
+            std::string batch;
+            batch.reserve(batchSize + 4096);
+            std::vector<ring *> rings;
+            auto written = std::chrono::steady_clock::now();
+            for (;;) {
+                bool stopping;
+                {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    rings.clear();
+                    for (auto &r : rings_) {
+                        rings.push_back(r.get());
+                    }
+                    stopping = stop_;
+                }
+                std::size_t drained = 0;
+                for (auto r : rings) {
+                    drained += r->drain([&batch](const access_record &record) { format(batch, record); });
+                }
+                auto now = std::chrono::steady_clock::now();
+                if (!batch.empty() && (batch.size() >= batchSize || now - written >= batchAge || stopping)) {
+                    flush(batch);
+                    written = now;
+                }
+                if (stopping) {
+                    break;
+                }
+                if (drained == 0) {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    wake_.wait_for(lock, idleSleep, [this]() { return stop_; });
+                }
+            }
+            close();
+        }
+
+        void flush(std::string &batch)
+        {
+            if (reopen_.exchange(false)) {
+                close();
+                open();
+            }
+            if (maxSize_ > 0 && size_ > 0 && size_ + batch.size() > maxSize_) {
+                rotate();
+            }
+            const char *data = batch.data();
+            std::size_t left = batch.size();
+            while (left > 0 && fd_ >= 0) {
+                ssize_t n = ::write(fd_, data, left);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    break;  // the disk is full or gone, the batch is lost
+                }
+                data += n;
+                left -= n;
+                size_ += n;
+            }
+            batch.clear();
+        }
+
+        void open()
+        {
+            fd_ = ::open(path_.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+            if (fd_ < 0) {
+                std::cerr << "Can't open access log " << path_ << ": " << std::strerror(errno) << '\n';
+                size_ = 0;
+                return;
+            }
+            struct stat st{};
+            size_ = ::fstat(fd_, &st) == 0 ? st.st_size : 0;
+        }
+
+        void close()
+        {
+            if (fd_ >= 0) {
+                ::close(fd_);
+                fd_ = -1;
+            }
+        }
+
+        /* path.(keep-1) becomes path.keep, ... path becomes path.1 */
+        void rotate()
+        {
+            close();
+            if (keep_ == 0) {
+                ::unlink(path_.c_str());
+            } else {
+                for (std::size_t i = keep_ - 1; i > 0; --i) {
+                    ::rename((path_ + '.' + std::to_string(i)).c_str(),
+                             (path_ + '.' + std::to_string(i + 1)).c_str());
+                }
+                ::rename(path_.c_str(), (path_ + ".1").c_str());
+            }
+            open();
+        }
+
+        static void appendEscaped(std::string &out, const char *data, std::size_t length)
+        {
+            for (std::size_t i = 0; i < length; ++i) {
+                unsigned char c = data[i];
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if (c < 0x20 || c >= 0x7f) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+            }
+        }
+
+        static void format(std::string &out, const access_record &r)
+        {
+            std::time_t seconds = r.time / 1000000000;
+            std::tm utc;
+            ::gmtime_r(&seconds, &utc);
+            char time[40];
+            std::size_t n = std::strftime(time, sizeof(time), "%Y-%m-%dT%H:%M:%S", &utc);
+            std::snprintf(time + n, sizeof(time) - n, ".%03dZ", int(r.time / 1000000 % 1000));
+            char numbers[96];
+            out += "{\"time\":\"";
+            out += time;
+            out += "\",\"peer\":\"";
+            appendEscaped(out, r.peer, r.peerLength);
+            out += "\",\"method\":\"";
+            appendEscaped(out, r.method, r.methodLength);
+            out += "\",\"url\":\"";
+            appendEscaped(out, r.url, r.urlLength);
+            out += "\",\"range\":\"";
+            appendEscaped(out, r.range, r.rangeLength);
+            std::snprintf(numbers, sizeof(numbers), "\",\"status\":%u,\"bytes\":%llu,\"duration_us\":%llu}\n",
+                          unsigned(r.status), static_cast<unsigned long long>(r.bytes),
+                          static_cast<unsigned long long>(r.durationUs));
+            out += numbers;
+        }
+    };
+}
+#endif //LIB_ACCESS_LOG_H
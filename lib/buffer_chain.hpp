@@ -0,0 +1,245 @@
+#ifndef LIB_BUFFER_CHAIN_H
+#define LIB_BUFFER_CHAIN_H
+
+#include "file_cache.hpp"
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <boost/asio/buffer.hpp>
+
+namespace webServer {
+
+    /*
+     * The pending output of a session: response headers, multipart
+     * boundaries and ranges of files, in the order they go on the wire.
+     *
+     * Entries live in a fixed ring that only the session's strand touches,
+     * so pushing and popping needs no lock and no allocation. Small byte
+     * buffers are copied into the entry itself, larger ones are moved in
+     * or shared. File ranges only hold a reference to the cached file.
+     * gather() turns the front of the chain into one buffer sequence so
+     * a header and the start of its body leave in a single writev.
+     */
+    class buffer_chain {
+    public:
+        static constexpr std::size_t capacity = 64;     // enough for a header and 16 multipart parts
+        static constexpr std::size_t inlineSize = 256;  // bytes stored inside the entry
+
+        struct entry {
+            std::array<char, inlineSize> inlineBytes;
+            std::string owned;                          // bytes that don't fit inline
+            std::shared_ptr<const std::string> shared;  // bytes shared between responses
+            std::shared_ptr<const cached_file> file;    // set for file ranges
+            const char *data = nullptr;                 // next byte of a memory entry
+            std::size_t offset = 0;                     // next byte of a file range
+            std::size_t length = 0;                     // bytes left to send
+            std::size_t advised = 0;                    // end of the range already advised WILLNEED
+
+            bool isFile() const
+            {
+                return data == nullptr;
+            }
+        };
+
+        /* A view of the gathered buffers that asio accepts as a ConstBufferSequence */
+        struct buffers {
+            const boost::asio::const_buffer *first;
+            const boost::asio::const_buffer *last;
+
+            const boost::asio::const_buffer *begin() const { return first; }
+            const boost::asio::const_buffer *end() const { return last; }
+        };
+
+        bool empty() const
+        {
+            return count_ == 0;
+        }
+
+        bool full() const
+        {
+            return count_ == capacity;
+        }
+
+        entry &front()
+        {
+            return ring_[head_];
+        }
+
+        /*
+         * Appends a copy of some bytes
+         * @param: the bytes
+         * @return: None
+         */
+        void push(std::string_view bytes)
+        {
+            if (bytes.empty()) {
+                return;
+            }
+            auto &e = next();
+            if (bytes.size() <= inlineSize) {
+                std::copy(bytes.begin(), bytes.end(), e.inlineBytes.begin());
+                e.data = e.inlineBytes.data();
+            } else {
+                e.owned.assign(bytes);
+                e.data = e.owned.data();
+            }
+            e.length = bytes.size();
+        }
+
+        /*
+         * Appends bytes shared with other responses, they are not copied
+         * @param: the bytes
+         * @return: None
+         */
+        void push(std::shared_ptr<const std::string> bytes)
+        {
+            if (bytes->empty()) {
+                return;
+            }
+            auto &e = next();
+            e.data = bytes->data();
+            e.length = bytes->size();
+            e.shared = std::move(bytes);
+        }
+
+        /*
+         * Appends a range of a file
+         * @param: the file, start and length of the range
+         * @return: None
+         */
+        void push(std::shared_ptr<const cached_file> file, std::size_t offset, std::size_t length)
+        {
+            if (length == 0) {
+                return;
+            }
+            auto &e = next();
+            e.file = std::move(file);
+            e.offset = offset;
+            e.length = length;
+            e.advised = offset;
+        }
+
+        /*
+         * Collects buffers from the front of the chain for one gathered write.
+         * File ranges are taken from the file's mapping, at most `window`
+         * bytes of each, and the next `ahead` bytes are advised WILLNEED.
+         * Stops at a file range that stopAt says must be sent another way.
+         * @param: most bytes to gather, bytes of a file to gather at once,
+         *         read ahead, predicate for ranges not to gather
+         * @return: the buffers, empty if the front must be sent another way
+         */
+        template <typename Predicate>
+        buffers gather(std::size_t limit, std::size_t window, std::size_t ahead, Predicate stopAt)
+        {
+            std::size_t n = 0;
+            for (std::size_t i = 0; i < count_ && limit > 0; ++i) {
+                auto &e = ring_[(head_ + i) % capacity];
+                std::size_t len = std::min(e.length, limit);
+                if (!e.isFile()) {
+                    iov_[n++] = boost::asio::const_buffer(e.data, len);
+                } else {
+                    if (stopAt(e) || e.file->data() == nullptr) {
+                        break;
+                    }
+                    len = std::min(len, window);
+                    if (e.advised < e.offset + len + ahead) {
+                        std::size_t end = std::min(e.offset + len + ahead, e.offset + e.length);
+                        e.file->willNeed(e.advised, end - e.advised);
+                        e.advised = end;
+                    }
+                    iov_[n++] = boost::asio::const_buffer(e.file->data() + e.offset, len);
+                    if (len < e.length) {
+                        break;  // the rest of the range comes in the next write
+                    }
+                }
+                limit -= len;
+            }
+            return {iov_.data(), iov_.data() + n};
+        }
+
+        /*
+         * Copies bytes from the front of the chain without consuming them.
+         * File ranges are read with pread(2), not from the mapping.
+         * @param: where to append the bytes, most bytes to copy
+         * @return: false if a file ended before its range
+         */
+        bool copy(std::string &out, std::size_t limit) const
+        {
+            for (std::size_t i = 0; i < count_ && limit > 0; ++i) {
+                auto &e = ring_[(head_ + i) % capacity];
+                std::size_t len = std::min(e.length, limit);
+                if (!e.isFile()) {
+                    out.append(e.data, len);
+                } else {
+                    std::size_t at = out.size();
+                    out.resize(at + len);
+                    if (!e.file->read(out.data() + at, len, e.offset)) {
+                        return false;
+                    }
+                }
+                limit -= len;
+            }
+            return true;
+        }
+
+        /*
+         * Drops bytes that have been written from the front of the chain
+         * @param: number of bytes written
+         * @return: None
+         */
+        void consume(std::size_t n)
+        {
+            while (n > 0 && count_ > 0) {
+                auto &e = front();
+                std::size_t len = std::min(n, e.length);
+                if (e.isFile()) {
+                    e.offset += len;
+                } else {
+                    e.data += len;
+                }
+                e.length -= len;
+                n -= len;
+                if (e.length == 0) {
+                    pop();
+                }
+            }
+        }
+
+        void clear()
+        {
+            while (count_ > 0) {
+                pop();
+            }
+        }
+
+    private:
+        std::array<entry, capacity> ring_;
+        std::array<boost::asio::const_buffer, capacity> iov_;
+        std::size_t head_ = 0;
+        std::size_t count_ = 0;
+
+        entry &next()
+        {
+            // Responses are built to fit, running out is a programming error
+            if (full()) {
+                throw std::length_error("buffer_chain is full");
+            }
+            return ring_[(head_ + count_++) % capacity];
+        }
+
+        void pop()
+        {
+            auto &e = front();
+            e.shared.reset();
+            e.file.reset();
+            e.owned.clear();    // keeps its capacity for the next response
+            e.data = nullptr;
+            e.length = 0;
+            head_ = (head_ + 1) % capacity;
+            --count_;
+        }
+    };
+}
+#endif //LIB_BUFFER_CHAIN_H
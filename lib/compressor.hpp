@@ -0,0 +1,296 @@
+#ifndef LIB_COMPRESSOR_H
+#define LIB_COMPRESSOR_H
+
+#include "file_cache.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <boost/asio/post.hpp>
+#include <boost/asio/thread_pool.hpp>
+#include <boost/filesystem.hpp>
+#include <zlib.h>
+
+namespace webServer {
+
+    /* A gzip copy of a served file, kept in the compression cache directory */
+    struct compressed_file {
+        std::string path;           // the .gz file in the cache directory
+        std::size_t size;           // size of the .gz file
+        std::size_t sourceSize;     // the source it was made from
+        std::time_t sourceMtime;
+    };
+
+    /*
+     * Compresses served files with gzip in the background and keeps the
+     * results on disk, so the compressed copy can be sent with sendfile
+     * like any other file.
+     *
+     * The first request for a file is answered uncompressed and queues
+     * the compression on a worker thread; later requests get the cached
+     * copy. The cache is bounded by size and drops the least recently
+     * used copies. A copy is thrown away when its source changes.
+     *
+     * Copies outlive the process. When the cache directory is configured
+     * the copies already in it count against the size, and are dropped
+     * first, oldest first, unless a request finds its source unchanged:
+     * the name of a copy holds the hash of the source path and the size
+     * and modification time of the source.
+     */
+    class compressor {
+    public:
+        static compressor &instance()
+        {
+            static compressor c;
+            return c;
+        }
+
+        /*
+         * @param: cache directory (empty disables compression on the fly),
+         *         size of the cache, smallest file worth compressing
+         * @return: None
+         */
+        void configure(const std::string &dir, std::size_t budget, std::size_t minSize)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            bool moved = dir != dir_;
+            dir_ = dir;
+            budget_ = budget;
+            minSize_ = minSize;
+            if (!dir_.empty()) {
+                boost::system::error_code ec;
+                boost::filesystem::create_directories(dir_, ec);
+                if (ec) {
+                    std::cerr << "Can't create compression cache " << dir_ << ": " << ec.message() << '\n';
+                    dir_.clear();
+                } else if (moved) {
+                    rescan();
+                }
+            }
+            evict();
+        }
+
+        /*
+         * Looks up the gzip copy of a file. Queues its compression if
+         * there is none yet.
+         * @param: the source file
+         * @return: the copy or nullptr if it isn't ready
+         */
+        std::shared_ptr<const compressed_file> find(const std::shared_ptr<const cached_file> &source)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (dir_.empty() || source->size() < minSize_) {
+                return nullptr;
+            }
+            auto found = entries_.find(source->path());
+            if (found != entries_.end()) {
+                auto &copy = found->second.first;
+                if (copy->sourceSize == source->size() && copy->sourceMtime == source->mtime()) {
+                    lru_.splice(lru_.begin(), lru_, found->second.second);
+                    return copy;
+                }
+                remove(found);
+            }
+            auto orphan = orphans_.empty() ? orphans_.end() : orphans_.find(copyPath(dir_, *source));
+            if (orphan != orphans_.end()) {
+                // Made by an earlier run from this version of the source
+                auto copy = std::make_shared<const compressed_file>(
+                        compressed_file{orphan->first, orphan->second.first, source->size(), source->mtime()});
+                dropOrphan(orphan);
+                lru_.push_front(source->path());
+                entries_[source->path()] = {copy, lru_.begin()};
+                used_ += copy->size;
+                return copy;
+            }
+            if (pending_.insert(source->path()).second) {
+                boost::asio::post(worker_, [this, source]() { compress(source); });
+            }
+            return nullptr;
+        }
+
+    private:
+        using lru_list = std::list<std::string>;
+        using entry = std::pair<std::shared_ptr<const compressed_file>, lru_list::iterator>;
+        using orphan = std::pair<std::size_t, lru_list::iterator>;    // size, place in orphanAge_
+
+        std::mutex mutex_;
+        std::string dir_;
+        std::size_t budget_ = 0;
+        std::size_t minSize_ = 0;
+        std::size_t used_ = 0;
+        std::unordered_map<std::string, entry> entries_;    // source path to its copy
+        lru_list lru_;                                      // most recently used first
+        std::unordered_set<std::string> pending_;           // sources being compressed
+        std::unordered_map<std::string, orphan> orphans_;   // copies found in the directory, by their path
+        lru_list orphanAge_;                                // their paths, oldest first
+        boost::asio::thread_pool worker_{1};
+
+        compressor() = default;
+
+        /* Must be called with mutex_ held */
+        void remove(std::unordered_map<std::string, entry>::iterator it)
+        {
+            used_ -= it->second.first->size;
+            std::remove(it->second.first->path.c_str());
+            lru_.erase(it->second.second);
+            entries_.erase(it);
+        }
+
+        /* Must be called with mutex_ held. Forgets a copy found in the directory, the file stays. */
+        void dropOrphan(std::unordered_map<std::string, orphan>::iterator it)
+        {
+            used_ -= it->second.first;
+            orphanAge_.erase(it->second.second);
+            orphans_.erase(it);
+        }
+
+        /* Must be called with mutex_ held. Drops copies until the cache fits its size. */
+        void evict()
+        {
+            while (used_ > budget_ && !orphanAge_.empty()) {
+                auto oldest = orphans_.find(orphanAge_.front());
+                std::remove(oldest->first.c_str());
+                dropOrphan(oldest);
+            }
+            while (used_ > budget_ && lru_.size() > 1) {
+                remove(entries_.find(lru_.back()));
+            }
+        }
+
+        /*
+         * Must be called with mutex_ held. Takes stock of the copies in
+         * the cache directory that aren't in use yet and deletes the
+         * partial ones of a compression that was cut short.
+         */
+        void rescan()
+        {
+            std::unordered_set<std::string> used;
+            for (auto &[source, e] : entries_) {
+                used.insert(e.first->path);
+            }
+            std::vector<std::pair<std::time_t, boost::filesystem::path>> found;
+            boost::system::error_code ec;
+            for (boost::filesystem::directory_iterator it(dir_, ec), end; !ec && it != end; it.increment(ec)) {
+                const auto &path = it->path();
+                if (path.extension() == ".tmp") {
+                    boost::filesystem::remove(path, ec);
+                    ec.clear();
+                } else if (path.extension() == ".gz" && !orphans_.count(path.string()) && !used.count(path.string())
+                           && boost::filesystem::is_regular_file(it->status())) {
+                    found.emplace_back(boost::filesystem::last_write_time(path, ec), path);
+                    ec.clear();
+                }
+            }
+            std::sort(found.begin(), found.end());
+            for (auto &[time, path] : found) {
+                auto size = boost::filesystem::file_size(path, ec);
+                if (ec) {
+                    ec.clear();
+                    continue;
+                }
+                orphanAge_.push_back(path.string());
+                orphans_.emplace(path.string(), orphan{size, std::prev(orphanAge_.end())});
+                used_ += size;
+            }
+        }
+
+        /* @return: path of the copy of this version of the source */
+        static std::string copyPath(const std::string &dir, const cached_file &source)
+        {
+            std::stringstream name;
+            name << dir << '/' << std::hex << std::hash<std::string>{}(source.path())
+                 << '-' << source.mtime() << '-' << source.size() << ".gz";
+            return name.str();
+        }
+
+        /*
+         * Runs on the worker thread. Deflates the source, read with pread,
+         * into a temporary file and renames it into place.
+         */
+        void compress(std::shared_ptr<const cached_file> source)
+        {
+            std::string dir;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                dir = dir_;
+            }
+            std::string path = copyPath(dir, *source);
+            std::string tmp = path + ".tmp";
+
+            bool ok = deflateTo(*source, tmp);
+            std::size_t size = ok ? boost::filesystem::file_size(tmp) : 0;
+            // Not worth it if it doesn't get smaller
+            ok = ok && size < source->size() && std::rename(tmp.c_str(), path.c_str()) == 0;
+            if (!ok) {
+                std::remove(tmp.c_str());
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            pending_.erase(source->path());
+            if (!ok) {
+                return;
+            }
+            auto copy = std::make_shared<const compressed_file>(
+                    compressed_file{path, size, source->size(), source->mtime()});
+            lru_.push_front(source->path());
+            entries_[source->path()] = {copy, lru_.begin()};
+            used_ += size;
+            evict();
+        }
+
+        static bool deflateTo(const cached_file &source, const std::string &path)
+        {
+            FILE *out = std::fopen(path.c_str(), "wb");
+            if (out == nullptr) {
+                return false;
+            }
+            z_stream zs{};
+            // 15 window bits + 16 writes a gzip header instead of a zlib one
+            if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+                std::fclose(out);
+                return false;
+            }
+            std::vector<unsigned char> in(std::min<std::size_t>(source.size(), 1 << 20));
+            std::size_t offset = 0;
+            std::size_t left = source.size();
+            unsigned char buf[1 << 16];
+            int rc = Z_OK;
+            do {
+                std::size_t n = std::min(left, in.size());
+                if (!source.read(in.data(), n, offset)) {
+                    rc = Z_STREAM_ERROR;    // the source shrunk meanwhile
+                    break;
+                }
+                zs.next_in = in.data();
+                zs.avail_in = n;
+                offset += n;
+                left -= n;
+                int flush = left == 0 ? Z_FINISH : Z_NO_FLUSH;
+                do {
+                    zs.next_out = buf;
+                    zs.avail_out = sizeof(buf);
+                    rc = deflate(&zs, flush);
+                    std::size_t have = sizeof(buf) - zs.avail_out;
+                    if (rc == Z_STREAM_ERROR || std::fwrite(buf, 1, have, out) != have) {
+                        rc = Z_STREAM_ERROR;
+                        left = 0;
+                        break;
+                    }
+                } while (zs.avail_out == 0);
+            } while (left > 0);
+            deflateEnd(&zs);
+            return std::fclose(out) == 0 && rc == Z_STREAM_END;
+        }
+    };
+}
+#endif //LIB_COMPRESSOR_H
@@ -0,0 +1,104 @@
+#ifndef LIB_CONFIG_H
+#define LIB_CONFIG_H
+
+#include "settings.hpp"
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <boost/asio.hpp>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+namespace webServer {
+
+    /*
+     * The settings in effect. A reload builds a whole new settings object
+     * and swaps the pointer, the same way the router swaps its table.
+     * New connections take the current snapshot and keep it until they
+     * close, so a reload never changes the rules under a running download.
+     */
+    class config {
+    public:
+        static config &instance()
+        {
+            static config c;
+            return c;
+        }
+
+        /* @return: the settings new connections get */
+        std::shared_ptr<const settings> current() const
+        {
+            return std::atomic_load(&current_);
+        }
+
+        void publish(std::shared_ptr<const settings> conf)
+        {
+            std::atomic_store(&current_, std::move(conf));
+        }
+
+        /*
+         * Calls changed whenever the file is written or replaced. The
+         * directory is watched rather than the file, since editors and
+         * deployment tools usually save by renaming a new file over it.
+         * @param: io_context that reads the events, path of the file,
+         *         function called on its thread after a change
+         * @return: None
+         */
+        void watch(boost::asio::io_context &io, const std::string &path, std::function<void()> changed)
+        {
+            int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd == -1) {
+                std::cerr << "inotify is not available, reload the configuration with SIGHUP\n";
+                return;
+            }
+            auto slash = path.rfind('/');
+            std::string dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+            name_ = slash == std::string::npos ? path : path.substr(slash + 1);
+            if (::inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1) {
+                std::cerr << "Can't watch " << dir << ": " << std::strerror(errno) << '\n';
+                ::close(fd);
+                return;
+            }
+            inotify_ = std::make_unique<boost::asio::posix::stream_descriptor>(io, fd);
+            changed_ = std::move(changed);
+            readEvents();
+        }
+
+    private:
+        std::shared_ptr<const settings> current_ = std::make_shared<const settings>();
+        std::unique_ptr<boost::asio::posix::stream_descriptor> inotify_;
+        std::string name_;                  // of the file in the watched directory
+        std::function<void()> changed_;
+        char events_[4096] __attribute__((aligned(alignof(struct inotify_event))));
+
+        config() = default;
+
+        void readEvents()
+        {
+            inotify_->async_read_some(boost::asio::buffer(events_),
+                    [this](const boost::system::error_code &ec, std::size_t len) {
+                        if (ec) {
+                            return;
+                        }
+                        // A save often comes as several events, they make one reload
+                        bool changed = false;
+                        for (std::size_t i = 0; i < len;) {
+                            auto event = reinterpret_cast<const inotify_event *>(events_ + i);
+                            if (event->len > 0 && name_ == event->name) {
+                                changed = true;
+                            }
+                            i += sizeof(inotify_event) + event->len;
+                        }
+                        if (changed) {
+                            changed_();
+                        }
+                        readEvents();
+                    });
+        }
+    };
+}
+#endif //LIB_CONFIG_H
@@ -0,0 +1,1149 @@
+#ifndef LIB_CONNECTION_H
+#define LIB_CONNECTION_H
+
+#include "access_log.hpp"
+#include "buffer_chain.hpp"
+#include "compressor.hpp"
+#include "connection_limit.hpp"
+#include "errors.hpp"
+#include "file_cache.hpp"
+#include "http_parser.hpp"
+#include "metrics.hpp"
+#include "response_cache.hpp"
+#include "router.hpp"
+#include "send_scheduler.hpp"
+#include "settings.hpp"
+#include "timer_wheel.hpp"
+#include "tls.hpp"
+#include "token_bucket.hpp"
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <string>
+#include <array>
+#include <charconv>
+#include <random>
+#include <vector>
+#include <sstream>
+#include <boost/asio.hpp>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+
+namespace webServer {
+    using boost::asio::ip::tcp;
+
+    /*
+     * State of one client connection and everything needed to answer its
+     * requests: parsing, routing, building the response into chain_ and
+     * writing it out. It doesn't do any asynchronous work itself; the
+     * session engines (callbacks in server.hpp, coroutines in
+     * coro_session.hpp, io_uring in uring_session.hpp) drive it.
+     */
+    class connection {
+    protected:
+        /* The request header is read into one buffer and parsed in place,
+         * request_ only holds slices of readBuf_.
+         */
+        std::array<char, 16384> readBuf_;   // buff for request header, conf_->maxHeaderSize of it is used
+        std::size_t readLen_ = 0;           // bytes of readBuf_ in use
+        http::request_parser parser_;
+        http::request request_;
+        std::shared_ptr<const route_table> routes_; // routes at the time of the request
+        const route *route_ = nullptr;      // the requested file, nullptr if there is none
+        bool notFound_ = false;             // the requested file couldn't be opened
+        std::string_view encoding_;         // Content-Encoding of file_, empty for identity
+        bool keepAlive_ = false;            // read the next request once this one is answered
+        std::size_t requests_ = 0;          // requests served on this connection
+        tcp::socket socket_;
+        std::shared_ptr<const settings> conf_;
+        timer_wheel &wheel_;                // deadlines of the connections of this thread
+        timer_wheel::entry deadline_{&connection::onDeadline, this};
+        /* What the connection waits for, and what deadline_ is for */
+        enum class phase {
+            none,
+            idle,       // a request, for conf_->idleTimeout
+            header,     // the rest of a request header, for conf_->headerTimeout
+            sending     // the client to read the response at conf_->minSendRate
+        } phase_ = phase::none;
+        std::uint64_t sentInWindow_ = 0;    // bytes sent since the send deadline was set
+        send_scheduler &scheduler_;         // turns of the sessions of this thread
+        send_scheduler::entry turn_;        // resumes the engine's write loop
+        token_bucket bandwidth_;            // conf_->connectionRate
+        buffer_chain chain_;                // everything not written to the socket yet
+        thread_metrics *stats_ = nullptr;   // metrics of the thread serving the connection
+        std::chrono::steady_clock::time_point requestTime_; // when the request being answered was parsed
+        bool firstByteSent_ = false;
+        unsigned status_ = 0;               // of the response being sent, 0 once it is logged
+        std::uint64_t responseBytes_ = 0;   // of the response written so far
+        access_record access_;              // the request being answered, when the access log is on
+
+        std::shared_ptr<const cached_file> file_;   // file being served, shared through the file_cache
+        std::shared_ptr<const cached_file> identity_;   // file_ before an encoding was picked, which dates the response
+        bool use_sendfile_ = false;                 // sendfile(2) or writes from the mapping
+        session_tls tls_;                           // set up by engines that serve TLS
+        std::string record_;                        // the bytes of the TLS record being written
+        static constexpr std::size_t maxRecord = 16384;
+
+        /* A range of the file to send, preceded by its multipart header if there is one */
+        struct body_part {
+            std::size_t prefixBegin;    // the multipart header is prefixes_[prefixBegin, +prefixLength)
+            std::size_t prefixLength;
+            std::size_t offset;
+            std::size_t length;
+        };
+        // The response header and the multipart headers are built in these,
+        // they keep their capacity from one response to the next
+        std::string header_;
+        std::string prefixes_;
+        std::string_view canned_;                   // a whole response made once, sent instead of header_
+        std::shared_ptr<const cached_response> response_;  // the header template of a whole file, before header_
+        response_cache &responses_;                 // whole file responses of this thread
+        std::vector<body_part> parts_;              // body of the response being built
+        static constexpr std::size_t maxRanges = 16; // more ranges than this and the Range header is ignored
+        // File ranges up to this size are written from the mapping together with
+        // their header even with sendfile, so a small response is one syscall
+        static constexpr std::size_t smallBody = 64 * 1024;
+
+        static constexpr std::string_view badRequest =
+                "HTTP/1.1 400 Bad Request\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        static constexpr std::string_view headerTooLarge =
+                "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                "Content-Length: 0\r\nConnection: close\r\n\r\n";
+
+        /* @param: the io_context of the session, what continues its writes after a turn */
+        explicit connection(boost::asio::io_context &io_context, void (*resume)(void *) = nullptr)
+            : socket_(io_context), wheel_(boost::asio::use_service<timer_wheel>(io_context)),
+              scheduler_(boost::asio::use_service<send_scheduler>(io_context)),
+              turn_(resume, this),
+              responses_(boost::asio::use_service<response_cache>(io_context))
+        {}
+
+        ~connection()
+        {
+            wheel_.cancel(deadline_);
+        }
+
+        /*
+         * Checks whether the client requested for any range
+         * as specified in HTTP/1.1
+         * @param: None
+         * @return: the value of the 'Range' header, empty if there is none
+         */
+        std::string_view headerContainsRange() const {
+            return request_.find("Range");
+        }
+
+        /*
+         * Boundary separating the parts of multipart/byteranges bodies,
+         * chosen once per process
+         */
+        static const std::string &boundary()
+        {
+            static const std::string b = [] {
+                std::random_device rd;
+                std::stringstream ss;
+                ss << std::hex << rd() << rd();
+                return ss.str();
+            }();
+            return b;
+        }
+
+        static void appendNumber(std::string &out, std::size_t n)
+        {
+            char digits[20];
+            out.append(digits, std::to_chars(digits, digits + sizeof(digits), n).ptr);
+        }
+
+        static void appendContentRange(std::string &out, const http::byte_range &range, std::size_t size)
+        {
+            out += "Content-Range: bytes ";
+            appendNumber(out, range.first);
+            out += '-';
+            appendNumber(out, range.last);
+            out += '/';
+            appendNumber(out, size);
+            out += "\r\n";
+        }
+
+        /*
+         * Builds the response header to be sent in header_ and lists
+         * the ranges of the file that make up the body in parts_
+         * @param: None
+         * @return: None
+         */
+        void buildResponseHeader()
+        {
+            header_.clear();
+            prefixes_.clear();
+            if (logging(log_level::debug)) {
+                for (std::size_t i = 0; i < request_.headerCount; ++i) {
+                    std::clog << request_.headers[i].name << ": " << request_.headers[i].value << '\n';
+                }
+            }
+            const std::string_view connection = keepAlive_ ? "keep-alive" : "close";
+            if (!isFileRequested()) {
+                stats_->error(error_kind::not_found);
+                status_ = 404;
+                canned_ = notFoundResponse(keepAlive_);
+                return;
+            }
+            std::size_t size = getFileSize();
+            if (http::hasQueryParameter(request_.url, "manifest")) {
+                buildManifest(connection);
+                return;
+            }
+            auto range = headerContainsRange();
+            if (!range.empty() && !ifRangeMatches()) {
+                range = {};     // the client's part is of another version, send all of this one
+            }
+            if (range.empty()) {
+                size = selectEncoding();
+            }
+            char etag[19];
+            std::uint64_t digest;
+            std::string_view tag = file_->digest(digest) ? formatETag(etag, digest) : std::string_view{};
+            if (notModified(tag)) {
+                status_ = 304;
+                header_ += "HTTP/1.1 304 Not Modified\r\n";
+                appendValidators(header_, tag);
+                header_ += "Connection: ";
+                header_ += connection;
+                header_ += "\r\n";
+                if (varies()) {
+                    header_ += "Vary: Accept-Encoding\r\n";
+                }
+                header_ += "\r\n";
+                return;
+            }
+            http::byte_range ranges[maxRanges];
+            std::size_t count = 0;
+            auto result = http::parseRanges(range, size, ranges, maxRanges, count);
+
+            if (result == http::range_result::unsatisfiable) {
+                stats_->error(error_kind::range_not_satisfiable);
+                status_ = 416;
+                header_ += "HTTP/1.1 416 Range Not Satisfiable\r\n";
+                header_ += "Content-Range: bytes */";
+                appendNumber(header_, size);
+                header_ += "\r\nConnection: ";
+                header_ += connection;
+                header_ += "\r\nContent-Length: 0\r\n\r\n";
+                return;
+            }
+            if (result == http::range_result::none) {
+                //Send the whole file to the client, the header is made once per file
+                status_ = 200;
+                response_ = wholeFile(tag);
+                header_ += "Connection: ";
+                header_ += connection;
+                header_ += "\r\n\r\n";
+                parts_.push_back({0, 0, 0, size});
+                if (request_.method == "HEAD") {
+                    parts_.clear();
+                }
+                return;
+            }
+            status_ = 206;
+            header_ += "HTTP/1.1 206 Partial Content\r\n";
+            header_ += "Accept-Ranges: bytes\r\n";
+            appendValidators(header_, tag);
+            header_ += "Connection: ";
+            header_ += connection;
+            header_ += "\r\n";
+            if (varies()) {
+                header_ += "Vary: Accept-Encoding\r\n";
+            }
+            if (count == 1) {
+                header_ += "Content-Type: ";
+                header_ += route_->contentType;
+                header_ += "\r\n";
+                appendContentRange(header_, ranges[0], size);
+                header_ += "Content-Length: ";
+                appendNumber(header_, ranges[0].length());
+                header_ += "\r\n\r\n";
+                parts_.push_back({0, 0, ranges[0].first, ranges[0].length()});
+                prefetchAfter(ranges[0]);
+            } else {
+                // Every range gets its own part header, the file data in
+                // between is streamed from the file like any other body
+                std::size_t length = 0;
+                for (std::size_t i = 0; i < count; ++i) {
+                    std::size_t begin = prefixes_.size();
+                    prefixes_ += "\r\n--";
+                    prefixes_ += boundary();
+                    prefixes_ += "\r\nContent-Type: ";
+                    prefixes_ += route_->contentType;
+                    prefixes_ += "\r\n";
+                    appendContentRange(prefixes_, ranges[i], size);
+                    prefixes_ += "\r\n";
+                    parts_.push_back({begin, prefixes_.size() - begin, ranges[i].first, ranges[i].length()});
+                    length += parts_.back().prefixLength + ranges[i].length();
+                }
+                std::size_t begin = prefixes_.size();
+                prefixes_ += "\r\n--";
+                prefixes_ += boundary();
+                prefixes_ += "--\r\n";
+                parts_.push_back({begin, prefixes_.size() - begin, 0, 0});
+                length += parts_.back().prefixLength;
+                header_ += "Content-Type: multipart/byteranges; boundary=";
+                header_ += boundary();
+                header_ += "\r\nContent-Length: ";
+                appendNumber(header_, length);
+                header_ += "\r\n\r\n";
+            }
+            if (request_.method == "HEAD") {
+                parts_.clear();
+            }
+        }
+
+        /*
+         * Builds the download manifest of the file in file_: its size and
+         * validators and the segments to fetch over parallel connections,
+         * each with the XXH64 of its bytes. The first segments are read
+         * into the page cache meanwhile. While the file is still being
+         * hashed the answer is 503 with Retry-After.
+         * @param: value of the Connection header
+         * @return: None
+         */
+        void buildManifest(std::string_view connection)
+        {
+            auto segments = file_->segments();
+            std::uint64_t digest;
+            if (segments == nullptr || !file_->digest(digest)) {
+                status_ = 503;
+                header_ += "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nConnection: ";
+                header_ += connection;
+                header_ += "\r\nContent-Length: 0\r\n\r\n";
+                return;
+            }
+            const std::size_t size = file_->size();
+            const std::size_t segment = digest_index::segmentSize(size);
+            file_->prefetch(0, segment * conf_->prefetchSegments);
+            char etag[19];
+            prefixes_ += "{\"url\":\"";
+            appendJsonString(prefixes_, request_.url.substr(0, request_.url.find('?')));
+            prefixes_ += "\",\"size\":";
+            appendNumber(prefixes_, size);
+            prefixes_ += ",\"etag\":\"";
+            appendJsonString(prefixes_, formatETag(etag, digest));
+            prefixes_ += "\",\"last_modified\":\"";
+            prefixes_ += file_->lastModified();
+            prefixes_ += "\",\"checksum\":\"xxh64\",\"segment_size\":";
+            appendNumber(prefixes_, segment);
+            prefixes_ += ",\"segments\":[";
+            for (std::size_t i = 0; i < segments->size(); ++i) {
+                std::size_t offset = i * segment;
+                prefixes_ += i == 0 ? "\n" : ",\n";
+                prefixes_ += "{\"offset\":";
+                appendNumber(prefixes_, offset);
+                prefixes_ += ",\"length\":";
+                appendNumber(prefixes_, std::min(segment, size - offset));
+                prefixes_ += ",\"xxh64\":\"";
+                // The quoted tag is the digest in hex
+                prefixes_ += formatETag(etag, (*segments)[i]).substr(1, 16);
+                prefixes_ += "\"}";
+            }
+            prefixes_ += "]}\n";
+            status_ = 200;
+            header_ += "HTTP/1.1 200 OK\r\n";
+            header_ += "Content-Type: application/json\r\n";
+            header_ += "Cache-Control: no-cache\r\n";
+            header_ += "Connection: ";
+            header_ += connection;
+            header_ += "\r\nContent-Length: ";
+            appendNumber(header_, prefixes_.size());
+            header_ += "\r\n\r\n";
+            parts_.push_back({0, prefixes_.size(), 0, 0});
+            if (request_.method == "HEAD") {
+                parts_.clear();
+            }
+        }
+
+        /* Appends text to a JSON string, escaping what JSON requires */
+        static void appendJsonString(std::string &out, std::string_view text)
+        {
+            for (char c : text) {
+                if (c == '"' || c == '\\') {
+                    out += '\\';
+                    out += c;
+                } else if (static_cast<unsigned char>(c) < 0x20) {
+                    char escaped[8];
+                    std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                    out += escaped;
+                } else {
+                    out += c;
+                }
+            }
+        }
+
+        /*
+         * When a range is a segment of the manifest, starts reading the
+         * conf_->prefetchSegments segments after it into the page cache,
+         * so the connections fetching those find them there
+         * @param: the range requested
+         * @return: None
+         */
+        void prefetchAfter(const http::byte_range &range)
+        {
+            if (conf_->prefetchSegments == 0) {
+                return;
+            }
+            std::size_t segment = digest_index::segmentSize(file_->size());
+            if (range.first % segment != 0) {
+                return;
+            }
+            file_->prefetch(range.last + 1, segment * conf_->prefetchSegments);
+        }
+
+        /*
+         * The 404 response, made once for each value of Connection
+         * @param: whether the connection is kept open
+         * @return: the whole response
+         */
+        static std::string_view notFoundResponse(bool keepAlive)
+        {
+            static const auto make = [](std::string_view connection) {
+                constexpr std::string_view html =
+                        "<html><body><h1>404 Not Found</h1><p>There's nothing here.</p></body></html>";
+                std::string response = "HTTP/1.1 404 Not Found\r\nContent-Type: text/html\r\nConnection: ";
+                response += connection;
+                response += "\r\nContent-Length: ";
+                appendNumber(response, html.size());
+                response += "\r\n\r\n";
+                response += html;
+                return response;
+            };
+            static const std::string keepOpen = make("keep-alive"), close = make("close");
+            return keepAlive ? keepOpen : close;
+        }
+
+        /* @return: whether the response depends on Accept-Encoding */
+        bool varies() const
+        {
+            return route_->compressible || !route_->gzip.empty() || !route_->zstd.empty();
+        }
+
+        /*
+         * Looks up the 200 response for the file in file_, making it if
+         * there is none or the one there was made from something else.
+         * Small files are kept whole.
+         * @param: entity tag of file_, empty while it is being hashed
+         * @return: the response, its header lacks Connection
+         */
+        std::shared_ptr<const cached_response> wholeFile(std::string_view etag)
+        {
+            bool vary = varies();
+            auto cached = responses_.find(file_->path());
+            if (cached && cached->file.lock() == file_ && cached->modified == identity_->mtime()
+                    && cached->tagged == !etag.empty() && cached->vary == vary
+                    && cached->contentType == route_->contentType && cached->cacheControl == conf_->cacheControl) {
+                return cached;
+            }
+            auto response = std::make_shared<cached_response>();
+            response->file = file_;
+            response->modified = identity_->mtime();
+            response->contentType = route_->contentType;
+            response->cacheControl = conf_->cacheControl;
+            response->vary = vary;
+            response->tagged = !etag.empty();
+            std::string header = "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n";
+            appendValidators(header, etag);
+            if (vary) {
+                header += "Vary: Accept-Encoding\r\n";
+            }
+            header += "Content-Type: ";
+            header += route_->contentType;
+            header += "\r\n";
+            if (!encoding_.empty()) {
+                header += "Content-Encoding: ";
+                header += encoding_;
+                header += "\r\n";
+            }
+            header += "Content-Length: ";
+            appendNumber(header, file_->size());
+            header += "\r\n";
+            response->header = std::make_shared<const std::string>(std::move(header));
+            if (file_->size() <= conf_->responseCacheObject) {
+                response->body = cached_response::load(*file_);
+            }
+            responses_.insert(file_->path(), response, conf_->responseCacheSize);
+            return response;
+        }
+
+        /*
+         * Formats the strong entity tag of a file, its quoted digest
+         * @param: where to format it, the digest
+         * @return: the tag, a view of out
+         */
+        static std::string_view formatETag(char (&out)[19], std::uint64_t digest)
+        {
+            static constexpr char hex[] = "0123456789abcdef";
+            out[0] = '"';
+            for (int i = 0; i < 16; ++i) {
+                out[16 - i] = hex[(digest >> (4 * i)) & 0xf];
+            }
+            out[17] = '"';
+            return {out, 18};
+        }
+
+        /*
+         * Adds ETag, Last-Modified and Cache-Control for the file in file_.
+         * The date is the identity file's, a compressed copy is remade
+         * whenever the compressor likes without the file changing.
+         */
+        void appendValidators(std::string &out, std::string_view etag) const
+        {
+            if (!etag.empty()) {
+                out += "ETag: ";
+                out += etag;
+                out += "\r\n";
+            }
+            out += "Last-Modified: ";
+            out += identity_->lastModified();
+            out += "\r\n";
+            if (!conf_->cacheControl.empty()) {
+                out += "Cache-Control: ";
+                out += conf_->cacheControl;
+                out += "\r\n";
+            }
+        }
+
+        /*
+         * Evaluates If-None-Match, or If-Modified-Since without it, as in
+         * RFC 9110 section 13.2.2. Only metadata is looked at, never the file.
+         * @param: entity tag of file_, empty while it is being hashed
+         * @return: true if the client's copy is current and a 304 is the answer
+         */
+        bool notModified(std::string_view etag) const
+        {
+            if (request_.method != "GET" && request_.method != "HEAD") {
+                return false;
+            }
+            auto noneMatch = request_.find("If-None-Match");
+            if (!noneMatch.empty()) {
+                return http::etagMatches(noneMatch, etag, true);
+            }
+            std::time_t since;
+            auto modifiedSince = request_.find("If-Modified-Since");
+            return !modifiedSince.empty() && http::parseDate(modifiedSince, since) && identity_->mtime() <= since;
+        }
+
+        /*
+         * Evaluates If-Range against the identity file in file_. An entity
+         * tag must match strongly and a date must be the Last-Modified date.
+         * @param: None
+         * @return: true if the Range header applies
+         */
+        bool ifRangeMatches() const
+        {
+            auto ifRange = request_.find("If-Range");
+            if (ifRange.empty()) {
+                return true;
+            }
+            if (ifRange.front() == '"' || ifRange.substr(0, 2) == "W/") {
+                char etag[19];
+                std::uint64_t digest;
+                return file_->digest(digest) && http::etagMatches(ifRange, formatETag(etag, digest), false);
+            }
+            std::time_t date;
+            return http::parseDate(ifRange, date) && date == file_->mtime();
+        }
+
+        /*
+         * Gets the filesize of the file you are sending
+         * The file is looked up in the file_cache and kept for sendData.
+         * @param: None
+         * @return: the size of the file
+         */
+        std::size_t getFileSize() {
+            if (!file_) {
+                file_ = file_cache::instance().get(route_->path);
+                if (!file_) {
+                    throw FileNotFound {"Served file can't be opened", route_->path};
+                }
+                identity_ = file_;
+            }
+            return file_->size();
+        }
+
+        /*
+         * Picks the representation of the file to send from Accept-Encoding:
+         * a precompressed .zst or .gz next to the file, or the gzip copy
+         * made by the compressor, which is queued on first use. Ranges are
+         * always served from the identity file, so this is only used for
+         * requests without a Range header.
+         * @param: None
+         * @return: the size of the representation that will be sent
+         */
+        std::size_t selectEncoding()
+        {
+            auto accept = request_.find("Accept-Encoding");
+            if (accept.empty()) {
+                return file_->size();
+            }
+            // A precompressed file older than the file it was made from is stale
+            auto sibling = [this](const std::string &path) {
+                auto copy = file_cache::instance().get(path);
+                return copy && copy->mtime() >= file_->mtime() ? copy : nullptr;
+            };
+            double zstd = route_->zstd.empty() ? 0 : http::encodingQuality(accept, "zstd");
+            double gzip = http::encodingQuality(accept, "gzip");
+            if (zstd > 0 && zstd >= gzip) {
+                if (auto copy = sibling(route_->zstd)) {
+                    file_ = std::move(copy);
+                    encoding_ = "zstd";
+                    return file_->size();
+                }
+            }
+            if (gzip > 0) {
+                std::shared_ptr<const cached_file> copy;
+                if (!route_->gzip.empty()) {
+                    copy = sibling(route_->gzip);
+                } else if (route_->compressible) {
+                    if (auto compressed = compressor::instance().find(file_)) {
+                        copy = file_cache::instance().get(compressed->path);
+                    }
+                }
+                if (copy) {
+                    file_ = std::move(copy);
+                    encoding_ = "gzip";
+                }
+            }
+            return file_->size();
+        }
+
+        /*
+         * Queues the response to the request in request_: the header
+         * and the body behind it
+         * @param: None
+         * @return: None
+         */
+        void prepareResponse()
+        {
+            startResponse();
+            if (!conf_->metricsPath.empty()
+                    && request_.url.substr(0, request_.url.find('?')) == conf_->metricsPath) {
+                prepareMetrics();
+                return;
+            }
+            resolveRoute();
+            try {
+                buildResponseHeader();
+            }
+            catch (FileNotFound &e) {
+                notFound_ = true; // Since we couldn't open the file. Send 404 error.
+                parts_.clear();
+                buildResponseHeader();
+            }
+            if (response_) {
+                chain_.push(response_->header);
+            }
+            chain_.push(canned_);
+            chain_.push(header_);
+            if (!parts_.empty()) {
+                use_sendfile_ = conf_->sendfile || !file_->data();
+            }
+            const std::string_view prefixes = prefixes_;
+            for (auto &part : parts_) {
+                chain_.push(prefixes.substr(part.prefixBegin, part.prefixLength));
+                if (response_ && response_->body) {
+                    chain_.push(response_->body);
+                } else {
+                    chain_.push(file_, part.offset, part.length);
+                }
+            }
+            parts_.clear();
+            response_.reset();
+            canned_ = {};
+        }
+
+        /*
+         * Queues the metrics of every thread in the Prometheus text format
+         * @param: None
+         * @return: None
+         */
+        void prepareMetrics()
+        {
+            prefixes_.clear();
+            metrics::instance().render(prefixes_);
+            status_ = 200;
+            header_.clear();
+            header_ += "HTTP/1.1 200 OK\r\n";
+            header_ += "Content-Type: text/plain; version=0.0.4\r\n";
+            header_ += "Cache-Control: no-store\r\n";
+            header_ += "Connection: ";
+            header_ += keepAlive_ ? "keep-alive" : "close";
+            header_ += "\r\nContent-Length: ";
+            appendNumber(header_, prefixes_.size());
+            header_ += "\r\n\r\n";
+            chain_.push(header_);
+            if (request_.method != "HEAD") {
+                chain_.push(prefixes_);
+            }
+        }
+
+        /*
+         * Queues one of the canned error responses, after which the
+         * connection is closed
+         * @param: the complete response, what went wrong
+         * @return: None
+         */
+        void prepareError(std::string_view response, error_kind kind)
+        {
+            startResponse();
+            stats_->error(kind);
+            std::from_chars(response.data() + 9, response.data() + 12, status_);
+            keepAlive_ = false;
+            chain_.push(response);
+        }
+
+        void startResponse()
+        {
+            phase_ = phase::sending;
+            sentInWindow_ = 0;
+            wheel_.schedule(deadline_, conf_->sendTimeout);
+            requestTime_ = std::chrono::steady_clock::now();
+            firstByteSent_ = false;
+            responseBytes_ = 0;
+            if (access_log::instance().enabled()) {
+                access_record::copy(access_.method, access_.methodLength, request_.method);
+                access_record::copy(access_.url, access_.urlLength, request_.url);
+                access_record::copy(access_.range, access_.rangeLength, headerContainsRange());
+            }
+        }
+
+        /*
+         * Queues the access log record of the response, once
+         * @param: None
+         * @return: None
+         */
+        void logAccess()
+        {
+            if (status_ == 0 || !access_log::instance().enabled()) {
+                status_ = 0;
+                return;
+            }
+            access_.status = status_;
+            access_.bytes = responseBytes_;
+            access_.durationUs = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - requestTime_).count());
+            access_.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+            if (!access_log::instance().push(access_)) {
+                stats_->accessLogDropped.add();
+            }
+            status_ = 0;
+        }
+
+        /*
+         * Counts bytes of the response written to the socket
+         * @param: bytes written
+         * @return: None
+         */
+        void countSent(std::size_t n)
+        {
+            stats_->bytesSent.add(n);
+            responseBytes_ += n;
+            sentInWindow_ += n;
+            if (bandwidth_.limited() || totalBandwidth().limited()) {
+                auto now = token_bucket::clock::now();
+                bandwidth_.consume(n, now);
+                totalBandwidth().consume(n, now);
+            }
+            if (!firstByteSent_ && n > 0) {
+                firstByteSent_ = true;
+                stats_->firstByte.observe(std::chrono::steady_clock::now() - requestTime_);
+            }
+        }
+
+        /*
+         * Counts a response written in full
+         * @param: None
+         * @return: None
+         */
+        void countResponse()
+        {
+            stats_->requests.add();
+            stats_->response.observe(std::chrono::steady_clock::now() - requestTime_);
+            logAccess();
+            phase_ = phase::none;
+            wheel_.cancel(deadline_);
+        }
+
+        /*
+         * Closes the socket. It is shut down first because a read pending
+         * in an io_uring doesn't end when the descriptor is closed.
+         */
+        void closeSocket()
+        {
+            boost::system::error_code ignored;
+            socket_.shutdown(tcp::socket::shutdown_both, ignored);
+            socket_.close(ignored);
+        }
+
+        /*
+         * Drops whatever is left of the response and closes the connection
+         */
+        void abortResponse()
+        {
+            if (socket_.is_open()) {
+                stats_->error(error_kind::write_failed);    // not closed by a deadline
+            }
+            logAccess();    // with the bytes that made it
+            chain_.clear();
+            closeSocket();
+        }
+
+        /*
+         * Sends part of a file range with sendfile(2)
+         * @param: the range, most bytes to send, error
+         * @return: bytes sent
+         */
+        std::size_t sendFileRange(buffer_chain::entry &range, std::size_t limit,
+                                  boost::system::error_code &ec)
+        {
+            off_t offset = range.offset;
+            std::size_t count = std::min({range.length, conf_->chunkSize, limit});
+            for (;;) {
+                ssize_t n = ::sendfile(socket_.native_handle(), range.file->fd(), &offset, count);
+                if (n >= 0) {
+                    if (n == 0) {
+                        // The file shrunk underneath us
+                        ec = boost::asio::error::eof;
+                    }
+                    return n;
+                }
+                if (errno != EINTR) {
+                    ec.assign(errno, boost::asio::error::get_system_category());
+                    return 0;
+                }
+            }
+        }
+
+        /*
+         * Makes one non-blocking write of at most budget bytes from the
+         * front of the chain and consumes what was written. Memory buffers
+         * and file ranges read from the mapping are gathered into one
+         * writev, so a header and its body share a syscall; large file
+         * ranges go through sendfile(2) unless the configuration asks for
+         * mmap. The socket must be in non-blocking mode.
+         * @param: most bytes to write, error (would_block when the socket buffer is full)
+         * @return: bytes written
+         */
+        std::size_t writeSome(std::size_t budget, boost::system::error_code &ec)
+        {
+            const std::size_t window = conf_->chunkSize;
+            if (tls_.active() && !tls_.kernelSend()) {
+                return writeRecord(budget, ec);
+            }
+            auto viaSendfile = [this](const buffer_chain::entry &e) {
+                return use_sendfile_ && (e.length > smallBody || e.file->data() == nullptr);
+            };
+            for (;;) {
+                std::size_t n = 0;
+                auto bufs = chain_.gather(budget, window, window * conf_->inflight, viaSendfile);
+                if (bufs.begin() != bufs.end()) {
+                    n = socket_.write_some(bufs, ec);
+                } else {
+                    n = sendFileRange(chain_.front(), budget, ec);
+                    if ((ec == boost::asio::error::invalid_argument
+                            || ec == boost::asio::error::operation_not_supported)
+                            && chain_.front().file->data()) {
+                        // This file can't be sendfile'd, write it from the mapping
+                        use_sendfile_ = false;
+                        ec.clear();
+                        continue;
+                    }
+                }
+                if (!ec) {
+                    chain_.consume(n);
+                    countSent(n);
+                }
+                return n;
+            }
+        }
+
+        /*
+         * writeSome() for a TLS connection the kernel doesn't encrypt for:
+         * one record of at most budget bytes. A header and the start of
+         * its body are copied together into the record; file ranges are
+         * read with pread, never from the mapping, see cached_file.
+         * @param: most bytes to write, error (would_block until the socket is ready)
+         * @return: bytes written
+         */
+        std::size_t writeRecord(std::size_t budget, boost::system::error_code &ec)
+        {
+            // A write that had to wait is repeated as it was
+            if (tls_.pending() == 0) {
+                record_.clear();
+                if (!chain_.copy(record_, std::min(budget, maxRecord))) {
+                    ec = boost::asio::error::eof;   // the file shrunk underneath us
+                    return 0;
+                }
+            }
+            std::size_t n = tls_.write(record_.data(), record_.size(), ec);
+            if (!ec) {
+                chain_.consume(n);
+                countSent(n);
+            }
+            return n;
+        }
+
+        /*
+         * Cuts a write down to what the rate limits allow
+         * @param: most bytes the session would write now
+         * @return: bytes it may write, 0 when it has to throttle()
+         */
+        std::size_t allowance(std::size_t budget) const
+        {
+            if (!bandwidth_.limited() && !totalBandwidth().limited()) {
+                return budget;
+            }
+            auto now = token_bucket::clock::now();
+            return std::min<std::uint64_t>({budget, bandwidth_.available(now), totalBandwidth().available(now)});
+        }
+
+        /*
+         * Lets the other sessions of the thread write before the engine
+         * carries on with this response
+         * @param: what keeps the session alive meanwhile
+         * @return: None
+         */
+        void waitTurn(std::shared_ptr<void> self)
+        {
+            scheduler_.yield(turn_, std::move(self));
+        }
+
+        /*
+         * Carries on with the response once the rate limits allow it. The
+         * session sleeps until about 50 ms worth of bytes can be sent, so
+         * a slow rate doesn't turn into a syscall for every few bytes.
+         * @param: what keeps the session alive meanwhile
+         * @return: None
+         */
+        void throttle(std::shared_ptr<void> self)
+        {
+            auto now = token_bucket::clock::now();
+            auto worth = [this](std::size_t rate) {
+                return std::clamp<std::uint64_t>(rate / 20, 1, conf_->sendQuantum);
+            };
+            auto delay = std::max(bandwidth_.delay(worth(conf_->connectionRate), now),
+                                  totalBandwidth().delay(worth(conf_->totalRate), now));
+            scheduler_.sleep(turn_, std::move(self), delay);
+        }
+
+        /*
+         * Finds the file served at the requested url
+         * @param: None
+         * @return: None
+         */
+        void resolveRoute()
+        {
+            char path[1024];
+            auto normalized = normalizePath(request_.url, path, sizeof(path));
+            routes_ = router::instance().table();
+            route_ = normalized.empty() ? nullptr : routes_->find(normalized);
+        }
+
+        bool isFileRequested() const
+        {
+            return route_ != nullptr && !notFound_;
+        }
+
+        /*
+         * Decides whether the connection stays open after this request.
+         * HTTP/1.1 connections persist unless the client sends
+         * "Connection: close", HTTP/1.0 ones only with "Connection: keep-alive".
+         * @param: None
+         * @return: true to keep the connection open
+         */
+        bool wantsKeepAlive()
+        {
+            if (++requests_ >= conf_->maxRequests) {
+                return false;
+            }
+            auto connection = request_.find("Connection");
+            if (request_.version == "HTTP/1.0") {
+                return http::hasToken(connection, "keep-alive");
+            }
+            return !http::hasToken(connection, "close");
+        }
+
+        /*
+         * Forgets the request that has just been answered and moves the
+         * bytes read past it, a pipelined request, to the front of readBuf_
+         * @param: None
+         * @return: None
+         */
+        void nextRequest()
+        {
+            std::size_t consumed = parser_.consumed();
+            std::memmove(readBuf_.data(), readBuf_.data() + consumed, readLen_ - consumed);
+            readLen_ -= consumed;
+            resetRequest();
+        }
+
+        void resetRequest()
+        {
+            parser_.reset();
+            request_ = http::request{};
+            notFound_ = false;
+            encoding_ = {};
+            route_ = nullptr;
+            routes_.reset();
+            parts_.clear();
+            file_.reset();
+            identity_.reset();
+        }
+
+        /*
+         * Sets the deadline for the request to be read: conf_->idleTimeout
+         * for its first byte, then conf_->headerTimeout for the whole
+         * header. The header deadline isn't moved by further reads, so a
+         * client trickling in a header byte by byte is cut off as well.
+         * @param: None
+         * @return: None
+         */
+        void waitForRequest()
+        {
+            if (readLen_ == 0) {
+                phase_ = phase::idle;
+                wheel_.schedule(deadline_, conf_->idleTimeout);
+            } else if (phase_ != phase::header) {
+                phase_ = phase::header;
+                wheel_.schedule(deadline_, conf_->headerTimeout);
+            }
+        }
+
+        /*
+         * Parses the request header read so far. A complete header longer
+         * than conf_->maxHeaderSize is reported as incomplete, so that
+         * headerTooLong() turns it down like one still arriving.
+         * @param: None
+         * @return: the result of the parser
+         */
+        http::parse_result parseRequest()
+        {
+            auto result = parser_.parse(readBuf_.data(), readLen_, request_);
+            if (result == http::parse_result::complete && parser_.consumed() > conf_->maxHeaderSize) {
+                return http::parse_result::incomplete;
+            }
+            return result;
+        }
+
+        /* @return: whether the request header being read is too long to be accepted */
+        bool headerTooLong() const
+        {
+            return readLen_ >= std::min(conf_->maxHeaderSize, readBuf_.size());
+        }
+
+        static void onDeadline(void *owner)
+        {
+            static_cast<connection *>(owner)->deadlinePassed();
+        }
+
+        /*
+         * Closes the connection when the deadline of its phase has passed.
+         * A response is given conf_->sendTimeout at a time; it carries on
+         * as long as the client read at least conf_->minSendRate meanwhile.
+         * The pending read or write of the session then fails and ends it.
+         */
+        void deadlinePassed()
+        {
+            if (!socket_.is_open()) {
+                return;
+            }
+            switch (phase_) {
+                case phase::none:
+                    return;
+                case phase::idle:
+                    stats_->error(error_kind::idle_timeout);
+                    break;
+                case phase::header:
+                    stats_->error(error_kind::header_timeout);
+                    break;
+                case phase::sending: {
+                    // A session held back by the scheduler or a rate limit isn't the client's fault
+                    auto seconds = std::chrono::duration_cast<std::chrono::seconds>(conf_->sendTimeout).count();
+                    auto rate = conf_->minSendRate;
+                    if (conf_->connectionRate != 0) {
+                        rate = std::min(rate, conf_->connectionRate);
+                    }
+                    if (turn_.waiting() || (sentInWindow_ > 0 && sentInWindow_ >= rate * seconds)) {
+                        sentInWindow_ = 0;
+                        wheel_.schedule(deadline_, conf_->sendTimeout);
+                        return;
+                    }
+                    stats_->error(error_kind::slow_client);
+                    break;
+                }
+            }
+            phase_ = phase::none;
+            closeSocket();
+        }
+
+        /*
+         * Takes over an accepted socket
+         * @param: the connected socket, settings for the connection
+         * @return: None
+         */
+        void accept(tcp::socket socket, std::shared_ptr<const settings> conf)
+        {
+            socket_ = std::move(socket);
+            conf_ = std::move(conf);
+            stats_ = &metrics::local();
+            stats_->accepted.add();
+            bandwidth_.configure(conf_->connectionRate, conf_->rateBurst);
+            access_.peerLength = 0;
+            if (logging(log_level::debug) || access_log::instance().enabled()) {
+                boost::system::error_code ec;
+                auto remote = socket_.remote_endpoint(ec);
+                if (!ec) {
+                    auto address = remote.address().to_string(ec);
+                    if (logging(log_level::debug)) {
+                        std::clog << "Client @" << address;
+                        std::clog << " with " << remote.port() << '\n';
+                    }
+                    if (remote.address().is_v6()) {
+                        address = '[' + address + ']';
+                    }
+                    address += ':';
+                    address += std::to_string(remote.port());
+                    access_record::copy(access_.peer, access_.peerLength, address);
+                }
+            }
+        }
+
+    public:
+        /*
+         * Brings the connection back to the state it was constructed in,
+         * so the session_pool can hand it to the next client. The buffers
+         * keep their memory.
+         * @param: None
+         * @return: None
+         */
+        void recycle()
+        {
+            if (stats_) {
+                stats_->closed.add();
+                stats_ = nullptr;
+                connection_limit::instance().release();
+            }
+            boost::system::error_code ignored;
+            socket_.close(ignored);
+            wheel_.cancel(deadline_);
+            phase_ = phase::none;
+            conf_.reset();
+            chain_.clear();
+            readLen_ = 0;
+            keepAlive_ = false;
+            requests_ = 0;
+            use_sendfile_ = false;
+            tls_.reset();
+            resetRequest();
+        }
+    };
+}
+#endif //LIB_CONNECTION_H
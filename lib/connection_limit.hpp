@@ -0,0 +1,110 @@
+#ifndef LIB_CONNECTION_LIMIT_H
+#define LIB_CONNECTION_LIMIT_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace webServer {
+
+    /*
+     * Cap on the connections open at once, shared by every thread.
+     * Acceptors take a slot before they accept and the connection gives
+     * it back when it is recycled. An acceptor that finds no free slot
+     * stops accepting, so new clients wait in the listen backlog instead
+     * of costing a socket and a session each, and it is resumed when a
+     * connection closes.
+     */
+    class connection_limit {
+    public:
+        static connection_limit &instance()
+        {
+            static connection_limit limit;
+            return limit;
+        }
+
+        /* @param: most connections open at once, 0 for no limit */
+        void configure(std::size_t max)
+        {
+            max_ = max;
+        }
+
+        bool limited() const
+        {
+            return max_ != 0;
+        }
+
+        std::size_t open() const
+        {
+            return open_.load(std::memory_order_relaxed);
+        }
+
+        /*
+         * Takes a slot for a connection about to be accepted
+         * @param: None
+         * @return: false when the limit is reached
+         */
+        bool tryAcquire()
+        {
+            const std::size_t max = max_;
+            std::size_t n = open_.load(std::memory_order_relaxed);
+            do {
+                if (max != 0 && n >= max) {
+                    return false;
+                }
+            } while (!open_.compare_exchange_weak(n, n + 1));
+            return true;
+        }
+
+        void release()
+        {
+            open_.fetch_sub(1);
+            if (waiting_.load() > 0) {
+                wakeAll();
+            }
+        }
+
+        /*
+         * Calls resume once a slot may have come free, which could be
+         * right away. It is called on the thread that released the slot,
+         * so it should only post to the waiting acceptor's io_context.
+         * @param: the function resuming the acceptor
+         * @return: None
+         */
+        void wait(std::function<void()> resume)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                waiters_.push_back(std::move(resume));
+                waiting_.fetch_add(1);
+            }
+            // A slot released since tryAcquire failed found no waiter to wake
+            if (open_.load() < max_) {
+                wakeAll();
+            }
+        }
+
+    private:
+        std::atomic<std::size_t> max_{0};
+        std::atomic<std::size_t> open_{0};
+        std::atomic<std::size_t> waiting_{0};
+        std::mutex mutex_;
+        std::vector<std::function<void()>> waiters_;
+
+        void wakeAll()
+        {
+            std::vector<std::function<void()>> waiters;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                waiters.swap(waiters_);
+                waiting_ = 0;
+            }
+            for (auto &resume : waiters) {
+                resume();
+            }
+        }
+    };
+}
+#endif //LIB_CONNECTION_LIMIT_H
@@ -0,0 +1,141 @@
+#ifndef LIB_CORO_SESSION_H
+#define LIB_CORO_SESSION_H
+
+#include "connection.hpp"
+#include <memory>
+#include <utility>
+#include <boost/asio.hpp>
+
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/detached.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+namespace webServer {
+
+    /*
+     * Session engine built on a C++20 coroutine. A connection is one
+     * linear loop of read, parse and send; the coroutine frame is
+     * allocated once per connection and holds the session alive. The
+     * session only ever runs on the thread of its io_context, so unlike
+     * the callback engine it does without a strand.
+     */
+    class coro_session : public connection, public std::enable_shared_from_this<coro_session> {
+        using error_code = boost::system::error_code;
+
+        /* Never expires; the send_scheduler cancels it to wake the coroutine for its turn */
+        boost::asio::steady_timer turnSignal_;
+
+        static void resume(void *owner)
+        {
+            static_cast<coro_session *>(static_cast<connection *>(owner))->turnSignal_.cancel();
+        }
+
+        /*
+         * Waits in the send_scheduler, for the next turn or for the rate
+         * limits to let the session write
+         * @param: true to sleep until the rate limits allow writing
+         */
+        boost::asio::awaitable<void> nextTurn(bool throttled)
+        {
+            turnSignal_.expires_at(boost::asio::steady_timer::time_point::max());
+            if (throttled) {
+                throttle(nullptr);
+            } else {
+                waitTurn(nullptr);
+            }
+            error_code ec;
+            co_await turnSignal_.async_wait(boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+        }
+
+        /*
+         * Serves requests until the client goes away, the connection
+         * times out or keep-alive ends
+         * @param: the session itself, which the coroutine frame keeps alive
+         * @return: None
+         */
+        boost::asio::awaitable<void> run([[maybe_unused]] std::shared_ptr<coro_session> self)
+        {
+            error_code ec;
+            for (;;) {
+                auto result = parseRequest();
+                while (result == http::parse_result::incomplete && !headerTooLong()) {
+                    waitForRequest();
+                    std::size_t n = co_await socket_.async_read_some(
+                            boost::asio::buffer(readBuf_.data() + readLen_, readBuf_.size() - readLen_),
+                            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                    if (ec) {
+                        co_return;
+                    }
+                    readLen_ += n;
+                    result = parseRequest();
+                }
+                switch (result) {
+                    case http::parse_result::complete:
+                        keepAlive_ = wantsKeepAlive();
+                        prepareResponse();
+                        break;
+                    case http::parse_result::incomplete:
+                        prepareError(headerTooLarge, error_kind::header_too_large);
+                        break;
+                    case http::parse_result::bad:
+                        prepareError(badRequest, error_kind::bad_request);
+                        break;
+                }
+
+                // Same write loop as session::flush, with the waits inline
+                if (!socket_.non_blocking()) {
+                    socket_.non_blocking(true);     // an ioctl, once per connection
+                }
+                std::size_t budget = conf_->sendQuantum;
+                while (!chain_.empty()) {
+                    if (budget == 0) {
+                        co_await nextTurn(false);
+                        budget = conf_->sendQuantum;
+                    }
+                    std::size_t allowed = allowance(budget);
+                    if (allowed == 0) {
+                        co_await nextTurn(true);
+                        continue;
+                    }
+                    std::size_t n = writeSome(allowed, ec);
+                    if (ec == boost::asio::error::would_block) {
+                        co_await socket_.async_wait(tcp::socket::wait_write,
+                                boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+                    }
+                    if (ec) {
+                        abortResponse();
+                        co_return;
+                    }
+                    budget -= std::min(n, budget);
+                }
+                countResponse();
+
+                if (!keepAlive_ || !socket_.is_open()) {
+                    socket_.shutdown(tcp::socket::shutdown_send, ec);
+                    co_return;
+                }
+                nextRequest();
+            }
+        }
+
+    public:
+        explicit coro_session(boost::asio::io_context &io_context)
+            : connection(io_context, &coro_session::resume), turnSignal_(io_context)
+        {}
+
+        /*
+         * Interface provided to accepted client
+         * @param: the connected socket, settings for the connection
+         * @return: None
+         */
+        void start(tcp::socket socket, std::shared_ptr<const settings> conf)
+        {
+            accept(std::move(socket), std::move(conf));
+            boost::asio::co_spawn(socket_.get_executor(), run(shared_from_this()), boost::asio::detached);
+        }
+    };
+}
+#endif // BOOST_ASIO_HAS_CO_AWAIT
+#endif //LIB_CORO_SESSION_H
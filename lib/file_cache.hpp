@@ -0,0 +1,617 @@
+#ifndef LIB_FILE_CACHE_H
+#define LIB_FILE_CACHE_H
+
+#include "http_parser.hpp"
+#include "xxhash.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace webServer {
+
+    /*
+     * A file opened once and shared by every session that serves it.
+     * Holds the descriptor (for sendfile), the size and modification time
+     * (for the response header) and a read only mapping of the whole file
+     * (for the mmap path). Everything is released with the last reference.
+     * The digest of the contents, the strong validator of the file, comes
+     * later from the digest_index.
+     *
+     * Served files may be truncated while they are mapped, and touching a
+     * page past the new end raises SIGBUS. So the mapping is only ever
+     * handed to the kernel, as a writev buffer: there a missing page fails
+     * the write with EFAULT instead. Code that needs the contents itself
+     * reads them with read(), which sees a shorter file as a short read.
+     */
+    class cached_file {
+    public:
+        cached_file(const cached_file &) = delete;
+        cached_file &operator=(const cached_file &) = delete;
+
+        ~cached_file()
+        {
+            if (data_ != nullptr) {
+                ::munmap(data_, size_);
+            }
+            ::close(fd_);
+        }
+
+        /*
+         * Opens and maps a file
+         * @param: path of the file
+         * @return: the file or nullptr if it can't be opened
+         */
+        static std::shared_ptr<const cached_file> open(const std::string &path)
+        {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) {
+                return nullptr;
+            }
+            struct stat st;
+            if (::fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+                ::close(fd);
+                return nullptr;
+            }
+            std::shared_ptr<cached_file> file(new cached_file(path, fd, st));
+            if (file->size_ > 0) {
+                void *addr = ::mmap(nullptr, file->size_, PROT_READ, MAP_SHARED, fd, 0);
+                if (addr != MAP_FAILED) {
+                    file->data_ = addr;
+                }
+            }
+            return file;
+        }
+
+        int fd() const { return fd_; }
+        std::size_t size() const { return size_; }
+        std::time_t mtime() const { return mtime_; }
+        const std::string &path() const { return path_; }
+        const std::string &lastModified() const { return lastModified_; }  // mtime as an HTTP date
+
+        /*
+         * @param: where to store the digest of the contents
+         * @return: false while the file is still being hashed
+         */
+        bool digest(std::uint64_t &out) const
+        {
+            if (!digested_.load(std::memory_order_acquire)) {
+                return false;
+            }
+            out = digest_;
+            return true;
+        }
+
+        /* @return: digests of the download segments, nullptr while the file is being hashed */
+        const std::vector<std::uint64_t> *segments() const
+        {
+            return digested_.load(std::memory_order_acquire) ? &segments_ : nullptr;
+        }
+
+        /*
+         * Starts reading [offset, offset + len) into the page cache
+         * without waiting for it, ahead of a client asking for it
+         * @param: offset and length of the range
+         * @return: None
+         */
+        void prefetch(std::size_t offset, std::size_t len) const
+        {
+            if (offset >= size_) {
+                return;
+            }
+            ::posix_fadvise(fd_, offset, std::min(len, size_ - offset), POSIX_FADV_WILLNEED);
+        }
+
+        /*
+         * Start of the whole file mapping, nullptr if the file is empty or
+         * can't be mapped. Only for buffers given to the kernel, never read
+         * it directly, see above.
+         */
+        const char *data() const { return static_cast<const char *>(data_); }
+
+        /*
+         * Reads [offset, offset + len) of the file with pread(2)
+         * @param: where to store the bytes, how many, offset in the file
+         * @return: false if the file ended before or can't be read
+         */
+        bool read(void *out, std::size_t len, std::size_t offset) const
+        {
+            auto *to = static_cast<char *>(out);
+            while (len > 0) {
+                ssize_t n = ::pread(fd_, to, len, offset);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0) {
+                    return false;
+                }
+                to += n;
+                offset += n;
+                len -= n;
+            }
+            return true;
+        }
+
+        /*
+         * Asks the kernel to read [offset, offset + len) of the mapping ahead
+         * @param: offset and length of the range
+         * @return: None
+         */
+        void willNeed(std::size_t offset, std::size_t len) const
+        {
+            if (data_ == nullptr || offset >= size_) {
+                return;
+            }
+            static const std::size_t page = ::sysconf(_SC_PAGESIZE);
+            std::size_t aligned = offset - offset % page;
+            len = std::min(len + (offset - aligned), size_ - aligned);
+            ::madvise(static_cast<char *>(data_) + aligned, len, MADV_WILLNEED);
+        }
+
+    private:
+        friend class digest_index;
+
+        cached_file(std::string path, int fd, const struct stat &st)
+            : path_(std::move(path)), fd_(fd), size_(st.st_size), mtime_(st.st_mtime),
+              mtimeNs_(st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec),
+              dev_(st.st_dev), ino_(st.st_ino), lastModified_(http::formatDate(st.st_mtime))
+        {}
+
+        std::string path_;
+        int fd_;
+        std::size_t size_;
+        std::time_t mtime_;
+        std::int64_t mtimeNs_;              // with dev_ and ino_, which version of the file this is
+        dev_t dev_;
+        ino_t ino_;
+        std::string lastModified_;
+        void *data_ = nullptr;
+        mutable std::uint64_t digest_ = 0;  // written once by the digest_index, before digested_
+        mutable std::vector<std::uint64_t> segments_;
+        mutable std::atomic<bool> digested_{false};
+
+        void setDigest(std::uint64_t digest, std::vector<std::uint64_t> segments) const
+        {
+            digest_ = digest;
+            segments_ = std::move(segments);
+            digested_.store(true, std::memory_order_release);
+        }
+    };
+
+    /*
+     * Digests of the served files, the source of their ETags. Hashing a
+     * multi-GB file takes seconds, so it is done once on a background
+     * thread and the result kept in an index file next to the file cache
+     * until the file changes: an entry only applies to the same device,
+     * inode, size and nanosecond modification time. Until a file has its
+     * digest it is served without an ETag.
+     *
+     * The same pass hashes every segment of the file on its own, for
+     * the download manifest, see segmentSize().
+     *
+     * Index lines are "digest device inode size mtime segments path",
+     * segments being the comma separated segment digests or "-".
+     */
+    class digest_index {
+    public:
+        static digest_index &instance()
+        {
+            static digest_index index;
+            return index;
+        }
+
+        digest_index(const digest_index &) = delete;
+        digest_index &operator=(const digest_index &) = delete;
+
+        ~digest_index()
+        {
+            stopping_.store(true, std::memory_order_relaxed);
+            worker_.join();
+        }
+
+        /*
+         * Loads the index file, in the background. Entries whose file
+         * changed since are dropped.
+         * @param: path of the index, empty to keep the digests in memory only
+         * @return: None
+         */
+        void configure(const std::string &path)
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (path == path_) {
+                    return;
+                }
+                path_ = path;
+            }
+            if (!path.empty()) {
+                boost::asio::post(worker_, [this, path] { load(path); });
+            }
+        }
+
+        /*
+         * Gives a newly opened file its digest, from the index if it has
+         * one for this version of the file, otherwise once it is hashed
+         * @param: the file
+         * @return: None
+         */
+        void lookup(const std::shared_ptr<const cached_file> &file)
+        {
+            if (known(*file)) {
+                return;
+            }
+            // Checked again on the worker, the index may be loading still
+            boost::asio::post(worker_, [this, file] {
+                if (!known(*file)) {
+                    hash(*file);
+                }
+            });
+        }
+
+        /*
+         * Size of the segments a file is downloaded in: a power of two of
+         * at least 1 MiB, so segments start on page and readahead
+         * boundaries, and large enough for at most 64 of them
+         * @param: size of the file
+         * @return: size of its segments, the last one may be shorter
+         */
+        static std::size_t segmentSize(std::size_t fileSize)
+        {
+            std::size_t segment = chunk;
+            while (segment * maxSegments < fileSize) {
+                segment *= 2;
+            }
+            return segment;
+        }
+
+    private:
+        struct entry {
+            std::uint64_t digest;
+            std::uint64_t dev;
+            std::uint64_t ino;
+            std::uint64_t size;
+            std::int64_t mtimeNs;
+            std::vector<std::uint64_t> segments;
+
+            bool matches(const cached_file &file) const
+            {
+                return dev == file.dev_ && ino == file.ino_ && size == file.size_ && mtimeNs == file.mtimeNs_;
+            }
+        };
+
+        static constexpr std::size_t chunk = 1 << 20;   // hashed between checks for shutdown
+        static constexpr std::size_t maxSegments = 64;
+
+        std::mutex mutex_;
+        std::string path_;
+        std::unordered_map<std::string, entry> entries_;
+        bool savePending_ = false;
+        std::atomic<bool> stopping_{false};
+        boost::asio::thread_pool worker_{1};
+
+        digest_index() = default;
+
+        bool known(const cached_file &file)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = entries_.find(file.path_);
+            if (found == entries_.end() || !found->second.matches(file)) {
+                return false;
+            }
+            file.setDigest(found->second.digest, found->second.segments);
+            return true;
+        }
+
+        /* Runs on the worker */
+        void hash(const cached_file &file)
+        {
+            xxh64 h;
+            xxh64 part;
+            std::vector<std::uint64_t> segments;
+            const std::size_t segment = segmentSize(file.size_);
+            std::vector<char> buffer(std::min(chunk, file.size_));
+            for (std::size_t offset = 0; offset < file.size_; offset += chunk) {
+                if (stopping_.load(std::memory_order_relaxed)) {
+                    return;
+                }
+                std::size_t len = std::min(chunk, file.size_ - offset);
+                if (!file.read(buffer.data(), len, offset)) {
+                    return;
+                }
+                h.update(buffer.data(), len);
+                part.update(buffer.data(), len);
+                // Segments are whole chunks, except at the end of the file
+                if ((offset + len) % segment == 0 || offset + len == file.size_) {
+                    segments.push_back(part.digest());
+                    part = xxh64();
+                }
+            }
+            // A file written to while it was hashed gets a digest once it settles
+            struct stat st;
+            if (::fstat(file.fd_, &st) == -1 || static_cast<std::size_t>(st.st_size) != file.size_
+                    || st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec != file.mtimeNs_) {
+                return;
+            }
+            std::uint64_t digest = h.digest();
+            file.setDigest(digest, segments);
+            std::lock_guard<std::mutex> lock(mutex_);
+            entries_[file.path_] = {digest, file.dev_, file.ino_, file.size_, file.mtimeNs_, std::move(segments)};
+            if (!path_.empty() && !savePending_) {
+                // Files opened together are hashed together, save them at once
+                savePending_ = true;
+                boost::asio::post(worker_, [this] { save(); });
+            }
+        }
+
+        /* Runs on the worker */
+        void load(const std::string &path)
+        {
+            std::ifstream in(path);
+            std::string line;
+            std::size_t dropped = 0;
+            while (std::getline(in, line)) {
+                std::istringstream fields(line);
+                entry e;
+                std::string segments;
+                std::string file;
+                fields >> std::hex >> e.digest >> std::dec >> e.dev >> e.ino >> e.size >> e.mtimeNs >> segments;
+                fields.get();
+                if (!fields || !std::getline(fields, file) || file.empty() || !parseSegments(segments, e)) {
+                    continue;
+                }
+                struct stat st;
+                if (::stat(file.c_str(), &st) == -1 || e.dev != st.st_dev || e.ino != st.st_ino
+                        || e.size != static_cast<std::uint64_t>(st.st_size)
+                        || e.mtimeNs != st.st_mtim.tv_sec * 1000000000ll + st.st_mtim.tv_nsec) {
+                    ++dropped;
+                    continue;
+                }
+                std::lock_guard<std::mutex> lock(mutex_);
+                entries_.emplace(file, e);
+            }
+            if (dropped > 0) {
+                save();
+            }
+        }
+
+        /* Reads the segments field of an index line, which must fit the size */
+        static bool parseSegments(const std::string &text, entry &e)
+        {
+            if (text != "-") {
+                std::istringstream list(text);
+                std::string digest;
+                while (std::getline(list, digest, ',')) {
+                    char *end = nullptr;
+                    e.segments.push_back(std::strtoull(digest.c_str(), &end, 16));
+                    if (digest.empty() || *end != '\0') {
+                        return false;
+                    }
+                }
+            }
+            std::size_t segment = segmentSize(e.size);
+            return e.segments.size() == (e.size + segment - 1) / segment;
+        }
+
+        /* Runs on the worker. Writes a new index and renames it over the old one. */
+        void save()
+        {
+            std::string path;
+            std::string text;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                savePending_ = false;
+                path = path_;
+                char line[128];
+                for (auto &[file, e] : entries_) {
+                    if (file.find('\n') != std::string::npos) {
+                        continue;
+                    }
+                    std::snprintf(line, sizeof(line), "%016llx %llu %llu %llu %lld ",
+                                  static_cast<unsigned long long>(e.digest), static_cast<unsigned long long>(e.dev),
+                                  static_cast<unsigned long long>(e.ino), static_cast<unsigned long long>(e.size),
+                                  static_cast<long long>(e.mtimeNs));
+                    text += line;
+                    for (std::size_t i = 0; i < e.segments.size(); ++i) {
+                        std::snprintf(line, sizeof(line), "%s%016llx", i == 0 ? "" : ",",
+                                      static_cast<unsigned long long>(e.segments[i]));
+                        text += line;
+                    }
+                    text += e.segments.empty() ? "- " : " ";
+                    text += file;
+                    text += '\n';
+                }
+            }
+            if (path.empty()) {
+                return;
+            }
+            std::string tmp = path + ".tmp";
+            {
+                std::ofstream out(tmp, std::ios::trunc);
+                out << text;
+                if (!out.flush()) {
+                    std::cerr << "Can't write the digest index " << tmp << '\n';
+                    return;
+                }
+            }
+            if (::rename(tmp.c_str(), path.c_str()) == -1) {
+                std::cerr << "Can't replace the digest index " << path << ": " << std::strerror(errno) << '\n';
+            }
+        }
+    };
+
+    /*
+     * Process wide cache of open files keyed by path.
+     *
+     * Every thread keeps its own copy of the entries it has used, so a
+     * lookup on the hot path is a relaxed atomic load and a hash lookup
+     * without any lock. The shared table is only locked on a miss.
+     * inotify tells us when a cached file changes; the entry is then
+     * dropped and the generation bumped, which makes every thread throw
+     * away its copy on its next lookup. Sessions still sending the old
+     * file keep it alive through their reference.
+     */
+    class file_cache {
+    public:
+        static file_cache &instance()
+        {
+            static file_cache cache;
+            return cache;
+        }
+
+        /*
+         * Looks up an open file, opening it on first use
+         * @param: path of the file
+         * @return: the shared file or nullptr if it can't be opened
+         */
+        std::shared_ptr<const cached_file> get(const std::string &path)
+        {
+            thread_local local_table local;
+            auto generation = generation_.load(std::memory_order_acquire);
+            if (local.generation != generation) {
+                local.files.clear();
+                local.generation = generation;
+            }
+            auto found = local.files.find(path);
+            if (found != local.files.end()) {
+                return found->second;
+            }
+            auto file = getShared(path);
+            if (file) {
+                local.files.emplace(path, file);
+            }
+            return file;
+        }
+
+        /*
+         * Starts watching the cached files for changes. The inotify
+         * events are read asynchronously on the given io_context.
+         * @param: io_context that reads the events
+         * @return: None
+         */
+        void watch(boost::asio::io_context &io)
+        {
+            int fd = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (fd == -1) {
+                std::cerr << "inotify is not available, cached files won't be refreshed\n";
+                return;
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            inotify_ = std::make_unique<boost::asio::posix::stream_descriptor>(io, fd);
+            for (auto &entry : files_) {
+                addWatch(entry.first);
+            }
+            readEvents();
+        }
+
+        /*
+         * Drops a file from the cache. It is opened again on the next lookup.
+         * @param: path of the file
+         * @return: None
+         */
+        void invalidate(const std::string &path)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            files_.erase(path);
+            generation_.fetch_add(1, std::memory_order_release);
+        }
+
+    private:
+        struct local_table {
+            std::uint64_t generation = 0;
+            std::unordered_map<std::string, std::shared_ptr<const cached_file>> files;
+        };
+
+        static constexpr std::uint32_t watchMask =
+            IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF;
+
+        std::mutex mutex_;
+        std::unordered_map<std::string, std::shared_ptr<const cached_file>> files_;
+        std::unordered_map<int, std::string> watches_;      // inotify watch descriptor to path
+        std::atomic<std::uint64_t> generation_{1};
+        std::unique_ptr<boost::asio::posix::stream_descriptor> inotify_;
+        char events_[4096] __attribute__((aligned(alignof(struct inotify_event))));
+
+        file_cache() = default;
+
+        std::shared_ptr<const cached_file> getShared(const std::string &path)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto found = files_.find(path);
+            if (found != files_.end()) {
+                return found->second;
+            }
+            auto file = cached_file::open(path);
+            if (file) {
+                files_.emplace(path, file);
+                addWatch(path);
+                digest_index::instance().lookup(file);
+            }
+            return file;
+        }
+
+        /* Must be called with mutex_ held */
+        void addWatch(const std::string &path)
+        {
+            if (!inotify_) {
+                return;
+            }
+            int wd = ::inotify_add_watch(inotify_->native_handle(), path.c_str(), watchMask);
+            if (wd != -1) {
+                watches_[wd] = path;
+            }
+        }
+
+        void readEvents()
+        {
+            inotify_->async_read_some(boost::asio::buffer(events_),
+                    [this](const boost::system::error_code &ec, std::size_t len) {
+                        if (ec) {
+                            return;
+                        }
+                        onEvents(len);
+                        readEvents();
+                    });
+        }
+
+        void onEvents(std::size_t len)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            for (std::size_t i = 0; i < len; ) {
+                auto *event = reinterpret_cast<const struct inotify_event *>(events_ + i);
+                i += sizeof(struct inotify_event) + event->len;
+                auto watched = watches_.find(event->wd);
+                if (watched == watches_.end()) {
+                    continue;
+                }
+                files_.erase(watched->second);
+                if (event->mask & IN_IGNORED) {
+                    watches_.erase(watched);
+                } else {
+                    // The path is watched again when it is opened next time
+                    ::inotify_rm_watch(inotify_->native_handle(), event->wd);
+                }
+            }
+            generation_.fetch_add(1, std::memory_order_release);
+        }
+    };
+}
+#endif //LIB_FILE_CACHE_H
@@ -0,0 +1,130 @@
+#ifndef LIB_HANDLER_ALLOC_H
+#define LIB_HANDLER_ALLOC_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <boost/asio/associated_allocator.hpp>
+
+namespace webServer {
+
+    /*
+     * Memory for the asynchronous operation a session has in flight.
+     * A session never has more than one read or one write outstanding,
+     * so each kind gets one block that asio reuses for every operation
+     * instead of going to the heap. Larger or overlapping requests fall
+     * back to operator new.
+     */
+    class handler_memory {
+    public:
+        handler_memory() = default;
+        handler_memory(const handler_memory &) = delete;
+        handler_memory &operator=(const handler_memory &) = delete;
+
+        void *allocate(std::size_t size)
+        {
+            if (!inUse_ && size <= sizeof(storage_)) {
+                inUse_ = true;
+                return &storage_;
+            }
+            return ::operator new(size);
+        }
+
+        void deallocate(void *pointer)
+        {
+            if (pointer == &storage_) {
+                inUse_ = false;
+            } else {
+                ::operator delete(pointer);
+            }
+        }
+
+    private:
+        typename std::aligned_storage<512, alignof(std::max_align_t)>::type storage_;
+        bool inUse_ = false;
+    };
+
+    /*
+     * Allocator that asio finds through associated_allocator and uses
+     * for the operation state of a handler.
+     */
+    template <typename T>
+    class handler_allocator {
+    public:
+        using value_type = T;
+
+        explicit handler_allocator(handler_memory &memory)
+            : memory_(memory)
+        {}
+
+        template <typename U>
+        handler_allocator(const handler_allocator<U> &other) noexcept
+            : memory_(other.memory_)
+        {}
+
+        T *allocate(std::size_t n) const
+        {
+            return static_cast<T *>(memory_.allocate(sizeof(T) * n));
+        }
+
+        void deallocate(T *pointer, std::size_t) const
+        {
+            memory_.deallocate(pointer);
+        }
+
+        bool operator==(const handler_allocator &other) const noexcept
+        {
+            return &memory_ == &other.memory_;
+        }
+
+        bool operator!=(const handler_allocator &other) const noexcept
+        {
+            return &memory_ != &other.memory_;
+        }
+
+    private:
+        template <typename> friend class handler_allocator;
+        handler_memory &memory_;
+    };
+
+    /*
+     * Wraps a completion handler so its operation is allocated from a
+     * handler_memory. The memory must outlive the operation, which holds
+     * when the handler keeps its session alive.
+     */
+    template <typename Handler>
+    class custom_alloc_handler {
+    public:
+        using allocator_type = handler_allocator<Handler>;
+
+        custom_alloc_handler(handler_memory &memory, Handler handler)
+            : memory_(memory), handler_(std::move(handler))
+        {}
+
+        allocator_type get_allocator() const noexcept
+        {
+            return allocator_type(memory_);
+        }
+
+        template <typename... Args>
+        void operator()(Args &&... args)
+        {
+            handler_(std::forward<Args>(args)...);
+        }
+
+    private:
+        handler_memory &memory_;
+        Handler handler_;
+    };
+
+    template <typename Handler>
+    inline custom_alloc_handler<typename std::decay<Handler>::type>
+    makeCustomAllocHandler(handler_memory &memory, Handler &&handler)
+    {
+        return custom_alloc_handler<typename std::decay<Handler>::type>(
+                memory, std::forward<Handler>(handler));
+    }
+}
+#endif //LIB_HANDLER_ALLOC_H
@@ -0,0 +1,534 @@
+#ifndef LIB_HTTP_PARSER_H
+#define LIB_HTTP_PARSER_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <string_view>
+#include <utility>
+
+namespace webServer {
+namespace http {
+
+    /*
+     * Compares two header names ignoring ASCII case
+     * @param: the names to compare
+     * @return: true if they are equal
+     */
+    inline bool iequals(std::string_view a, std::string_view b)
+    {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            char x = a[i], y = b[i];
+            if (x >= 'A' && x <= 'Z') x += 'a' - 'A';
+            if (y >= 'A' && y <= 'Z') y += 'a' - 'A';
+            if (x != y) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Checks whether a comma separated header value such as
+     * "keep-alive, Upgrade" contains a token, ignoring case
+     * @param: header value, token to look for
+     * @return: true if the token is in the list
+     */
+    inline bool hasToken(std::string_view value, std::string_view token)
+    {
+        while (!value.empty()) {
+            auto comma = value.find(',');
+            auto item = value.substr(0, comma);
+            while (!item.empty() && (item.front() == ' ' || item.front() == '\t')) {
+                item.remove_prefix(1);
+            }
+            while (!item.empty() && (item.back() == ' ' || item.back() == '\t')) {
+                item.remove_suffix(1);
+            }
+            if (iequals(item, token)) {
+                return true;
+            }
+            if (comma == std::string_view::npos) {
+                break;
+            }
+            value.remove_prefix(comma + 1);
+        }
+        return false;
+    }
+
+    /*
+     * Checks whether the query of a url such as "/a.iso?x=1&manifest"
+     * has a parameter, with or without a value
+     * @param: the request url, name of the parameter
+     * @return: true if it is there
+     */
+    inline bool hasQueryParameter(std::string_view url, std::string_view name)
+    {
+        auto question = url.find('?');
+        if (question == std::string_view::npos) {
+            return false;
+        }
+        auto query = url.substr(question + 1);
+        while (!query.empty()) {
+            auto amp = query.find('&');
+            auto item = query.substr(0, amp);
+            if (item.substr(0, item.find('=')) == name) {
+                return true;
+            }
+            if (amp == std::string_view::npos) {
+                break;
+            }
+            query.remove_prefix(amp + 1);
+        }
+        return false;
+    }
+
+    /*
+     * Reads the quality the client gives a content coding in an
+     * Accept-Encoding value such as "gzip;q=0.8, zstd, *;q=0"
+     * @param: Accept-Encoding value, content coding
+     * @return: the q value between 0 and 1, 0 if the coding isn't accepted
+     */
+    inline double encodingQuality(std::string_view value, std::string_view coding)
+    {
+        double wildcard = 0;
+        while (!value.empty()) {
+            auto comma = value.find(',');
+            auto item = value.substr(0, comma);
+            value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+            auto semi = item.find(';');
+            auto name = item.substr(0, semi);
+            while (!name.empty() && (name.front() == ' ' || name.front() == '\t')) {
+                name.remove_prefix(1);
+            }
+            while (!name.empty() && (name.back() == ' ' || name.back() == '\t')) {
+                name.remove_suffix(1);
+            }
+            double q = 1;
+            if (semi != std::string_view::npos) {
+                auto params = item.substr(semi + 1);
+                auto eq = params.find("q=");
+                if (eq != std::string_view::npos) {
+                    params.remove_prefix(eq + 2);
+                    q = 0;
+                    double scale = 1;
+                    bool fraction = false;
+                    for (char c : params) {
+                        if (c == '.') {
+                            fraction = true;
+                        } else if (c >= '0' && c <= '9') {
+                            if (fraction) {
+                                scale /= 10;
+                                q += (c - '0') * scale;
+                            } else {
+                                q = q * 10 + (c - '0');
+                            }
+                        } else {
+                            break;
+                        }
+                    }
+                }
+            }
+            if (iequals(name, coding)) {
+                return q;
+            }
+            if (name == "*") {
+                wildcard = q;
+            }
+        }
+        return wildcard;
+    }
+
+    struct header {
+        std::string_view name;
+        std::string_view value;
+    };
+
+    /*
+     * A parsed request. Every field is a slice of the connection's read
+     * buffer, so it is only valid until that buffer is reused.
+     */
+    struct request {
+        static constexpr std::size_t maxHeaders = 32;
+
+        std::string_view method;        // the current method: GET POST DELETE
+        std::string_view url;           // the url that's accessed
+        std::string_view version;       // HTTP/1.1 only
+        header headers[maxHeaders];
+        std::size_t headerCount = 0;
+
+        /*
+         * Looks up a header ignoring the case of its name
+         * @param: header name
+         * @return: the value or an empty view if the header is absent
+         */
+        std::string_view find(std::string_view name) const
+        {
+            for (std::size_t i = 0; i < headerCount; ++i) {
+                if (iequals(headers[i].name, name)) {
+                    return headers[i].value;
+                }
+            }
+            return {};
+        }
+    };
+
+    enum class parse_result { complete, incomplete, bad };
+
+    /*
+     * Incremental parser of a request header block. The caller keeps
+     * appending what it reads from the socket to one buffer and calls
+     * parse() with the whole buffer each time; the search for the blank
+     * line resumes where the previous call stopped. Once the block is
+     * complete it is split into the request line and headers in a single
+     * pass without copying or allocating.
+     */
+    class request_parser {
+    public:
+        /*
+         * @param: start and length of the buffered bytes, request to fill
+         * @return: complete when req holds the request, incomplete if more
+         *          bytes are needed, bad if the request is malformed
+         */
+        parse_result parse(const char *data, std::size_t len, request &req)
+        {
+            while (scanned_ < len) {
+                auto *nl = static_cast<const char *>(
+                        std::memchr(data + scanned_, '\n', len - scanned_));
+                if (nl == nullptr) {
+                    scanned_ = len;
+                    return parse_result::incomplete;
+                }
+                std::size_t lineEnd = nl - data;
+                std::size_t lineLen = lineEnd - lineStart_;
+                if (lineLen > 0 && data[lineEnd - 1] == '\r') {
+                    --lineLen;
+                }
+                scanned_ = lineEnd + 1;
+                if (lineLen == 0) {
+                    if (lineStart_ == begin_) {
+                        // Empty lines before the request line are ignored (RFC 7230 3.5)
+                        begin_ = lineStart_ = scanned_;
+                        continue;
+                    }
+                    consumed_ = scanned_;
+                    return split(data + begin_, lineStart_ - begin_, req)
+                        ? parse_result::complete : parse_result::bad;
+                }
+                lineStart_ = scanned_;
+            }
+            return parse_result::incomplete;
+        }
+
+        /* Bytes of the buffer taken by the parsed request, blank line included */
+        std::size_t consumed() const
+        {
+            return consumed_;
+        }
+
+        void reset()
+        {
+            scanned_ = lineStart_ = begin_ = consumed_ = 0;
+        }
+
+    private:
+        std::size_t scanned_ = 0;       // bytes already searched for a new line
+        std::size_t lineStart_ = 0;     // start of the line being searched
+        std::size_t begin_ = 0;         // start of the request line
+        std::size_t consumed_ = 0;
+
+        static std::string_view trim(std::string_view s)
+        {
+            while (!s.empty() && (s.front() == ' ' || s.front() == '\t')) {
+                s.remove_prefix(1);
+            }
+            while (!s.empty() && (s.back() == ' ' || s.back() == '\t' || s.back() == '\r')) {
+                s.remove_suffix(1);
+            }
+            return s;
+        }
+
+        /*
+         * Pops the next line of the header block
+         */
+        static std::string_view nextLine(std::string_view &block)
+        {
+            auto nl = block.find('\n');
+            auto line = block.substr(0, nl);
+            block.remove_prefix(nl == std::string_view::npos ? block.size() : nl + 1);
+            if (!line.empty() && line.back() == '\r') {
+                line.remove_suffix(1);
+            }
+            return line;
+        }
+
+        static bool split(const char *data, std::size_t len, request &req)
+        {
+            std::string_view block(data, len);
+            std::string_view line = nextLine(block);
+
+            auto sp1 = line.find(' ');
+            auto sp2 = line.find(' ', sp1 == std::string_view::npos ? sp1 : sp1 + 1);
+            if (sp1 == 0 || sp1 == std::string_view::npos || sp2 == std::string_view::npos
+                    || sp2 == sp1 + 1 || sp2 + 1 >= line.size()
+                    || line.find(' ', sp2 + 1) != std::string_view::npos) {
+                return false;
+            }
+            req.method = line.substr(0, sp1);
+            req.url = line.substr(sp1 + 1, sp2 - sp1 - 1);
+            req.version = line.substr(sp2 + 1);
+            req.headerCount = 0;
+
+            while (!block.empty()) {
+                line = nextLine(block);
+                // Folded lines (obs-fold) and whitespace before the colon
+                // are rejected, as RFC 7230 section 3.2.4 asks of servers
+                auto colon = line.find(':');
+                if (colon == 0 || colon == std::string_view::npos
+                        || line.front() == ' ' || line.front() == '\t'
+                        || line[colon - 1] == ' ' || line[colon - 1] == '\t') {
+                    return false;
+                }
+                if (req.headerCount == request::maxHeaders) {
+                    return false;
+                }
+                req.headers[req.headerCount++] = {
+                    line.substr(0, colon), trim(line.substr(colon + 1))};
+            }
+            return true;
+        }
+    };
+
+    /*
+     * Reads an unsigned decimal number from the front of s
+     * @param: text to read from, where to store the number
+     * @return: true if at least one digit was read and it didn't overflow
+     */
+    inline bool parseNumber(std::string_view &s, unsigned long long &out)
+    {
+        std::size_t i = 0;
+        unsigned long long value = 0;
+        for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) {
+            unsigned long long next = value * 10 + (s[i] - '0');
+            if (next / 10 != value) {
+                return false;
+            }
+            value = next;
+        }
+        if (i == 0) {
+            return false;
+        }
+        s.remove_prefix(i);
+        out = value;
+        return true;
+    }
+
+    /* An inclusive byte range, as in "Content-Range: bytes first-last/size" */
+    struct byte_range {
+        std::size_t first;
+        std::size_t last;
+
+        std::size_t length() const
+        {
+            return last - first + 1;
+        }
+    };
+
+    enum class range_result {
+        none,           // no Range header or one we ignore: send the whole file
+        satisfiable,    // at least one range overlaps the file: 206
+        unsatisfiable   // no range overlaps the file: 416
+    };
+
+    /*
+     * Parses a Range header as in RFC 7233 section 2.1. Accepts
+     * bytes=first-last, bytes=first- and bytes=-suffix and lists of them.
+     * Ranges starting past the end of the file are dropped and the
+     * others are clipped to the file. A header that doesn't parse or has
+     * more than max ranges is ignored, as the RFC allows. Overlapping and
+     * adjacent ranges are merged and the result sorted by offset, so a
+     * list like bytes=0-,0-,0- can't make the response larger than the
+     * file (RFC 7233 section 6.1).
+     * @param: value of the Range header, size of the file, where to store
+     *         the satisfiable ranges, capacity of out, number stored
+     * @return: what to answer
+     */
+    inline range_result parseRanges(std::string_view value, std::size_t size,
+                                    byte_range *out, std::size_t max, std::size_t &count)
+    {
+        count = 0;
+        constexpr std::string_view unit = "bytes=";
+        if (value.size() < unit.size() || !iequals(value.substr(0, unit.size()), unit)) {
+            return range_result::none;
+        }
+        value.remove_prefix(unit.size());
+        bool any = false;
+        while (!value.empty()) {
+            auto comma = value.find(',');
+            auto spec = value.substr(0, comma);
+            value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+            while (!spec.empty() && (spec.front() == ' ' || spec.front() == '\t')) {
+                spec.remove_prefix(1);
+            }
+            while (!spec.empty() && (spec.back() == ' ' || spec.back() == '\t')) {
+                spec.remove_suffix(1);
+            }
+            if (spec.empty()) {
+                continue;
+            }
+            any = true;
+            unsigned long long first = 0, last = 0;
+            if (spec.front() == '-') {
+                spec.remove_prefix(1);
+                if (!parseNumber(spec, last) || !spec.empty()) {
+                    return range_result::none;
+                }
+                if (last == 0 || size == 0) {
+                    continue;
+                }
+                first = last >= size ? 0 : size - last;
+                last = size - 1;
+            } else {
+                if (!parseNumber(spec, first) || spec.empty() || spec.front() != '-') {
+                    return range_result::none;
+                }
+                spec.remove_prefix(1);
+                if (spec.empty()) {
+                    last = size - 1;
+                } else if (!parseNumber(spec, last) || !spec.empty() || last < first) {
+                    return range_result::none;
+                }
+                if (first >= size) {
+                    continue;
+                }
+                if (last >= size) {
+                    last = size - 1;
+                }
+            }
+            if (count == max) {
+                return range_result::none;
+            }
+            out[count++] = {static_cast<std::size_t>(first), static_cast<std::size_t>(last)};
+        }
+        if (!any) {
+            return range_result::none;
+        }
+        if (count == 0) {
+            return range_result::unsatisfiable;
+        }
+        std::sort(out, out + count, [](const byte_range &a, const byte_range &b) {
+            return a.first < b.first;
+        });
+        std::size_t merged = 0;
+        for (std::size_t i = 1; i < count; ++i) {
+            if (out[i].first <= out[merged].last + 1) {
+                out[merged].last = std::max(out[merged].last, out[i].last);
+            } else {
+                out[++merged] = out[i];
+            }
+        }
+        count = merged + 1;
+        return range_result::satisfiable;
+    }
+
+    /*
+     * Formats a time as an HTTP date (IMF-fixdate, RFC 9110 section 5.6.7),
+     * e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+     * @param: seconds since the epoch
+     * @return: the date
+     */
+    inline std::string formatDate(std::time_t t)
+    {
+        static constexpr const char *days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+        static constexpr const char *months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+        struct tm tm;
+        ::gmtime_r(&t, &tm);
+        char date[64];
+        std::snprintf(date, sizeof(date), "%s, %02d %s %04d %02d:%02d:%02d GMT",
+                      days[tm.tm_wday], tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900,
+                      tm.tm_hour, tm.tm_min, tm.tm_sec);
+        return date;
+    }
+
+    /*
+     * Parses an HTTP date. Only the IMF-fixdate current clients send is
+     * understood; a conditional header with an obsolete date format is
+     * ignored, which just means the whole response is sent.
+     * @param: header value, where to store the time
+     * @return: true if it is a valid date
+     */
+    inline bool parseDate(std::string_view s, std::time_t &out)
+    {
+        static constexpr std::string_view months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+        if (s.size() != 29 || s.substr(3, 2) != ", " || s.substr(25) != " GMT"
+                || s[7] != ' ' || s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':') {
+            return false;
+        }
+        auto digits = [s](std::size_t pos, std::size_t len, int &value) {
+            value = 0;
+            for (std::size_t i = pos; i < pos + len; ++i) {
+                if (s[i] < '0' || s[i] > '9') {
+                    return false;
+                }
+                value = value * 10 + (s[i] - '0');
+            }
+            return true;
+        };
+        struct tm tm = {};
+        auto month = months.find(s.substr(8, 3));
+        if (month == std::string_view::npos || month % 3 != 0
+                || !digits(5, 2, tm.tm_mday) || !digits(12, 4, tm.tm_year)
+                || !digits(17, 2, tm.tm_hour) || !digits(20, 2, tm.tm_min) || !digits(23, 2, tm.tm_sec)) {
+            return false;
+        }
+        tm.tm_mon = static_cast<int>(month / 3);
+        tm.tm_year -= 1900;
+        out = ::timegm(&tm);
+        return out != -1;
+    }
+
+    /*
+     * Checks a list of entity tags such as W/"a", "b" from If-None-Match
+     * or If-Range against the tag of the representation, with the weak or
+     * the strong comparison of RFC 9110 section 8.8.3.2
+     * @param: header value, the quoted tag, empty if it isn't known,
+     *         whether tags marked W/ can match
+     * @return: true if one of them matches, or the list is *
+     */
+    inline bool etagMatches(std::string_view list, std::string_view etag, bool weak)
+    {
+        while (!list.empty()) {
+            while (!list.empty() && (list.front() == ' ' || list.front() == '\t' || list.front() == ',')) {
+                list.remove_prefix(1);
+            }
+            if (list.empty()) {
+                break;
+            }
+            if (list.front() == '*') {
+                return true;
+            }
+            bool isWeak = list.substr(0, 2) == "W/";
+            if (isWeak) {
+                list.remove_prefix(2);
+            }
+            auto close = list.empty() || list.front() != '"' ? std::string_view::npos : list.find('"', 1);
+            if (close == std::string_view::npos) {
+                return false;
+            }
+            if ((weak || !isWeak) && !etag.empty() && list.substr(0, close + 1) == etag) {
+                return true;
+            }
+            list.remove_prefix(close + 1);
+        }
+        return false;
+    }
+}
+}
+#endif //LIB_HTTP_PARSER_H
@@ -0,0 +1,280 @@
+#ifndef LIB_METRICS_H
+#define LIB_METRICS_H
+
+#include "settings.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace webServer {
+
+    /*
+     * The log level in effect. It is read with a relaxed load on the hot
+     * path, so turning logging off costs a load and a branch.
+     */
+    inline std::atomic<log_level> &logLevel()
+    {
+        static std::atomic<log_level> level{log_level::error};
+        return level;
+    }
+
+    inline bool logging(log_level level)
+    {
+        return level <= logLevel().load(std::memory_order_relaxed);
+    }
+
+    inline const char *logLevelName(log_level level)
+    {
+        static const char *const names[] = {"off", "error", "info", "debug"};
+        return names[static_cast<int>(level)];
+    }
+
+    /*
+     * Counter written by a single thread. Adding is a plain load and
+     * store, without a locked instruction, and a reader on another thread
+     * still never sees a torn value.
+     */
+    class counter {
+    public:
+        void add(std::uint64_t n = 1)
+        {
+            value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        std::uint64_t get() const
+        {
+            return value_.load(std::memory_order_relaxed);
+        }
+
+    private:
+        std::atomic<std::uint64_t> value_{0};
+    };
+
+    /*
+     * Latency histogram written by a single thread. Bucket i counts the
+     * latencies up to 2^i microseconds, the last one everything longer.
+     */
+    class latency_histogram {
+    public:
+        static constexpr std::size_t buckets = 25;
+
+        void observe(std::chrono::steady_clock::duration d)
+        {
+            auto ns = static_cast<std::uint64_t>(std::max<std::int64_t>(0,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(d).count()));
+            std::uint64_t us = (ns + 999) / 1000;
+            std::size_t i = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+            counts_[std::min(i, buckets - 1)].add();
+            sumNs_.add(ns);
+        }
+
+        std::uint64_t count(std::size_t bucket) const
+        {
+            return counts_[bucket].get();
+        }
+
+        std::uint64_t sumNs() const
+        {
+            return sumNs_.get();
+        }
+
+        /* Adds the observations of another histogram to this one */
+        void merge(const latency_histogram &other)
+        {
+            for (std::size_t i = 0; i < buckets; ++i) {
+                counts_[i].add(other.count(i));
+            }
+            sumNs_.add(other.sumNs());
+        }
+
+    private:
+        std::array<counter, buckets> counts_;
+        counter sumNs_;
+    };
+
+    /* Why a request failed or a connection was closed early */
+    enum class error_kind {
+        bad_request,
+        header_too_large,
+        not_found,
+        range_not_satisfiable,
+        write_failed,
+        idle_timeout,
+        header_timeout,     // the request header took too long to arrive
+        slow_client,        // the client read the response too slowly
+        tls_handshake,      // the TLS handshake failed
+        count
+    };
+
+    /* Everything counted by the sessions of one thread */
+    struct thread_metrics {
+        counter accepted;               // connections accepted
+        counter closed;                 // connections done with
+        counter requests;               // responses sent in full
+        counter bytesSent;
+        counter accessLogDropped;       // access log records lost to a full ring
+        counter tlsHandshakes;          // TLS handshakes completed
+        counter tlsResumed;             // of them, resumed sessions
+        counter tlsKernel;              // of them, with the kernel encrypting the responses
+        std::array<counter, static_cast<std::size_t>(error_kind::count)> errors;
+        latency_histogram firstByte;    // request parsed to first byte of the response written
+        latency_histogram response;     // request parsed to last byte of the response written
+
+        void error(error_kind kind)
+        {
+            errors[static_cast<std::size_t>(kind)].add();
+        }
+    };
+
+    /*
+     * Registry of the per-thread metrics. Threads only ever write their
+     * own thread_metrics; the /metrics endpoint sums them all up.
+     */
+    class metrics {
+    public:
+        static metrics &instance()
+        {
+            static metrics m;
+            return m;
+        }
+
+        /*
+         * Metrics of the calling thread, created on first use
+         * @param: None
+         * @return: metrics only this thread writes to
+         */
+        static thread_metrics &local()
+        {
+            thread_local thread_metrics *mine = instance().add();
+            return *mine;
+        }
+
+        /*
+         * Appends the metrics of all threads in the Prometheus text format
+         * @param: string to append to
+         * @return: None
+         */
+        void render(std::string &out) const
+        {
+            thread_metrics total;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (auto &t : threads_) {
+                    // closed first, so a connection accepted meanwhile can't make active negative
+                    total.closed.add(t->closed.get());
+                    total.accepted.add(t->accepted.get());
+                    total.requests.add(t->requests.get());
+                    total.bytesSent.add(t->bytesSent.get());
+                    total.accessLogDropped.add(t->accessLogDropped.get());
+                    total.tlsHandshakes.add(t->tlsHandshakes.get());
+                    total.tlsResumed.add(t->tlsResumed.get());
+                    total.tlsKernel.add(t->tlsKernel.get());
+                    for (std::size_t i = 0; i < total.errors.size(); ++i) {
+                        total.errors[i].add(t->errors[i].get());
+                    }
+                    total.firstByte.merge(t->firstByte);
+                    total.response.merge(t->response);
+                }
+            }
+            family(out, "webserver_connections_accepted_total", "counter", "Connections accepted.");
+            sample(out, "webserver_connections_accepted_total", "", total.accepted.get());
+            family(out, "webserver_connections_active", "gauge", "Connections open now.");
+            sample(out, "webserver_connections_active", "", total.accepted.get() - total.closed.get());
+            family(out, "webserver_requests_total", "counter", "Responses sent in full.");
+            sample(out, "webserver_requests_total", "", total.requests.get());
+            family(out, "webserver_sent_bytes_total", "counter", "Bytes written to clients.");
+            sample(out, "webserver_sent_bytes_total", "", total.bytesSent.get());
+            family(out, "webserver_access_log_dropped_total", "counter",
+                   "Access log records dropped because the writer fell behind.");
+            sample(out, "webserver_access_log_dropped_total", "", total.accessLogDropped.get());
+            family(out, "webserver_tls_handshakes_total", "counter", "TLS handshakes completed.");
+            sample(out, "webserver_tls_handshakes_total", "resumed=\"false\"",
+                   total.tlsHandshakes.get() - total.tlsResumed.get());
+            sample(out, "webserver_tls_handshakes_total", "resumed=\"true\"", total.tlsResumed.get());
+            family(out, "webserver_tls_kernel_offload_total", "counter",
+                   "TLS connections whose responses the kernel encrypts.");
+            sample(out, "webserver_tls_kernel_offload_total", "", total.tlsKernel.get());
+
+            static const char *const kinds[] = {"bad_request", "header_too_large", "not_found",
+                                                "range_not_satisfiable", "write_failed", "idle_timeout",
+                                                "header_timeout", "slow_client", "tls_handshake"};
+            family(out, "webserver_errors_total", "counter", "Failed requests and connections closed early.");
+            for (std::size_t i = 0; i < total.errors.size(); ++i) {
+                sample(out, "webserver_errors_total", std::string("kind=\"") + kinds[i] + '"',
+                       total.errors[i].get());
+            }
+            histogram(out, "webserver_time_to_first_byte_seconds",
+                      "Time from a parsed request to the first byte of its response.", total.firstByte);
+            histogram(out, "webserver_response_seconds",
+                      "Time from a parsed request to the last byte of its response.", total.response);
+            family(out, "webserver_log_level", "gauge", "0 off, 1 error, 2 info, 3 debug.");
+            sample(out, "webserver_log_level", "", static_cast<int>(logLevel().load()));
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::vector<std::unique_ptr<thread_metrics>> threads_;
+
+        thread_metrics *add()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            threads_.push_back(std::make_unique<thread_metrics>());
+            return threads_.back().get();
+        }
+
+        static void family(std::string &out, const char *name, const char *type, const char *help)
+        {
+            out += "# HELP ";
+            out += name;
+            out += ' ';
+            out += help;
+            out += "\n# TYPE ";
+            out += name;
+            out += ' ';
+            out += type;
+            out += '\n';
+        }
+
+        static void sample(std::string &out, const char *name, const std::string &labels, double value)
+        {
+            char number[32];
+            std::snprintf(number, sizeof(number), "%.15g", value);
+            out += name;
+            if (!labels.empty()) {
+                out += '{';
+                out += labels;
+                out += '}';
+            }
+            out += ' ';
+            out += number;
+            out += '\n';
+        }
+
+        static void histogram(std::string &out, const char *name, const char *help, const latency_histogram &h)
+        {
+            family(out, name, "histogram", help);
+            std::string bucket = std::string(name) + "_bucket";
+            std::uint64_t cumulative = 0;
+            for (std::size_t i = 0; i < latency_histogram::buckets; ++i) {
+                cumulative += h.count(i);
+                char le[32];
+                if (i + 1 < latency_histogram::buckets) {
+                    std::snprintf(le, sizeof(le), "%g", double(1ull << i) / 1e6);
+                } else {
+                    std::snprintf(le, sizeof(le), "+Inf");
+                }
+                sample(out, bucket.c_str(), std::string("le=\"") + le + '"', cumulative);
+            }
+            sample(out, (std::string(name) + "_sum").c_str(), "", h.sumNs() / 1e9);
+            sample(out, (std::string(name) + "_count").c_str(), "", cumulative);
+        }
+    };
+}
+#endif //LIB_METRICS_H
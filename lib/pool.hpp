@@ -0,0 +1,254 @@
+#ifndef LIB_POOL_H
+#define LIB_POOL_H
+
+#include "server.hpp"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <pthread.h>
+#include <sched.h>
+
+namespace webServer {
+
+    /*
+     * Runs one io_context per thread. Every io_context owns its own
+     * SO_REUSEPORT acceptor, so the kernel load balances connections
+     * between threads and a session never leaves the thread that
+     * accepted it.
+     *
+     * The configuration is reloaded on SIGHUP and whenever its file
+     * changes, without dropping a connection: the new settings are
+     * published for new connections, the routes, limits and logs are
+     * set up again, and every thread moves its acceptor if the port
+     * changed. The number of threads and the engine need a restart.
+     */
+    class io_context_pool {
+    public:
+        using loader = std::function<std::shared_ptr<const settings>()>;
+
+        /*
+         * @param: settings holding the number of threads (0 means one per core)
+         *         and the ports to listen on, function reading the
+         *         configuration again (none to never reload), path of the
+         *         configuration file to watch (empty to only reload on SIGHUP)
+         */
+        explicit io_context_pool(std::shared_ptr<const settings> conf, loader load = nullptr,
+                                 const std::string &confPath = "")
+            : load_(std::move(load))
+        {
+            // Refuses to start rather than close every connection in a failed handshake
+            tls_context::instance().configure(conf->tlsCertificate, conf->tlsKey, conf->ktls);
+            std::size_t threads = conf->threads;
+            if (threads == 0) {
+                threads = std::max(1u, std::thread::hardware_concurrency());
+            }
+            for (std::size_t i = 0; i < threads; ++i) {
+                // Only one thread ever runs this io_context, let asio skip the locking.
+                contexts_.push_back(std::make_unique<boost::asio::io_context>(1));
+                servers_.push_back(std::make_unique<server>(*contexts_.back(), conf));
+            }
+            file_cache::instance().watch(*contexts_.front());
+            apply(conf, nullptr);
+            signals_ = std::make_unique<boost::asio::signal_set>(*contexts_.front(), SIGHUP);
+            reloadOnSignal();
+            if (load_ && !confPath.empty()) {
+                config::instance().watch(*contexts_.front(), confPath, [this]() {
+                    reload();
+                });
+            }
+            levelSignals_ = std::make_unique<boost::asio::signal_set>(*contexts_.front(), SIGUSR1, SIGUSR2);
+            changeLogLevelOnSignal();
+        }
+
+        std::size_t size() const
+        {
+            return contexts_.size();
+        }
+
+        /* @return: the port listened on */
+        unsigned short port() const
+        {
+            return port_;
+        }
+
+        /*
+         * Starts a thread per io_context, pins it to a core
+         * and blocks until every io_context has stopped.
+         * @param: None
+         * @return: None
+         */
+        void run()
+        {
+            std::vector<std::thread> threads;
+            const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+            for (std::size_t i = 0; i < contexts_.size(); ++i) {
+                auto &io = *contexts_[i];
+                threads.emplace_back([&io]() { io.run(); });
+                pinToCore(threads.back(), i % cores);
+            }
+            for (auto &t : threads) {
+                t.join();
+            }
+        }
+
+        void stop()
+        {
+            for (auto &io : contexts_) {
+                io->stop();
+            }
+        }
+
+    private:
+        std::vector<std::unique_ptr<boost::asio::io_context>> contexts_;
+        std::vector<std::unique_ptr<server>> servers_;
+        std::unique_ptr<boost::asio::signal_set> signals_;
+        std::unique_ptr<boost::asio::signal_set> levelSignals_;
+        loader load_;
+        unsigned short port_ = 0;
+
+        /*
+         * Reloads the configuration on SIGHUP. That also rebuilds the
+         * routing table, so files added under the document root are
+         * served without a restart, and reopens the access log after
+         * logrotate moved it.
+         */
+        void reloadOnSignal()
+        {
+            signals_->async_wait([this](const boost::system::error_code &ec, int) {
+                if (ec) {
+                    return;
+                }
+                reload();
+                reloadOnSignal();
+            });
+        }
+
+        /*
+         * Reads the configuration file again and applies it. A file that
+         * can't be read or parsed, or names a certificate that can't be
+         * loaded, leaves the running configuration alone.
+         * Runs on the thread of the first io_context.
+         * @param: None
+         * @return: None
+         */
+        void reload()
+        {
+            auto previous = config::instance().current();
+            std::shared_ptr<const settings> conf = previous;
+            try {
+                if (load_) {
+                    conf = load_();
+                }
+                tls_context::instance().configure(conf->tlsCertificate, conf->tlsKey, conf->ktls);
+            }
+            catch (std::exception &e) {
+                std::cerr << "Keeping the running configuration: " << e.what() << '\n';
+                return;
+            }
+            if (conf->threads != previous->threads || conf->engine != previous->engine) {
+                std::cerr << "Changes to [threads] and the engine take effect after a restart\n";
+            }
+            apply(conf, previous);
+        }
+
+        /*
+         * Puts settings into effect, their TLS context has been loaded
+         * @param: the settings, the ones in effect so far (nullptr when starting)
+         * @return: None
+         */
+        void apply(std::shared_ptr<const settings> conf, std::shared_ptr<const settings> previous)
+        {
+            logLevel() = conf->logLevel;
+            router::instance().rebuild(conf->file, conf->root);
+            compressor::instance().configure(conf->compressionCache,
+                    conf->compressionCacheSize, conf->compressionMinSize);
+            digest_index::instance().configure(conf->digestIndex);
+            connection_limit::instance().configure(conf->maxConnections);
+            if (!conf->tlsCertificate.empty() && conf->engine != session_engine::callbacks
+                    && (!previous || previous->tlsCertificate.empty())) {
+                std::cerr << "TLS connections are served by the callback engine\n";
+            }
+            if (!previous || conf->totalRate != previous->totalRate || conf->rateBurst != previous->rateBurst) {
+                totalBandwidth().configure(conf->totalRate, conf->rateBurst);
+            }
+            if (!previous || conf->accessLog != previous->accessLog || conf->accessLogSize != previous->accessLogSize
+                    || conf->accessLogKeep != previous->accessLogKeep) {
+                access_log::instance().configure(conf->accessLog, conf->accessLogSize, conf->accessLogKeep);
+            } else {
+                access_log::instance().reopen();
+            }
+            config::instance().publish(conf);
+            listen(conf->ports, previous != nullptr);
+        }
+
+        /*
+         * Listens on the first of the ports that can be bound, or on one
+         * the OS picks when none can. The first server tries them and the
+         * others follow it on their own threads. A reload that can't bind
+         * any of its ports keeps the one listened on.
+         * @param: the ports in order of preference, whether the threads run
+         * @return: None
+         */
+        void listen(const std::vector<unsigned short> &ports, bool running)
+        {
+            auto &first = *servers_.front();
+            bool bound = false;
+            for (auto port : ports) {
+                if ((port == 0 && first.listening()) || first.listen(port)) {
+                    bound = true;
+                    break;
+                }
+            }
+            if (!bound && !first.listening()) {
+                first.listen(0);
+            }
+            if (first.port() == port_) {
+                return;
+            }
+            port_ = first.port();
+            for (std::size_t i = 1; i < servers_.size(); ++i) {
+                auto &s = *servers_[i];
+                auto port = port_;
+                if (running) {
+                    boost::asio::post(*contexts_[i], [&s, port]() { s.listen(port); });
+                } else {
+                    s.listen(port);
+                }
+            }
+            if (running) {
+                std::cout << "Listening on port " << port_ << '\n';
+            }
+        }
+
+        /*
+         * SIGUSR1 logs more, SIGUSR2 logs less
+         */
+        void changeLogLevelOnSignal()
+        {
+            levelSignals_->async_wait([this](const boost::system::error_code &ec, int signal) {
+                if (ec) {
+                    return;
+                }
+                int level = static_cast<int>(logLevel().load());
+                level += signal == SIGUSR1 ? 1 : -1;
+                level = std::clamp(level, static_cast<int>(log_level::off), static_cast<int>(log_level::debug));
+                logLevel() = static_cast<log_level>(level);
+                std::clog << "Log level " << logLevelName(logLevel()) << '\n';
+                changeLogLevelOnSignal();
+            });
+        }
+
+        static void pinToCore(std::thread &t, unsigned core)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(core, &set);
+            if (pthread_setaffinity_np(t.native_handle(), sizeof(set), &set) != 0) {
+                std::cerr << "Could not pin thread to core " << core << '\n';
+            }
+        }
+    };
+}
+#endif //LIB_POOL_H
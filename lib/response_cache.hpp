@@ -0,0 +1,129 @@
+#ifndef LIB_RESPONSE_CACHE_H
+#define LIB_RESPONSE_CACHE_H
+
+#include "file_cache.hpp"
+#include <ctime>
+#include <list>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <boost/asio.hpp>
+
+namespace webServer {
+
+    /*
+     * The 200 response for a whole file, made once: the header up to and
+     * including Content-Length and, for a small file, the body. Only the
+     * Connection header and the blank line are added per request.
+     */
+    struct cached_response {
+        std::weak_ptr<const cached_file> file;      // the version of the file it was made from
+        std::time_t modified = 0;                   // Last-Modified, the date of the identity file
+        std::string contentType;                    // and the rest of what the header was made from
+        std::string cacheControl;
+        bool vary = false;
+        bool tagged = false;                        // the digest of the file was known
+        std::shared_ptr<const std::string> header;
+        std::shared_ptr<const std::string> body;    // nullptr for a file too large to keep
+
+        /* @return: bytes it takes up */
+        std::size_t cost() const
+        {
+            return sizeof(*this) + header->size() + (body ? body->size() : 0);
+        }
+
+        /*
+         * Reads a whole file into memory
+         * @param: the file
+         * @return: its contents, nullptr if it can't be read
+         */
+        static std::shared_ptr<const std::string> load(const cached_file &file)
+        {
+            auto body = std::make_shared<std::string>(file.size(), '\0');
+            if (!file.read(body->data(), body->size(), 0)) {
+                return nullptr;
+            }
+            return body;
+        }
+    };
+
+    /*
+     * The cached_responses of the files one io_context serves, found with
+     * boost::asio::use_service<response_cache>(io_context). Only the thread
+     * running the io_context uses it, so a hit takes no lock; in exchange
+     * each thread keeps its own copies within its own budget. The least
+     * recently used responses are dropped first. A response is only used
+     * while the file_cache returns the file it was made from, so a file
+     * that changed gets a new one. It doesn't hold on to that file: the
+     * descriptor and mapping of a file the file_cache dropped are closed
+     * even though responses made from it are still cached here.
+     */
+    class response_cache : public boost::asio::execution_context::service {
+    public:
+        static inline boost::asio::execution_context::id id;
+
+        explicit response_cache(boost::asio::execution_context &context)
+            : service(context)
+        {}
+
+        /*
+         * @param: path of the file
+         * @return: the response made for it, nullptr if there is none
+         */
+        std::shared_ptr<const cached_response> find(const std::string &path)
+        {
+            auto found = entries_.find(path);
+            if (found == entries_.end()) {
+                return nullptr;
+            }
+            lru_.splice(lru_.begin(), lru_, found->second.second);
+            return found->second.first;
+        }
+
+        /*
+         * Keeps a response in place of the one made before for the file
+         * @param: path of the file, the response, bytes the cache may take up
+         * @return: None
+         */
+        void insert(const std::string &path, std::shared_ptr<const cached_response> response, std::size_t budget)
+        {
+            auto found = entries_.find(path);
+            if (found != entries_.end()) {
+                remove(found);
+            }
+            if (response->cost() > budget) {
+                return;
+            }
+            used_ += response->cost();
+            lru_.push_front(path);
+            entries_.emplace(path, entry{std::move(response), lru_.begin()});
+            while (used_ > budget) {
+                remove(entries_.find(lru_.back()));
+            }
+        }
+
+        void shutdown() override
+        {
+            entries_.clear();
+            lru_.clear();
+            used_ = 0;
+        }
+
+    private:
+        using lru_list = std::list<std::string>;
+        using entry = std::pair<std::shared_ptr<const cached_response>, lru_list::iterator>;
+
+        std::unordered_map<std::string, entry> entries_;   // by path of the file
+        lru_list lru_;                                      // most recently used first
+        std::size_t used_ = 0;
+
+        void remove(std::unordered_map<std::string, entry>::iterator it)
+        {
+            used_ -= it->second.first->cost();
+            lru_.erase(it->second.second);
+            entries_.erase(it);
+        }
+    };
+}
+#endif //LIB_RESPONSE_CACHE_H
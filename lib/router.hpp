@@ -0,0 +1,304 @@
+#ifndef LIB_ROUTER_H
+#define LIB_ROUTER_H
+
+#include <array>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+namespace webServer {
+
+    /*
+     * Content types by file extension, looked up without allocating.
+     * Extensions are compared ignoring case.
+     */
+    constexpr std::array<std::pair<std::string_view, std::string_view>, 24> mimeTypes {{
+        {"html", "text/html; charset=utf-8"},
+        {"htm", "text/html; charset=utf-8"},
+        {"txt", "text/plain; charset=utf-8"},
+        {"css", "text/css; charset=utf-8"},
+        {"js", "application/javascript"},
+        {"json", "application/json"},
+        {"xml", "application/xml"},
+        {"csv", "text/csv; charset=utf-8"},
+        {"md", "text/markdown; charset=utf-8"},
+        {"toml", "application/toml"},
+        {"png", "image/png"},
+        {"jpg", "image/jpeg"},
+        {"jpeg", "image/jpeg"},
+        {"gif", "image/gif"},
+        {"svg", "image/svg+xml"},
+        {"ico", "image/x-icon"},
+        {"pdf", "application/pdf"},
+        {"zip", "application/zip"},
+        {"gz", "application/gzip"},
+        {"tar", "application/x-tar"},
+        {"zst", "application/zstd"},
+        {"wasm", "application/wasm"},
+        {"mp4", "video/mp4"},
+        {"iso", "application/x-iso9660-image"},
+    }};
+
+    constexpr std::string_view defaultMimeType = "application/octet-stream";
+
+    /*
+     * @param: path of a file
+     * @return: the content type for its extension
+     */
+    inline std::string_view contentType(std::string_view path)
+    {
+        auto dot = path.rfind('.');
+        auto slash = path.rfind('/');
+        if (dot == std::string_view::npos || (slash != std::string_view::npos && dot < slash)) {
+            return defaultMimeType;
+        }
+        auto ext = path.substr(dot + 1);
+        for (auto &type : mimeTypes) {
+            if (type.first.size() != ext.size()) {
+                continue;
+            }
+            bool same = true;
+            for (std::size_t i = 0; i < ext.size() && same; ++i) {
+                char c = ext[i];
+                if (c >= 'A' && c <= 'Z') c += 'a' - 'A';
+                same = c == type.first[i];
+            }
+            if (same) {
+                return type.second;
+            }
+        }
+        return defaultMimeType;
+    }
+
+    /*
+     * Turns a request target into a clean absolute path in the caller's
+     * buffer: drops the query and fragment, decodes %XX escapes, collapses
+     * "//" and "." and resolves ".." without ever climbing above "/".
+     * A trailing '/' is kept so directories can be told apart.
+     * @param: request target, output buffer and its size
+     * @return: the normalized path, empty if the target is invalid
+     */
+    inline std::string_view normalizePath(std::string_view target, char *out, std::size_t cap)
+    {
+        auto hex = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+            if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+            return -1;
+        };
+        auto end = target.find_first_of("?#");
+        target = target.substr(0, end);
+        if (target.empty() || target.front() != '/' || cap < 2) {
+            return {};
+        }
+        std::size_t len = 0;
+        out[len++] = '/';
+        std::size_t i = 1;
+        while (i <= target.size()) {
+            // Decode one segment after the '/' already written
+            std::size_t segment = len;
+            for (; i < target.size() && target[i] != '/'; ++i) {
+                char c = target[i];
+                if (c == '%') {
+                    if (i + 2 >= target.size()) {
+                        return {};
+                    }
+                    int h = hex(target[i + 1]), l = hex(target[i + 2]);
+                    if (h < 0 || l < 0) {
+                        return {};
+                    }
+                    c = static_cast<char>(h * 16 + l);
+                    i += 2;
+                }
+                if (c == '\0' || c == '/' || c == '\\') {
+                    return {};
+                }
+                if (len == cap) {
+                    return {};
+                }
+                out[len++] = c;
+            }
+            std::string_view name(out + segment, len - segment);
+            if (name == ".") {
+                len = segment;
+            } else if (name == "..") {
+                if (segment == 1) {
+                    return {};      // would leave the document root
+                }
+                len = segment - 1;
+                while (out[len - 1] != '/') {
+                    --len;
+                }
+            } else if (!name.empty() && i < target.size()) {
+                if (len == cap) {
+                    return {};
+                }
+                out[len++] = '/';
+            }
+            ++i;
+        }
+        return {out, len};
+    }
+
+    /*
+     * @param: content type
+     * @return: true if the type is text that gzip shrinks well
+     */
+    inline bool isCompressible(std::string_view type)
+    {
+        constexpr std::string_view text[] = {
+            "text/", "application/javascript", "application/json",
+            "application/xml", "application/toml", "image/svg+xml"};
+        for (auto prefix : text) {
+            if (type.substr(0, prefix.size()) == prefix) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /* A URL path served from a file */
+    struct route {
+        std::string url;                // normalized path, the key of the table
+        std::string path;               // file on disk
+        std::string_view contentType;
+        bool compressible;              // worth gzipping on the fly
+        std::string gzip;               // precompressed path.gz next to the file, if any
+        std::string zstd;               // precompressed path.zst next to the file, if any
+    };
+
+    /*
+     * The URL to file table. Built once and never modified, a new one
+     * is built on reload and swapped in while sessions finish with the
+     * old one.
+     */
+    class route_table {
+    public:
+        /*
+         * @param: file served at "/" (may be empty), document root (may be empty)
+         */
+        route_table(const std::string &index, const std::string &root)
+        {
+            namespace fs = boost::filesystem;
+            if (!index.empty()) {
+                addRoute("/", index);
+            }
+            if (!root.empty()) {
+                boost::system::error_code ec;
+                fs::recursive_directory_iterator it(root, ec), end;
+                if (ec) {
+                    std::cerr << "Can't read document root " << root << ": " << ec.message() << '\n';
+                }
+                for (; it != end; it.increment(ec)) {
+                    if (ec) {
+                        break;
+                    }
+                    auto name = it->path().filename().string();
+                    if (!name.empty() && name.front() == '.') {
+                        // Hidden files and directories are not served
+                        if (fs::is_directory(it->status())) {
+                            it.disable_recursion_pending();
+                        }
+                        continue;
+                    }
+                    if (!fs::is_regular_file(it->status())) {
+                        continue;
+                    }
+                    auto relative = it->path().lexically_relative(root).generic_string();
+                    addRoute("/" + relative, it->path().string());
+                    if (name == "index.html") {
+                        auto dir = relative.substr(0, relative.size() - name.size());
+                        addRoute("/" + dir, it->path().string());
+                        if (!dir.empty()) {
+                            addRoute("/" + dir.substr(0, dir.size() - 1), it->path().string());
+                        }
+                    }
+                }
+            }
+            // The vector no longer grows, the keys can point into it
+            table_.reserve(routes_.size());
+            for (std::size_t i = 0; i < routes_.size(); ++i) {
+                table_.emplace(routes_[i].url, i);
+            }
+        }
+
+        /*
+         * @param: normalized path
+         * @return: the route or nullptr if nothing is served there
+         */
+        const route *find(std::string_view url) const
+        {
+            auto found = table_.find(url);
+            return found == table_.end() ? nullptr : &routes_[found->second];
+        }
+
+        std::size_t size() const
+        {
+            return table_.size();
+        }
+
+    private:
+        std::vector<route> routes_;
+        std::unordered_map<std::string_view, std::size_t> table_;
+
+        void addRoute(std::string url, std::string path)
+        {
+            if (url == "/" && !routes_.empty() && routes_.front().url == "/") {
+                return;     // the configured file wins over the root's index.html
+            }
+            auto type = contentType(path);
+            auto sibling = [&path](const char *ext) {
+                boost::system::error_code ec;
+                auto name = path + ext;
+                return boost::filesystem::is_regular_file(name, ec) ? name : std::string{};
+            };
+            auto gzip = sibling(".gz");
+            auto zstd = sibling(".zst");
+            routes_.push_back({std::move(url), std::move(path), type, isCompressible(type),
+                               std::move(gzip), std::move(zstd)});
+        }
+    };
+
+    /*
+     * Process wide access to the current route_table.
+     */
+    class router {
+    public:
+        static router &instance()
+        {
+            static router r;
+            return r;
+        }
+
+        /*
+         * Builds a new table and swaps it in
+         * @param: file served at "/", document root
+         * @return: None
+         */
+        void rebuild(const std::string &index, const std::string &root)
+        {
+            auto table = std::make_shared<const route_table>(index, root);
+            std::cout << "Serving " << table->size() << " route(s)" << '\n';
+            std::atomic_store(&table_, std::move(table));
+        }
+
+        /*
+         * @return: the current table, valid for as long as it is held
+         */
+        std::shared_ptr<const route_table> table() const
+        {
+            return std::atomic_load(&table_);
+        }
+
+    private:
+        std::shared_ptr<const route_table> table_ = std::make_shared<const route_table>("", "");
+
+        router() = default;
+    };
+}
+#endif //LIB_ROUTER_H
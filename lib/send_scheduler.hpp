@@ -0,0 +1,193 @@
+#ifndef LIB_SEND_SCHEDULER_H
+#define LIB_SEND_SCHEDULER_H
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <utility>
+#include <boost/asio.hpp>
+
+namespace webServer {
+
+    /*
+     * Takes turns between the sessions of one io_context that have more
+     * to send, found with boost::asio::use_service<send_scheduler>(io_context).
+     *
+     * A session writes at most one quantum of its response and then
+     * waits for its turn at the back of the queue. The scheduler resumes
+     * one session per handler it posts, so everything else that became
+     * ready on the thread, like the request of a new client, runs between
+     * two turns instead of behind all the large transfers. A response
+     * that fits in a quantum is written as soon as it is built.
+     *
+     * Sessions held back by a rate limit sleep until their bucket has
+     * refilled and then queue up like the others; one steady_timer waits
+     * for the earliest of them.
+     */
+    class send_scheduler : public boost::asio::execution_context::service {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        static inline boost::asio::execution_context::id id;
+
+        /*
+         * A session's place in the scheduler, embedded in the session.
+         * While it waits it holds on to its owner.
+         */
+        class entry {
+        public:
+            /* @param: called with the owner when it is the owner's turn */
+            entry(void (*resume)(void *), void *owner)
+                : resume_(resume), owner_(owner)
+            {}
+
+            entry() = default;  // the head of the queue
+
+            entry(const entry &) = delete;
+            entry &operator=(const entry &) = delete;
+
+            bool waiting() const
+            {
+                return prev_ != nullptr || sleeping_;
+            }
+
+        private:
+            friend class send_scheduler;
+            entry *prev_ = nullptr;     // in the queue of sessions waiting for their turn
+            entry *next_ = nullptr;
+            bool sleeping_ = false;     // in sleepers_ instead
+            std::multimap<clock::time_point, entry *>::iterator wake_;
+            std::shared_ptr<void> keep_;
+            void (*resume_)(void *) = nullptr;
+            void *owner_ = nullptr;
+        };
+
+        explicit send_scheduler(boost::asio::execution_context &context)
+            : service(context),
+              io_context_(static_cast<boost::asio::io_context &>(context)),
+              timer_(io_context_)
+        {
+            head_.prev_ = head_.next_ = &head_;
+        }
+
+        /*
+         * Queues a session for its next turn
+         * @param: its entry, what keeps the session alive until then
+         * @return: None
+         */
+        void yield(entry &e, std::shared_ptr<void> keep)
+        {
+            unlink(e);
+            e.keep_ = std::move(keep);
+            enqueue(e);
+        }
+
+        /*
+         * Queues a session once some time has passed
+         * @param: its entry, what keeps the session alive until then, the time
+         * @return: None
+         */
+        void sleep(entry &e, std::shared_ptr<void> keep, clock::duration after)
+        {
+            unlink(e);
+            e.keep_ = std::move(keep);
+            e.wake_ = sleepers_.emplace(clock::now() + after, &e);
+            e.sleeping_ = true;
+            if (e.wake_ == sleepers_.begin()) {
+                arm();
+            }
+        }
+
+        void shutdown() override
+        {
+            timer_.cancel();
+            // Releasing a session may destroy it, so it is unlinked first
+            while (head_.next_ != &head_) {
+                auto keep = release(*head_.next_);
+            }
+            while (!sleepers_.empty()) {
+                auto keep = release(*sleepers_.begin()->second);
+            }
+        }
+
+    private:
+        boost::asio::io_context &io_context_;
+        boost::asio::steady_timer timer_;
+        entry head_;                    // sentinel of the circular queue
+        std::multimap<clock::time_point, entry *> sleepers_;
+        bool posted_ = false;           // a turn is posted
+
+        void unlink(entry &e)
+        {
+            if (e.prev_) {
+                e.prev_->next_ = e.next_;
+                e.next_->prev_ = e.prev_;
+                e.prev_ = e.next_ = nullptr;
+            }
+            if (e.sleeping_) {
+                sleepers_.erase(e.wake_);
+                e.sleeping_ = false;
+            }
+        }
+
+        std::shared_ptr<void> release(entry &e)
+        {
+            unlink(e);
+            return std::move(e.keep_);
+        }
+
+        void enqueue(entry &e)
+        {
+            e.next_ = &head_;
+            e.prev_ = head_.prev_;
+            head_.prev_->next_ = &e;
+            head_.prev_ = &e;
+            if (!posted_) {
+                posted_ = true;
+                boost::asio::post(io_context_, [this]() { turn(); });
+            }
+        }
+
+        /* Resumes the session at the front of the queue */
+        void turn()
+        {
+            posted_ = false;
+            if (head_.next_ == &head_) {
+                return;
+            }
+            entry &e = *head_.next_;
+            auto keep = release(e);
+            if (head_.next_ != &head_) {
+                posted_ = true;
+                boost::asio::post(io_context_, [this]() { turn(); });
+            }
+            e.resume_(e.owner_);
+        }
+
+        void arm()
+        {
+            timer_.expires_at(sleepers_.begin()->first);
+            timer_.async_wait([this](const boost::system::error_code &ec) {
+                if (!ec) {
+                    wake();
+                }
+            });
+        }
+
+        /* Queues the sessions whose sleep is over */
+        void wake()
+        {
+            auto now = clock::now();
+            while (!sleepers_.empty() && sleepers_.begin()->first <= now) {
+                entry &e = *sleepers_.begin()->second;
+                sleepers_.erase(sleepers_.begin());
+                e.sleeping_ = false;
+                enqueue(e);
+            }
+            if (!sleepers_.empty()) {
+                arm();
+            }
+        }
+    };
+}
+#endif //LIB_SEND_SCHEDULER_H
@@ -1,386 +1,499 @@
 #ifndef LIB_SERVER_H
 #define LIB_SERVER_H
 
-#include "errors.hpp"
-#include <fstream>
-#include <iostream>
+#include "config.hpp"
+#include "connection.hpp"
+#include "coro_session.hpp"
+#include "handler_alloc.hpp"
+#include "session_pool.hpp"
+#include "settings.hpp"
+#include "uring_session.hpp"
+#include <algorithm>
+#include <chrono>
+#include <memory>
 #include <utility>
-#include <string>
+#include <vector>
 #include <boost/asio.hpp>
-#include <boost/filesystem/operations.hpp>
-#include <boost/interprocess/mapped_region.hpp>
-#include <boost/interprocess/file_mapping.hpp>
-#include <boost/lexical_cast.hpp>
-#include <regex>
-#include <list>
 
 
 namespace webServer {
-    using boost::asio::ip::tcp;
 
-    class session : public std::enable_shared_from_this<session> {
-        /* We could have these private variables in a different class
-         * for they are used to get the request header of the client.
-         */
-        boost::asio::streambuf buff;    //buff for request header
-        std::string method;             // the current method: GET POST DELETE
-        std::string url;                // the url that's accessed
-        std::string version;            // HTTP/1.1 only
-        std::map<std::string, std::string> headers; //maps key to value of request header
+    /*
+     * Session engine built from callbacks: every step of a request
+     * continues in the completion handler of the previous one. It is
+     * also the engine that speaks TLS, whichever engine is configured.
+     */
+    class session : public connection, public std::enable_shared_from_this<session> {
         boost::asio::io_context::strand writeStrand;
         boost::asio::io_context &io_service;
-        tcp::socket socket_;
-        //std::deque<std::string> outgoing_queue;
-        std::deque<void*> outgoing_queue;
-        std::deque<std::size_t> outgoing_queue_length;
-        boost::interprocess::mapped_region region_;
+        handler_memory readMemory_;         // operation state of the pending read
+        handler_memory writeMemory_;        // operation state of the pending write wait
 
         /*
-         *  This function reads every header seperated by '\r'
-         *  and inserts the key value pair in the map
-         *  @param: a string delimited by '\r'
-         *  @return: None
+         * Writes the chain to the socket. When the socket buffer is full
+         * it waits for the socket to become writable on the writeStrand.
+         * After a quantum it waits for its next turn in the send_scheduler
+         * so other sessions on this thread get theirs, and it sleeps there
+         * while a rate limit holds it back.
+         * @param: None
+         * @return: None
          */
-        void onReadHeader(const std::string &line) {
-            auto self(shared_from_this());
-            if (line.empty()) {
+        void flush()
+        {
+            if (!socket_.is_open()) {
+                abortResponse();
                 return;
             }
-            std::stringstream ssHeader(line);
-            std::string headerName;
-            std::getline(ssHeader, headerName, ':');
-
-            std::string value;
-            std::getline(ssHeader, value);
-            headers.insert({headerName, value});
+            if (!socket_.non_blocking()) {
+                socket_.non_blocking(true);     // an ioctl, once per connection
+            }
+            std::size_t budget = conf_->sendQuantum;
+            while (!chain_.empty()) {
+                if (budget == 0) {
+                    waitTurn(shared_from_this());
+                    return;
+                }
+                std::size_t allowed = allowance(budget);
+                if (allowed == 0) {
+                    throttle(shared_from_this());
+                    return;
+                }
+                boost::system::error_code ec;
+                std::size_t n = writeSome(allowed, ec);
+                if (ec == boost::asio::error::would_block) {
+                    // OpenSSL may need to read before it can write, a key update for one
+                    auto wait = tls_.active() && !tls_.kernelSend() ? tls_.waitType() : tcp::socket::wait_write;
+                    socket_.async_wait(wait, makeCustomAllocHandler(writeMemory_,
+                            writeStrand.wrap([self = shared_from_this()](const boost::system::error_code &ec) {
+                                if (!ec) {
+                                    self->flush();
+                                } else {
+                                    self->abortResponse();
+                                }
+                            })));
+                    return;
+                }
+                if (ec) {
+                    abortResponse();
+                    return;
+                }
+                budget -= std::min(n, budget);
+            }
+            onResponseSent();
         }
 
-        /*
-         * Checks whether the client requested for any range
-         * as specified in HTTP/1.1
-         * @param: None
-         * @return: true if the request header contains 'Range'
-         */
-        std::string headerContainsRange() {
-            auto self(shared_from_this());
-            auto found(headers.find("Range"));
-            if (found != headers.end()) {
-                return found->second;
-            }
-            return {};
+        /* The send_scheduler gave the session its turn */
+        static void resume(void *owner)
+        {
+            static_cast<session *>(static_cast<connection *>(owner))->flush();
         }
 
         /*
-         * Returns the response header to be sent
+         * Called on the writeStrand once the whole response is written.
+         * Either closes the connection or gets ready for the next request,
+         * which may already be waiting in readBuf_ if the client pipelines.
          * @param: None
-         * @return: tuple that contains  <content_length_of_the_file,<start_range,end_range>>
+         * @return: None
          */
-        std::tuple<std::pair<std::string, std::size_t>, std::pair<unsigned, unsigned>>
-        getResponseHeader()
+        void onResponseSent()
         {
-            auto self(shared_from_this());
-
-            std::stringstream ssOut;
-            {
-                ssOut << (url == "/" ? "HTTP/1.1 200 OK" : "HTTP/1.1 404 Not Found") << std::endl;
-                ssOut << "Content-Type: text/html" << std::endl;
-                ssOut << "Content-Length: ";
+            countResponse();
+            if (!keepAlive_ || !socket_.is_open()) {
+                tls_.shutdown();
+                boost::system::error_code ignored;
+                socket_.shutdown(tcp::socket::shutdown_send, ignored);
+                return;
+            }
+            nextRequest();
+            if (readLen_ > 0) {
+                onRead();
+            } else {
+                do_read();
             }
-            return getContentLength(ssOut);
         }
 
         /*
-         * Gets the filesize of the file you are sending
-         * Change the name of the file.
-         * This file is about ~1.2Gb
-         * @param: None
-         * @return: the size of the file
+         * Answers a request that couldn't be parsed and lets the connection
+         * close once the answer is written.
+         * @param: the complete response, what was wrong with the request
+         * @return: None
          */
-        static std::size_t getFileSize() {
-            namespace fs = boost::filesystem;
-            std::string file = "the_name_of_the_file";
-            return fs::file_size(file);
+        void sendError(std::string_view response, error_kind kind)
+        {
+            prepareError(response, kind);
+            flush();
         }
 
         /*
-         * This functions sends the response.
+         * Feeds what has been read so far to the parser. Sends the
+         * response once the whole request header is in, reads more otherwise.
          * @param: None
-         * @return: tuple in the form of message, range_start, range_end
+         * @return: None
          */
-        std::tuple<std::pair<std::string, std::size_t>, std::pair<unsigned, unsigned>>
-                        getContentLength(std::stringstream &ssOut)
+        void onRead()
         {
-            auto self(shared_from_this());
-            unsigned start_ = 0;
-            unsigned end_ = 0;
-            for (auto &p: headers) {
-                std::cout << p.first << ": " << p.second <<'\n';
-            }
-            if (url == "/") { /* Send the data when requested */
-                const std::string end{};
-                if (auto val(headerContainsRange()); val != end) {
-                    auto findRange([](const auto &val) {
-                        std::regex rgx(R"(bytes=([0-9]*[.]?[0-9]+)-([0-9]*[.]?[0-9]+))");
-                        std::smatch match;
-                        if (!std::regex_search(val, match, rgx)) {
-                            return std::pair<unsigned, unsigned>{0.0, 0.0};
-                        }
-                        std::string s_ = static_cast<std::string>(match[1]);
-                        std::string e_ = static_cast<std::string>(match[2]);
-                        e_ = e_.empty() ? "0.0" : e_;
-                        return std::pair<unsigned, unsigned>{
-                                std::ceil(boost::lexical_cast<float>(s_)),
-                                std::ceil(boost::lexical_cast<float>(e_))};
-                    });
-                    auto [s_, e_] = findRange(val);
-                    start_ = s_;
-                    end_ = e_;
-
-                    if (start_ == end_) {
-                        std::cerr << "Send the whole file" << '\n';
-                        ssOut << getFileSize();
+            switch (parseRequest()) {
+                case http::parse_result::complete:
+                    keepAlive_ = wantsKeepAlive();
+                    prepareResponse();
+                    flush();
+                    break;
+                case http::parse_result::incomplete:
+                    if (headerTooLong()) {
+                        sendError(headerTooLarge, error_kind::header_too_large);
                     } else {
-                        std::cerr << "Send parts of the file" << '\n';
-                        ssOut << end_ - start_;
+                        do_read();
                     }
-                } else {
-                    //Send the whole file to the client
-                    ssOut << getFileSize();
-                }
-                ssOut << "\r\n";
-            } else {
-                std::string sHTML = "<html><body><h1>404 Not Found</h1><p>There's nothing here.</p></body></html>";
-                ssOut << sHTML.length() << std::endl;
-                ssOut << "\r\n";
-                ssOut << sHTML;
+                    break;
+                case http::parse_result::bad:
+                    sendError(badRequest, error_kind::bad_request);
+                    break;
             }
-            std::size_t len = ssOut.str().length();
-            return {{ssOut.str(), len}, { start_, end_}};
         }
 
         /*
-         * This function sends the response header to the connected client
-         * @param: self: the shared_ptr to itself
-         * @return: the start and end range requested by the client
+         * Invoked when a client is connected.
+         * This functions returns immediately if there is no data to be read
+         * @param: None
+         * @return: None
          */
-        std::pair<unsigned, unsigned> sendHeaderFirst()
+        void do_read()
         {
-            auto self(shared_from_this());
-            auto tuple_ = getResponseHeader();
-            auto hdr_len_pair = std::get<0>(tuple_);
-            char* data = const_cast<char *>(hdr_len_pair.first.c_str());
-            auto header  = std::make_shared<void*>(data); // This contains data
-            auto len = hdr_len_pair.second;
-            boost::asio::post(self->io_service,
-                                  self->writeStrand.wrap([self, header, len]() {
-                                      self->queuePackets(header, len);
-                                  }));
-            return std::get<1>(tuple_);
+            waitForRequest();
+            if (tls_.active()) {
+                readRecord();
+                return;
+            }
+            socket_.async_read_some(
+                    boost::asio::buffer(readBuf_.data() + readLen_, readBuf_.size() - readLen_),
+                    makeCustomAllocHandler(readMemory_, [self = shared_from_this(), this] (
+                            const boost::system::error_code& ec, std::size_t s) {
+                if (!ec) {
+                    readLen_ += s;
+                    onRead();
+                }
+            }));
         }
 
-        void startPacketSend()
+        /*
+         * do_read() of a TLS connection. OpenSSL may hold decrypted bytes
+         * already, so it is asked first and the socket waited for after.
+         * @param: None
+         * @return: None
+         */
+        void readRecord()
         {
-            auto self(shared_from_this());
-            std::cout << "async_write: " << outgoing_queue_length.front() << '\n';
-            boost::asio::async_write(self->socket_,
-                    boost::asio::buffer(self->outgoing_queue.front(),  self->outgoing_queue_length.front()),
-                    self->writeStrand.wrap(
-                    [self](boost::system::error_code const &ec, std::size_t s) {
-                        if (!ec) {
-                            std::cerr << "Sent a packet of " << s << " bytes to the client\n";
-                            self->outgoing_queue.pop_front();
-                            self->outgoing_queue_length.pop_front();
-                            if (!self->outgoing_queue.empty()) {
-                                self->startPacketSend();
+            boost::system::error_code ec;
+            std::size_t n = tls_.read(readBuf_.data() + readLen_, readBuf_.size() - readLen_, ec);
+            if (ec == boost::asio::error::would_block) {
+                socket_.async_wait(tls_.waitType(), makeCustomAllocHandler(readMemory_,
+                        [self = shared_from_this(), this](const boost::system::error_code &ec) {
+                            if (!ec) {
+                                readRecord();
                             }
-                        }
-                        else {
-                            if ((boost::asio::error::eof == ec) ||
-                                (boost::asio::error::connection_reset == ec) ||
-                                boost::asio::error::broken_pipe == ec) {
-                                self->socket_.close();
-                                return ;
-                            }
-                        }
-            }));
+                        }));
+                return;
+            }
+            if (!ec) {
+                readLen_ += n;
+                onRead();
+            }
         }
 
-        void queuePackets(const std::shared_ptr<void*> data, std::size_t len)
+        /*
+         * Carries the TLS handshake on as the socket gets ready, under
+         * the idle deadline, then reads the first request
+         * @param: None
+         * @return: None
+         */
+        void handshake()
         {
-            auto self(shared_from_this());
-            bool writeInProgress = !self->outgoing_queue.empty();
-            if (self->socket_.is_open()) {
-                outgoing_queue.push_back(*data);
-                outgoing_queue_length.push_back(len);
-                if (!writeInProgress) {
-                    self->startPacketSend();
+            boost::system::error_code ec;
+            if (tls_.handshake(ec)) {
+                stats_->tlsHandshakes.add();
+                if (tls_.resumed()) {
+                    stats_->tlsResumed.add();
+                }
+                if (tls_.kernelSend()) {
+                    stats_->tlsKernel.add();
                 }
+                do_read();
+                return;
+            }
+            if (ec == boost::asio::error::would_block) {
+                socket_.async_wait(tls_.waitType(), makeCustomAllocHandler(readMemory_,
+                        [self = shared_from_this(), this](const boost::system::error_code &ec) {
+                            if (!ec) {
+                                handshake();
+                            }
+                        }));
+                return;
+            }
+            if (logging(log_level::info)) {
+                std::clog << "TLS handshake failed: " << ec.message() << '\n';
             }
+            stats_->error(error_kind::tls_handshake);
+            closeSocket();
         }
 
+    public:
+
+        explicit session(boost::asio::io_context& io_context)
+                :  connection(io_context, &session::resume), writeStrand(io_context),
+                   io_service(io_context)
+                {}
+
         /*
-         * This function sends the data to the client once all the response header is sent.
-         * @param: self, FileName to send, start and end range
+         * Interface provided to accepted client
+         * @param: the connected socket, settings for the connection
          * @return: None
          */
-        static void sendData(unsigned start_, unsigned end_,
-                                std::shared_ptr<session> self )
+        void start(tcp::socket socket, std::shared_ptr<const settings> conf)
+        {
+            accept(std::move(socket), std::move(conf));
+            if (conf_->tlsCertificate.empty()) {
+                do_read();
+                return;
+            }
+            auto context = tls_context::instance().current();
+            boost::system::error_code ec;
+            socket_.non_blocking(true, ec);
+            if (ec || !context || !tls_.start(std::move(context), socket_.native_handle())) {
+                stats_->error(error_kind::tls_handshake);
+                closeSocket();
+                return;
+            }
+            waitForRequest();
+            handshake();
+        }
+    };
+
+    /*
+     * SO_REUSEPORT lets every io_context own an acceptor bound to the
+     * same port; the kernel then spreads incoming connections across them.
+     */
+    using reuse_port = boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
+    /*
+     * Accepts the clients of one io_context and starts their sessions.
+     * Sessions get the settings published in config at the time they are
+     * accepted; the engine is chosen once, when the server is built.
+     */
+    class server {
+    public:
+        server(boost::asio::io_service &io_context, std::shared_ptr<const settings> conf)
+        : io_context_(io_context), engine_(conf->engine), acceptRetry_(io_context),
+          sessions_(std::make_shared<session_pool<session>>(io_context))
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+          , coroSessions_(std::make_shared<session_pool<coro_session>>(io_context))
+#endif
         {
-            // Put the filename of your choice that you're sending to the client
-            std::string fileName = "the_name_of_the_file_goes_here";
-            std::size_t len = end_ - start_ ;
-            boost::interprocess::file_mapping fm(fileName.c_str(), boost::interprocess::read_only);
-            boost::interprocess::mapped_region region(fm, boost::interprocess::read_only,
-                    std::ceil(start_), (int)(end_ - start_));
-            self->region_.swap(region);
-            auto reg_addr = std::make_shared<void*>(self->region_.get_address());
-            self->queuePackets(reg_addr, len);
+#if defined(WEBSERVER_HAS_IO_URING)
+            if (engine_ == session_engine::uring) {
+                setUpRing();
+            }
+#endif
         }
 
-        void startSendingPackets()
+        /*
+         * Listens on a port, from then on instead of the one listened on
+         * so far. Clients already accepted stay connected.
+         * Must be called on the thread of the io_context.
+         * @param: the port, 0 lets the OS pick one
+         * @return: false if the port can't be bound
+         */
+        bool listen(unsigned short port)
         {
-            auto self(shared_from_this());
+            if (acceptor_ && port != 0 && port == this->port()) {
+                return true;
+            }
+            auto acceptor = std::make_shared<tcp::acceptor>(io_context_);
             try {
-                auto[start_, end_] = self->sendHeaderFirst();
-                if (start_ == end_) {
-                    end_ = self->getFileSize();
+                tcp::endpoint endpoint(tcp::v6(), port);
+                acceptor->open(endpoint.protocol());
+                acceptor->set_option(boost::asio::socket_base::reuse_address(true));
+                acceptor->set_option(reuse_port(true));
+                acceptor->bind(endpoint);
+                acceptor->listen();
+            }
+            catch (boost::system::system_error &e) {
+                if (logging(log_level::error)) {
+                    std::cerr << "Can't listen on port " << port << ": " << e.what() << '\n';
                 }
-                self->sendData(start_, end_, self);
+                return false;
             }
-            catch (boost::filesystem::filesystem_error &e) {
-                self->url = "abcd"; // Since we couldn't open the file. Send 404 error.
-                self->sendHeaderFirst();
+            stopAccepting();
+            acceptor_ = std::move(acceptor);
+#if defined(WEBSERVER_HAS_IO_URING)
+            if (ring_) {
+                uringAcceptor_ = std::make_unique<uring_acceptor>(io_context_, ring_, acceptor_->native_handle(),
+                        [this](tcp::socket socket) {
+                            auto conf = config::instance().current();
+                            if (!conf->tlsCertificate.empty()) {
+                                sessions_->acquire()->start(std::move(socket), std::move(conf));
+                                return;
+                            }
+                            uringSessions_->acquire()->start(std::move(socket), std::move(conf), ring_);
+                        });
+                return true;
             }
+#endif
+            do_accept(acceptor_);
+            return true;
         }
 
-        /*
-         * This function reads all of the contents of the header.
-         * And sends data when all the contents are read form the header.
-         * This function returns immediately if there's no data to be read
-         * @param: The session that is shared
-         * @return: None
-         */
-        void parseRestOfTheHeaders()
+        bool listening() const
         {
-            auto self(shared_from_this());
-            boost::asio::async_read_until(self->socket_,
-                                   self->buff, '\r',
-                                   [self](const boost::system::error_code ec,
-                                           std::size_t s) {
-                if (!ec) {
-                    std::string line, ignore;
-                    std::istream stream {&self->buff};
-                    std::getline(stream, line, '\r');
-                    std::getline(stream, ignore, '\n');
-                    self->onReadHeader(line);
-                    if (line.length() == 0) {
-                        self->startSendingPackets();
-                    } else {
-                        self->parseRestOfTheHeaders();
-                    }
-                }
-            });
+            return acceptor_ != nullptr;
         }
 
-        /*
-         * This function reads the first string from the header
-         * delimited by '\r'. Thus, we get the requested URI.
-         * @param: The session object that is shared
-         * @return: None
-         */
-        void readFirstURI()
+        unsigned short port() const
         {
-            auto self(shared_from_this());
-            std::string line;
-            std::string ignore;
-            std::istream stream{&self->buff};
-            std::getline(stream, line, '\r');
-            std::getline(stream, ignore, '\n');
-            std::stringstream ssRequestLine(line);
-            ssRequestLine >> method;
-            ssRequestLine >> url;
-            ssRequestLine >> version;
+            return acceptor_->local_endpoint().port();
         }
 
+    private:
+        boost::asio::io_context &io_context_;
+        session_engine engine_;
+        std::shared_ptr<tcp::acceptor> acceptor_;
+        boost::asio::steady_timer acceptRetry_;     // accepting again after running out of fds
+        std::chrono::milliseconds acceptBackoff_{0};
+        std::shared_ptr<session_pool<session>> sessions_;
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+        std::shared_ptr<session_pool<coro_session>> coroSessions_;
+#endif
+#if defined(WEBSERVER_HAS_IO_URING)
+        std::shared_ptr<uring> ring_;
+        std::shared_ptr<session_pool<uring_session>> uringSessions_;
+        std::unique_ptr<uring_acceptor> uringAcceptor_;
+        // Acceptors of ports no longer listened on, until their ACCEPT leaves the ring
+        std::vector<std::pair<std::shared_ptr<tcp::acceptor>, std::unique_ptr<uring_acceptor>>> retired_;
+
         /*
-         * reads the rest of the header from the client
+         * Sets up the io_uring of this thread to accept through
+         * @param: None
+         * @return: None, connections are accepted by do_accept if
+         *          io_uring isn't usable
          */
-
-        void readAndSendPackets()
+        void setUpRing()
         {
-            auto self(shared_from_this());
-            self->readFirstURI();
-            self->parseRestOfTheHeaders();
+            try {
+                ring_ = std::make_shared<uring>(io_context_);
+            }
+            catch (std::system_error &e) {
+                std::cerr << "io_uring is not available (" << e.what()
+                          << "), using the callback engine" << '\n';
+                return;
+            }
+            uringSessions_ = std::make_shared<session_pool<uring_session>>(io_context_);
         }
+#endif
 
         /*
-         * Invoked when a client is connected.
-         * This functions returns immediately if there is no data to be read
+         * Stops accepting on the port listened on so far
          * @param: None
          * @return: None
          */
-        void do_read()
+        void stopAccepting()
         {
-            auto self(shared_from_this());
-            boost::asio::async_read_until(self->socket_, self->buff,
-                             '\r',
-                             [self, this] (const boost::system::error_code& ec,
-                                     std::size_t s) {
-                if (!ec) {
-                    this->readAndSendPackets();
-                }
-            });
-        }
-
-    public:
-
-        session(tcp::socket socket, boost::asio::io_context& io_context)
-                :  writeStrand(io_context),io_service(io_context),
-                   socket_(std::move(socket))
-                {
-            std::clog << "Client @" << socket_.remote_endpoint().address();
-            std::clog << " with " << socket_.remote_endpoint().port() << '\n';
+            if (!acceptor_) {
+                return;
+            }
+#if defined(WEBSERVER_HAS_IO_URING)
+            retired_.erase(std::remove_if(retired_.begin(), retired_.end(),
+                    [](auto &r) { return r.second->done(); }), retired_.end());
+            if (uringAcceptor_) {
+                uringAcceptor_->stop();
+                retired_.emplace_back(std::move(acceptor_), std::move(uringAcceptor_));
+                return;
+            }
+#endif
+            boost::system::error_code ignored;
+            acceptor_->close(ignored);
         }
 
         /*
-         * Interface provided to accepted client
+         * Hands an accepted client to the configured session engine, or
+         * to the callback engine when it has to speak TLS
+         * @param: the connected socket
+         * @return: None
          */
-        void start()
+        void startSession(tcp::socket socket)
         {
-            do_read();
-        }
-    };
-
-    class server {
-    public:
-        server(boost::asio::io_service &io_context, std::string port)
-        : acceptor_(io_context, tcp::endpoint(tcp::v6(), std::stoi(port)))
-        {
-            acceptor_.set_option(boost::asio::socket_base::reuse_address(true));
-            do_accept(io_context);
+            auto conf = config::instance().current();
+#if defined(BOOST_ASIO_HAS_CO_AWAIT)
+            if (engine_ == session_engine::coroutines && conf->tlsCertificate.empty()) {
+                coroSessions_->acquire()->start(std::move(socket), std::move(conf));
+                return;
+            }
+#endif
+            sessions_->acquire()->start(std::move(socket), std::move(conf));
         }
 
-    private:
-        tcp::acceptor acceptor_;
-
         /*
          * Function that asynchronously accepts client.
          * This functions returns immediately if there's no connection.
-         * Wait is done on boost's internal mechanism
-         * @param: None
+         * Wait is done on boost's internal mechanism. At the connection
+         * limit it stops accepting until a connection closes. When the
+         * process or the system is out of file descriptors or memory the
+         * pending client stays in the backlog and accepting it again
+         * would fail straight away, so it waits a while first, longer
+         * each time up to a second.
+         * @param: the acceptor, it stops once it is closed
          * @return: None
          */
-        void do_accept(boost::asio::io_service &io_context)
+        void do_accept(std::shared_ptr<tcp::acceptor> acceptor)
         {
-            acceptor_.async_accept(
-                    [this, &io_context](boost::system::error_code ec,
+            if (!acceptor->is_open()) {
+                return;     // the server moved to another port
+            }
+            if (!connection_limit::instance().tryAcquire()) {
+                connection_limit::instance().wait([this, acceptor]() {
+                    boost::asio::post(io_context_, [this, acceptor]() { do_accept(acceptor); });
+                });
+                return;
+            }
+            acceptor->async_accept(
+                    [this, acceptor](boost::system::error_code ec,
                             tcp::socket socket) {
                         if (!ec) {
-                            std::make_shared<session>(std::move(socket), io_context)->start();
+                            acceptBackoff_ = std::chrono::milliseconds(0);
+                            startSession(std::move(socket));
+                        } else {
+                            connection_limit::instance().release();
+                            if (outOfResources(ec)) {
+                                retryAccept(acceptor);
+                                return;
+                            }
                         }
-                        do_accept(io_context);
+                        do_accept(acceptor);
             });
         }
+
+        static bool outOfResources(const boost::system::error_code &ec)
+        {
+            return ec == boost::asio::error::no_descriptors             // EMFILE
+                || ec == boost::system::errc::too_many_files_open_in_system
+                || ec == boost::asio::error::no_buffer_space
+                || ec == boost::asio::error::no_memory;
+        }
+
+        /*
+         * Calls do_accept after the backoff, which doubles from 10 ms
+         * @param: the acceptor
+         * @return: None
+         */
+        void retryAccept(std::shared_ptr<tcp::acceptor> acceptor)
+        {
+            acceptBackoff_ = std::min(std::max(acceptBackoff_ * 2, std::chrono::milliseconds(10)),
+                                      std::chrono::milliseconds(1000));
+            if (logging(log_level::error)) {
+                std::cerr << "Out of file descriptors or memory, accepting again in "
+                          << acceptBackoff_.count() << " ms" << '\n';
+            }
+            acceptRetry_.expires_after(acceptBackoff_);
+            acceptRetry_.async_wait([this, acceptor](boost::system::error_code) { do_accept(acceptor); });
+        }
     };
 }
 #endif
@@ -0,0 +1,146 @@
+#ifndef LIB_SESSION_POOL_H
+#define LIB_SESSION_POOL_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+#include <boost/asio/io_context.hpp>
+
+namespace webServer {
+
+    /*
+     * Closed sessions of one io_context, kept for the next connections.
+     * Session is one of the session engines. It carries the read buffer
+     * and the buffer_chain, tens of KiB that are allocated once per
+     * pooled session instead of on every accept; the shared_ptr control
+     * blocks are recycled the same way. Only the
+     * thread running the io_context uses the pool, so there is no lock.
+     * Sessions and control blocks hold the pool alive until they are gone.
+     */
+    template <typename Session>
+    class session_pool : public std::enable_shared_from_this<session_pool<Session>> {
+    public:
+        static constexpr std::size_t maxIdle = 256;   // sessions kept beyond this are freed
+
+        explicit session_pool(boost::asio::io_context &io_context)
+            : io_context_(io_context)
+        {}
+
+        ~session_pool()
+        {
+            for (auto *s : idle_) {
+                delete s;
+            }
+            for (auto *block : blocks_) {
+                ::operator delete(block);
+            }
+        }
+
+        /*
+         * Hands out an idle session, or a new one if there is none.
+         * It comes back to the pool when the last reference is dropped.
+         * @param: None
+         * @return: the session
+         */
+        std::shared_ptr<Session> acquire()
+        {
+            Session *s;
+            if (idle_.empty()) {
+                s = new Session(io_context_);
+            } else {
+                s = idle_.back();
+                idle_.pop_back();
+            }
+            auto self = this->shared_from_this();
+            return std::shared_ptr<Session>(s, recycler{self}, block_allocator<Session>{self});
+        }
+
+    private:
+        struct recycler {
+            std::shared_ptr<session_pool> pool;
+
+            void operator()(Session *s) const
+            {
+                pool->release(s);
+            }
+        };
+
+        template <typename T>
+        struct block_allocator {
+            using value_type = T;
+            std::shared_ptr<session_pool> pool;
+
+            explicit block_allocator(std::shared_ptr<session_pool> p)
+                : pool(std::move(p))
+            {}
+
+            template <typename U>
+            block_allocator(const block_allocator<U> &other)
+                : pool(other.pool)
+            {}
+
+            T *allocate(std::size_t n)
+            {
+                return static_cast<T *>(pool->allocateBlock(n * sizeof(T)));
+            }
+
+            void deallocate(T *p, std::size_t n)
+            {
+                pool->deallocateBlock(p, n * sizeof(T));
+            }
+
+            template <typename U>
+            bool operator==(const block_allocator<U> &other) const
+            {
+                return pool == other.pool;
+            }
+
+            template <typename U>
+            bool operator!=(const block_allocator<U> &other) const
+            {
+                return pool != other.pool;
+            }
+        };
+
+        void release(Session *s)
+        {
+            s->recycle();
+            if (idle_.size() < maxIdle) {
+                idle_.push_back(s);
+            } else {
+                delete s;
+            }
+        }
+
+        // Every control block has the same size, the first one sets it
+        void *allocateBlock(std::size_t size)
+        {
+            if (size == blockSize_ && !blocks_.empty()) {
+                void *block = blocks_.back();
+                blocks_.pop_back();
+                return block;
+            }
+            if (blockSize_ == 0) {
+                blockSize_ = size;
+            }
+            return ::operator new(size);
+        }
+
+        void deallocateBlock(void *block, std::size_t size)
+        {
+            if (size == blockSize_ && blocks_.size() < maxIdle) {
+                blocks_.push_back(block);
+            } else {
+                ::operator delete(block);
+            }
+        }
+
+        boost::asio::io_context &io_context_;
+        std::vector<Session *> idle_;
+        std::vector<void *> blocks_;
+        std::size_t blockSize_ = 0;
+    };
+}
+#endif //LIB_SESSION_POOL_H
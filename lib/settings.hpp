@@ -0,0 +1,68 @@
+#ifndef LIB_SETTINGS_H
+#define LIB_SETTINGS_H
+
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace webServer {
+
+    /* How connections are served */
+    enum class session_engine {
+        callbacks,      // session, completion handlers on the epoll reactor
+        coroutines,     // coro_session, a C++20 coroutine per connection
+        uring           // uring_session, socket I/O through io_uring
+    };
+
+    /* How much is written to std::clog */
+    enum class log_level {
+        off,
+        error,      // things that stop a feature from working
+        info,       // start up and reconfiguration
+        debug       // every connection and request header, slow
+    };
+
+    /*
+     * Values read from the configuration file that the server and
+     * the sessions need at run time.
+     */
+    struct settings {
+        std::vector<unsigned short> ports;  // the first of them that can be bound is listened on, 0 lets the OS pick
+        std::string file;               // file served at "/"
+        std::string root;               // document root, every file under it is served
+        std::size_t threads = 1;        // io_contexts to run, 0 is one per core
+        bool sendfile = true;           // send file bodies with sendfile(2) instead of mmap + write
+        std::size_t chunkSize = 1 << 20; // bodies are sent in chunks of this many bytes
+        std::size_t inflight = 2;       // chunks a session may have mapped or queued at once
+        std::size_t prefetchSegments = 2;   // download segments read ahead into the page cache
+        std::chrono::seconds idleTimeout{5}; // close a connection that sends nothing for this long
+        std::size_t maxRequests = 100;  // requests served on one connection before it is closed
+        std::size_t maxConnections = 10000; // open at once over all threads, 0 for no limit
+        std::size_t maxHeaderSize = 8192;   // longer request headers are answered with 431
+        std::chrono::seconds headerTimeout{10}; // to receive a request header once it started
+        std::chrono::seconds sendTimeout{30};   // a response must progress at minSendRate over this time
+        std::size_t minSendRate = 1024;     // bytes per second
+        std::size_t connectionRate = 0;     // bytes per second sent to one connection, 0 for no limit
+        std::size_t totalRate = 0;          // bytes per second sent to all connections together
+        std::size_t rateBurst = 256 << 10;  // bytes a rate limited connection may send at once
+        std::size_t sendQuantum = 256 << 10; // bytes a session writes per turn before the others
+        session_engine engine = session_engine::callbacks;
+        std::string compressionCache;   // directory for gzip copies, empty disables gzip on the fly
+        std::size_t compressionCacheSize = 256 << 20; // bytes of gzip copies kept
+        std::size_t compressionMinSize = 1024;  // smaller files are sent as they are
+        std::string digestIndex;        // file keeping the digests ETags are made of, empty keeps them in memory
+        std::string cacheControl;       // Cache-Control sent with files, empty sends none
+        std::size_t responseCacheSize = 64 << 20;   // bytes of ready made responses each thread keeps
+        std::size_t responseCacheObject = 64 << 10; // files up to this size are kept whole
+        std::string tlsCertificate;     // PEM certificate chain, empty serves plain HTTP
+        std::string tlsKey;             // PEM private key, empty if it is in the certificate file
+        bool ktls = true;               // let the kernel encrypt responses after the handshake
+        std::string metricsPath = "/metrics";   // url of the Prometheus metrics, empty to turn them off
+        log_level logLevel = log_level::error;
+        std::string accessLog;          // file of the access log, empty turns it off
+        std::size_t accessLogSize = 100 << 20;  // the access log is rotated at this size
+        std::size_t accessLogKeep = 5;  // rotated access logs kept
+    };
+}
+#endif //LIB_SETTINGS_H
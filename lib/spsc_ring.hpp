@@ -0,0 +1,66 @@
+#ifndef LIB_SPSC_RING_H
+#define LIB_SPSC_RING_H
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+
+namespace webServer {
+
+    /*
+     * Bounded queue between exactly one producer thread and one consumer
+     * thread, without locks. head_ and tail_ only ever grow; the slot of
+     * a position is its value modulo Size. The producer keeps its own
+     * copy of head_ and only reloads it when the ring looks full, so a
+     * push rarely touches the consumer's cache line. The consumer takes
+     * everything queued at once and loads tail_ once per drain().
+     */
+    template <typename T, std::size_t Size>
+    class spsc_ring {
+        static_assert(Size > 0 && (Size & (Size - 1)) == 0, "the size must be a power of two");
+
+    public:
+        /*
+         * Producer side
+         * @param: the element to copy in
+         * @return: false if the ring is full, the element is then dropped
+         */
+        bool push(const T &value)
+        {
+            std::size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - headCache_ == Size) {
+                headCache_ = head_.load(std::memory_order_acquire);
+                if (tail - headCache_ == Size) {
+                    return false;
+                }
+            }
+            slots_[tail & (Size - 1)] = value;
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        /*
+         * Consumer side: hands every element queued so far to f
+         * @param: function called with each element in order
+         * @return: number of elements consumed
+         */
+        template <typename F>
+        std::size_t drain(F &&f)
+        {
+            std::size_t head = head_.load(std::memory_order_relaxed);
+            std::size_t tail = tail_.load(std::memory_order_acquire);
+            for (std::size_t i = head; i != tail; ++i) {
+                f(slots_[i & (Size - 1)]);
+            }
+            head_.store(tail, std::memory_order_release);
+            return tail - head;
+        }
+
+    private:
+        alignas(64) std::atomic<std::size_t> head_{0};   // next slot the consumer reads
+        alignas(64) std::atomic<std::size_t> tail_{0};   // next slot the producer writes
+        std::size_t headCache_ = 0;                       // producer's view of head_
+        alignas(64) std::array<T, Size> slots_;
+    };
+}
+#endif //LIB_SPSC_RING_H
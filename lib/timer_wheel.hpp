@@ -0,0 +1,172 @@
+#ifndef LIB_TIMER_WHEEL_H
+#define LIB_TIMER_WHEEL_H
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <boost/asio.hpp>
+
+namespace webServer {
+
+    /*
+     * Coarse deadlines for the connections of one io_context, found with
+     * boost::asio::use_service<timer_wheel>(io_context).
+     *
+     * Giving every connection its own steady_timer costs a timerfd_settime
+     * whenever its deadline moves ahead of the others, and deadlines move
+     * on every request. Here a deadline is a slot in a hashed wheel of
+     * `slots` lists: scheduling and cancelling unlink and link a node in
+     * O(1) without a syscall, and one steady_timer ticks the wheel every
+     * `resolution` while anything is scheduled. Deadlines fire up to one
+     * tick late.
+     */
+    class timer_wheel : public boost::asio::execution_context::service {
+    public:
+        using clock = std::chrono::steady_clock;
+        static constexpr auto resolution = std::chrono::milliseconds(100);
+        static constexpr std::size_t slots = 512;
+
+        static inline boost::asio::execution_context::id id;
+
+        /*
+         * A deadline, embedded in its owner. It must be cancelled before
+         * the owner goes away.
+         */
+        class entry {
+        public:
+            /* @param: called when the deadline passes, with the owner */
+            entry(void (*expired)(void *), void *owner)
+                : expired_(expired), owner_(owner)
+            {}
+
+            entry() = default;  // the heads of the slots
+
+            entry(const entry &) = delete;
+            entry &operator=(const entry &) = delete;
+
+            bool scheduled() const
+            {
+                return prev_ != nullptr;
+            }
+
+        private:
+            friend class timer_wheel;
+            entry *prev_ = nullptr;     // the slot's head sentinel or the previous entry
+            entry *next_ = nullptr;
+            std::uint64_t tick_ = 0;    // tick at which it fires
+            void (*expired_)(void *) = nullptr;
+            void *owner_ = nullptr;
+        };
+
+        explicit timer_wheel(boost::asio::execution_context &context)
+            : service(context),
+              timer_(static_cast<boost::asio::io_context &>(context))
+        {
+            for (auto &head : heads_) {
+                head.prev_ = head.next_ = &head;
+            }
+        }
+
+        /*
+         * (Re)schedules a deadline
+         * @param: the deadline, time from now until it fires
+         * @return: None
+         */
+        void schedule(entry &e, clock::duration after)
+        {
+            unlink(e);
+            auto now = clock::now();
+            if (count_ == 0) {
+                current_ = tickOf(now);
+            }
+            std::uint64_t ticks = (after + resolution - clock::duration(1)) / resolution;
+            e.tick_ = std::max(tickOf(now) + std::max<std::uint64_t>(ticks, 1), current_ + 1);
+            entry &head = heads_[e.tick_ % slots];
+            e.prev_ = &head;
+            e.next_ = head.next_;
+            head.next_->prev_ = &e;
+            head.next_ = &e;
+            if (++count_ == 1) {
+                arm();
+            }
+        }
+
+        /*
+         * Removes a deadline, if it is scheduled
+         * @param: the deadline
+         * @return: None
+         */
+        void cancel(entry &e)
+        {
+            unlink(e);
+        }
+
+        void shutdown() override
+        {
+            timer_.cancel();
+        }
+
+    private:
+        boost::asio::steady_timer timer_;
+        std::array<entry, slots> heads_;    // sentinels of circular lists
+        std::uint64_t current_ = 0;     // last tick whose slot was expired
+        std::size_t count_ = 0;         // entries scheduled
+        bool armed_ = false;
+
+        static std::uint64_t tickOf(clock::time_point t)
+        {
+            return t.time_since_epoch() / resolution;
+        }
+
+        void unlink(entry &e)
+        {
+            if (!e.prev_) {
+                return;
+            }
+            e.prev_->next_ = e.next_;
+            e.next_->prev_ = e.prev_;
+            e.prev_ = e.next_ = nullptr;
+            --count_;
+        }
+
+        void arm()
+        {
+            if (armed_) {
+                return;
+            }
+            armed_ = true;
+            timer_.expires_at(clock::time_point((current_ + 1) * resolution));
+            timer_.async_wait([this](const boost::system::error_code &ec) {
+                armed_ = false;
+                if (!ec) {
+                    advance();
+                }
+            });
+        }
+
+        /* Fires every deadline up to now */
+        void advance()
+        {
+            const std::uint64_t now = tickOf(clock::now());
+            while (current_ < now && count_ > 0) {
+                ++current_;
+                entry &head = heads_[current_ % slots];
+                for (entry *e = head.next_; e != &head;) {
+                    entry *next = e->next_;
+                    if (e->tick_ <= current_) {
+                        unlink(*e);
+                        e->expired_(e->owner_);
+                    }
+                    e = next;
+                }
+            }
+            if (count_ > 0) {
+                current_ = std::max(current_, now);
+                arm();
+            }
+        }
+    };
+}
+#endif //LIB_TIMER_WHEEL_H
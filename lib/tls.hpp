@@ -0,0 +1,283 @@
+#ifndef LIB_TLS_H
+#define LIB_TLS_H
+
+#include <atomic>
+#include <cerrno>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+// Kernel TLS came with OpenSSL 3.0, and distributions may build it without
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+#define WEBSERVER_HAS_KTLS 1
+#endif
+
+namespace webServer {
+
+    /*
+     * The certificate, key and session resumption state every TLS
+     * connection shares. A reload builds a new SSL context and swaps the
+     * pointer, like the router swaps its table, so a renewed certificate
+     * is picked up by new connections. The session ticket keys move over
+     * to the new context, so clients can still resume afterwards.
+     */
+    class tls_context {
+    public:
+        static tls_context &instance()
+        {
+            static tls_context c;
+            return c;
+        }
+
+        /*
+         * Loads the certificate and key. On an error the context in use
+         * so far is kept.
+         * @param: PEM file of the certificate chain (empty turns TLS off),
+         *         PEM file of the private key, whether to let the kernel
+         *         encrypt once the handshake is done
+         * @return: None
+         * @throws: std::runtime_error when the certificate or key can't be loaded
+         */
+        void configure(const std::string &certificate, const std::string &key, bool ktls)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (certificate.empty()) {
+                std::atomic_store(&context_, std::shared_ptr<boost::asio::ssl::context>());
+                return;
+            }
+            auto context = std::make_shared<boost::asio::ssl::context>(boost::asio::ssl::context::tls_server);
+            try {
+                context->set_options(boost::asio::ssl::context::default_workarounds
+                        | boost::asio::ssl::context::no_sslv2 | boost::asio::ssl::context::no_sslv3
+                        | boost::asio::ssl::context::no_tlsv1 | boost::asio::ssl::context::no_tlsv1_1);
+                context->use_certificate_chain_file(certificate);
+                context->use_private_key_file(key.empty() ? certificate : key, boost::asio::ssl::context::pem);
+            }
+            catch (boost::system::system_error &e) {
+                throw std::runtime_error("Can't load the TLS certificate " + certificate + ": " + e.what());
+            }
+            SSL_CTX *ctx = context->native_handle();
+#if defined(WEBSERVER_HAS_KTLS)
+            if (ktls) {
+                SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+            }
+#else
+            if (ktls) {
+                std::cerr << "OpenSSL is built without kernel TLS, records are encrypted in user space\n";
+            }
+#endif
+            // A session_tls writes from buffers that move as the chain is consumed
+            SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+            // TLS 1.3 clients resume with tickets, TLS 1.2 ones may use session ids
+            static const unsigned char sessionContext[] = "webServer";
+            SSL_CTX_set_session_id_context(ctx, sessionContext, sizeof(sessionContext) - 1);
+            SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(ctx, 1 << 16);
+            if (auto previous = std::atomic_load(&context_)) {
+                unsigned char keys[80];
+                if (SSL_CTX_get_tlsext_ticket_keys(previous->native_handle(), keys, sizeof(keys)) == 1) {
+                    SSL_CTX_set_tlsext_ticket_keys(ctx, keys, sizeof(keys));
+                }
+            }
+            std::atomic_store(&context_, std::move(context));
+        }
+
+        /* @return: the context new connections use, nullptr when there is none */
+        std::shared_ptr<boost::asio::ssl::context> current() const
+        {
+            return std::atomic_load(&context_);
+        }
+
+    private:
+        std::mutex mutex_;      // serializes configure()
+        std::shared_ptr<boost::asio::ssl::context> context_;
+
+        tls_context() = default;
+    };
+
+    /*
+     * TLS on one connected socket, driven on its non-blocking descriptor.
+     * asio's ssl::stream isn't used because it encrypts through a memory
+     * BIO; the kernel can only take over the records of a socket BIO.
+     * When it does (kernelSend()), whatever is written to the socket is
+     * encrypted by the kernel, so the connection keeps writing with
+     * writev and sendfile(2) as without TLS. Otherwise responses go
+     * through write(), one record at a time.
+     *
+     * Every call returns would_block when the socket isn't ready; wait
+     * for waitType() and call it again with the same arguments.
+     */
+    class session_tls {
+    public:
+        session_tls() = default;
+        session_tls(const session_tls &) = delete;
+        session_tls &operator=(const session_tls &) = delete;
+
+        ~session_tls()
+        {
+            reset();
+        }
+
+        bool active() const
+        {
+            return ssl_ != nullptr;
+        }
+
+        /*
+         * @param: the shared context, descriptor of the connected socket
+         * @return: false if OpenSSL is out of memory
+         */
+        bool start(std::shared_ptr<boost::asio::ssl::context> context, int fd)
+        {
+            reset();
+            ssl_ = SSL_new(context->native_handle());
+            if (ssl_ == nullptr || SSL_set_fd(ssl_, fd) != 1) {
+                reset();
+                return false;
+            }
+            SSL_set_accept_state(ssl_);
+            context_ = std::move(context);
+            return true;
+        }
+
+        /*
+         * @param: error, would_block while the handshake goes on
+         * @return: true once the handshake is done
+         */
+        bool handshake(boost::system::error_code &ec)
+        {
+            ERR_clear_error();
+            errno = 0;
+            int rc = SSL_do_handshake(ssl_);
+            if (rc != 1) {
+                failed(rc, ec);
+                return false;
+            }
+            return true;
+        }
+
+        /* @return: whether the kernel encrypts what is written to the socket */
+        bool kernelSend() const
+        {
+#if defined(WEBSERVER_HAS_KTLS)
+            return BIO_get_ktls_send(SSL_get_wbio(ssl_)) != 0;
+#else
+            return false;
+#endif
+        }
+
+        bool resumed() const
+        {
+            return SSL_session_reused(ssl_) == 1;
+        }
+
+        std::size_t read(void *data, std::size_t len, boost::system::error_code &ec)
+        {
+            ERR_clear_error();
+            errno = 0;
+            std::size_t n = 0;
+            if (SSL_read_ex(ssl_, data, len, &n) != 1) {
+                failed(0, ec);
+                return 0;
+            }
+            return n;
+        }
+
+        /*
+         * Writes at most one record. A write that has to wait must be
+         * repeated with the length of the first attempt, see pending().
+         * @param: the bytes, how many, error
+         * @return: bytes written
+         */
+        std::size_t write(const void *data, std::size_t len, boost::system::error_code &ec)
+        {
+            ERR_clear_error();
+            errno = 0;
+            std::size_t n = 0;
+            if (SSL_write_ex(ssl_, data, len, &n) != 1) {
+                failed(0, ec);
+                if (ec == boost::asio::error::would_block) {
+                    pending_ = len;
+                }
+                return 0;
+            }
+            pending_ = 0;
+            return n;
+        }
+
+        /* @return: length of the write to repeat, 0 if there is none */
+        std::size_t pending() const
+        {
+            return pending_;
+        }
+
+        /* @return: what the last call that returned would_block waits for */
+        boost::asio::socket_base::wait_type waitType() const
+        {
+            return wantWrite_ ? boost::asio::socket_base::wait_write : boost::asio::socket_base::wait_read;
+        }
+
+        /* Sends close_notify if the socket takes it right away */
+        void shutdown()
+        {
+            if (ssl_ != nullptr && SSL_is_init_finished(ssl_)) {
+                ERR_clear_error();
+                SSL_shutdown(ssl_);
+            }
+        }
+
+        void reset()
+        {
+            if (ssl_ != nullptr) {
+                SSL_free(ssl_);
+                ssl_ = nullptr;
+            }
+            context_.reset();
+            wantWrite_ = false;
+            pending_ = 0;
+        }
+
+    private:
+        SSL *ssl_ = nullptr;
+        std::shared_ptr<boost::asio::ssl::context> context_;
+        bool wantWrite_ = false;    // the last call waits for the socket to be writable
+        std::size_t pending_ = 0;
+
+        void failed(int rc, boost::system::error_code &ec)
+        {
+            int error = SSL_get_error(ssl_, rc);
+            switch (error) {
+                case SSL_ERROR_WANT_READ:
+                    wantWrite_ = false;
+                    ec = boost::asio::error::would_block;
+                    break;
+                case SSL_ERROR_WANT_WRITE:
+                    wantWrite_ = true;
+                    ec = boost::asio::error::would_block;
+                    break;
+                case SSL_ERROR_ZERO_RETURN:
+                    ec = boost::asio::error::eof;
+                    break;
+                case SSL_ERROR_SYSCALL:
+                    if (errno != 0) {
+                        ec.assign(errno, boost::asio::error::get_system_category());
+                    } else {
+                        ec = boost::asio::error::eof;
+                    }
+                    break;
+                default:
+                    ec.assign(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+                    break;
+            }
+            ERR_clear_error();
+        }
+    };
+}
+#endif //LIB_TLS_H
@@ -0,0 +1,122 @@
+#ifndef LIB_TOKEN_BUCKET_H
+#define LIB_TOKEN_BUCKET_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+
+namespace webServer {
+
+    /*
+     * Token bucket limiting the bytes sent to rate per second, with
+     * bursts of up to burst bytes. Instead of a token count it keeps the
+     * time at which the bucket is full again (a "theoretical arrival
+     * time"); sending n bytes pushes that time n / rate later. The whole
+     * state is then one atomic, so the same bucket works for a single
+     * connection and, without a lock, for all threads together.
+     *
+     * available() and consume() are separate so a session can ask before
+     * a write and pay for what the write really took. Threads sharing a
+     * bucket may all spend what they saw available at once; the excess is
+     * paid back by waiting longer afterwards.
+     */
+    class token_bucket {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        /* @param: bytes per second, 0 for no limit, most bytes sent at once */
+        void configure(std::uint64_t rate, std::uint64_t burst)
+        {
+            rate_.store(rate, std::memory_order_relaxed);
+            // The arithmetic below is in nanoseconds, keep it well inside 64 bits
+            burst_.store(std::clamp<std::uint64_t>(burst, 1, std::uint64_t(1) << 32), std::memory_order_relaxed);
+            full_.store(0, std::memory_order_relaxed);
+        }
+
+        bool limited() const
+        {
+            return rate_.load(std::memory_order_relaxed) != 0;
+        }
+
+        /*
+         * @param: the time now
+         * @return: bytes that can be sent now
+         */
+        std::uint64_t available(clock::time_point now) const
+        {
+            std::uint64_t rate = rate_.load(std::memory_order_relaxed);
+            if (rate == 0) {
+                return std::numeric_limits<std::uint64_t>::max();
+            }
+            std::int64_t owed = owedNs(now);
+            std::int64_t capacity = nanoseconds(burst_.load(std::memory_order_relaxed), rate);
+            return owed >= capacity ? 0 : static_cast<std::uint64_t>(capacity - owed) * rate / 1000000000;
+        }
+
+        /*
+         * @param: bytes to be sent, the time now
+         * @return: time until that many bytes are available
+         */
+        clock::duration delay(std::uint64_t bytes, clock::time_point now) const
+        {
+            std::uint64_t rate = rate_.load(std::memory_order_relaxed);
+            if (rate == 0) {
+                return clock::duration::zero();
+            }
+            std::uint64_t burst = burst_.load(std::memory_order_relaxed);
+            std::int64_t wait = owedNs(now) + nanoseconds(std::min(bytes, burst), rate) - nanoseconds(burst, rate);
+            return std::chrono::nanoseconds(std::max<std::int64_t>(wait, 0));
+        }
+
+        /*
+         * Takes bytes out of the bucket, after they were sent
+         * @param: bytes sent, the time now
+         * @return: None
+         */
+        void consume(std::uint64_t bytes, clock::time_point now)
+        {
+            std::uint64_t rate = rate_.load(std::memory_order_relaxed);
+            if (rate == 0) {
+                return;
+            }
+            std::int64_t t = sinceEpoch(now);
+            std::int64_t cost = nanoseconds(bytes, rate);
+            std::int64_t full = full_.load(std::memory_order_relaxed);
+            while (!full_.compare_exchange_weak(full, std::max(full, t) + cost, std::memory_order_relaxed)) {
+            }
+        }
+
+    private:
+        // Atomic as well, so the shared bucket can be reconfigured while it is used
+        std::atomic<std::uint64_t> rate_{0};
+        std::atomic<std::uint64_t> burst_{1};
+        std::atomic<std::int64_t> full_{0};   // nanoseconds since the clock's epoch when the bucket is full
+
+        static std::int64_t sinceEpoch(clock::time_point t)
+        {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count();
+        }
+
+        /* @param: bytes, rate, which is never 0 here */
+        static std::int64_t nanoseconds(std::uint64_t bytes, std::uint64_t rate)
+        {
+            return static_cast<std::int64_t>(bytes * 1000000000 / rate);
+        }
+
+        /* Time it takes to refill what was taken out of the bucket */
+        std::int64_t owedNs(clock::time_point now) const
+        {
+            return std::max<std::int64_t>(full_.load(std::memory_order_relaxed) - sinceEpoch(now), 0);
+        }
+    };
+
+    /* The limit on what all connections are sent together */
+    inline token_bucket &totalBandwidth()
+    {
+        static token_bucket bucket;
+        return bucket;
+    }
+}
+#endif //LIB_TOKEN_BUCKET_H
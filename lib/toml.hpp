@@ -0,0 +1,316 @@
+#ifndef LIB_TOML_H
+#define LIB_TOML_H
+
+#include "errors.hpp"
+#include <cstddef>
+#include <map>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace utility {
+namespace toml {
+
+    /*
+     * A value of the configuration file: a string, number or boolean
+     * kept as the text it was written as, or an array of values.
+     */
+    struct value {
+        std::string text;           // the scalar, without quotes and with escapes resolved
+        std::vector<value> items;   // the elements, if it is an array
+        bool array = false;
+        std::size_t line = 0;       // where it was written, for error messages
+    };
+
+    using table = std::map<std::string, value>;
+    using document = std::map<std::string, table>;  // tables by name, "" holds keys before the first one
+
+    /*
+     * Parser of the TOML the configuration is written in: [tables],
+     * key = value pairs, basic and literal strings, numbers, booleans,
+     * arrays spanning several lines, and # comments anywhere outside a
+     * string. Unquoted words that aren't TOML, like [ ./some_directory ]
+     * in older configuration files, are taken as strings. Inline tables
+     * and multi-line strings aren't supported. It makes one pass over
+     * the text without backtracking.
+     */
+    class parser {
+    public:
+        /*
+         * @param: the whole file
+         * @return: its tables
+         * @throws: InvalidFile naming the line of the first error
+         */
+        static document parse(std::string_view text)
+        {
+            parser p(text);
+            return p.file();
+        }
+
+    private:
+        std::string_view text_;
+        std::size_t pos_ = 0;
+        std::size_t line_ = 1;
+
+        explicit parser(std::string_view text)
+            : text_(text)
+        {}
+
+        bool atEnd() const
+        {
+            return pos_ >= text_.size();
+        }
+
+        char peek() const
+        {
+            return atEnd() ? '\0' : text_[pos_];
+        }
+
+        char next()
+        {
+            char c = text_[pos_++];
+            if (c == '\n') {
+                ++line_;
+            }
+            return c;
+        }
+
+        [[noreturn]] void fail(const std::string &what) const
+        {
+            throw InvalidFile{"Configuration line " + std::to_string(line_) + ": " + what};
+        }
+
+        /* Skips blanks on the line and a comment ending it */
+        void skipBlanks()
+        {
+            while (peek() == ' ' || peek() == '\t' || peek() == '\r') {
+                next();
+            }
+            if (peek() == '#') {
+                while (!atEnd() && peek() != '\n') {
+                    next();
+                }
+            }
+        }
+
+        /* Skips blanks, comments and new lines, as allowed inside arrays */
+        void skipSpace()
+        {
+            for (;;) {
+                skipBlanks();
+                if (peek() != '\n') {
+                    return;
+                }
+                next();
+            }
+        }
+
+        /* Expects nothing but a comment up to the end of the line */
+        void endOfLine()
+        {
+            skipBlanks();
+            if (!atEnd() && next() != '\n') {
+                fail("unexpected text after the value");
+            }
+        }
+
+        document file()
+        {
+            document doc;
+            table *current = &doc[""];
+            while (!atEnd()) {
+                skipSpace();
+                if (atEnd()) {
+                    break;
+                }
+                if (peek() == '[') {
+                    next();
+                    std::string name = key();
+                    while (peek() == '.') {
+                        next();
+                        name += '.';
+                        name += key();
+                    }
+                    skipBlanks();
+                    if (peek() != ']') {
+                        fail("expected ] after the table name");
+                    }
+                    next();
+                    if (doc.count(name) && !doc[name].empty()) {
+                        fail("table [" + name + "] is defined twice");
+                    }
+                    current = &doc[name];
+                    endOfLine();
+                    continue;
+                }
+                std::size_t line = line_;
+                std::string name = key();
+                skipBlanks();
+                if (peek() != '=') {
+                    fail("expected = after " + name);
+                }
+                next();
+                skipBlanks();
+                value v = parseValue();
+                v.line = line;
+                if (!current->emplace(name, std::move(v)).second) {
+                    fail(name + " is set twice");
+                }
+                endOfLine();
+            }
+            return doc;
+        }
+
+        static bool isBareKey(char c)
+        {
+            return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+                    || c == '_' || c == '-';
+        }
+
+        std::string key()
+        {
+            skipBlanks();
+            if (peek() == '"' || peek() == '\'') {
+                return quoted();
+            }
+            std::size_t begin = pos_;
+            while (isBareKey(peek())) {
+                next();
+            }
+            if (pos_ == begin) {
+                fail("expected a key");
+            }
+            return std::string(text_.substr(begin, pos_ - begin));
+        }
+
+        value parseValue()
+        {
+            value v;
+            v.line = line_;
+            if (peek() == '[') {
+                next();
+                v.array = true;
+                skipSpace();
+                while (peek() != ']') {
+                    if (atEnd()) {
+                        fail("unterminated array");
+                    }
+                    v.items.push_back(parseValue());
+                    skipSpace();
+                    if (peek() == ',') {
+                        next();
+                        skipSpace();
+                    } else if (peek() != ']') {
+                        fail("expected , or ] in the array");
+                    }
+                }
+                next();
+            } else if (peek() == '"' || peek() == '\'') {
+                v.text = quoted();
+            } else {
+                v.text = bare();
+            }
+            return v;
+        }
+
+        /* A number, boolean or date, or an unquoted word of an older configuration file */
+        std::string bare()
+        {
+            std::size_t begin = pos_;
+            while (!atEnd() && peek() != ',' && peek() != ']' && peek() != '#' && peek() != '\n') {
+                next();
+            }
+            std::string_view word = text_.substr(begin, pos_ - begin);
+            while (!word.empty() && (word.back() == ' ' || word.back() == '\t' || word.back() == '\r')) {
+                word.remove_suffix(1);
+            }
+            if (word.empty()) {
+                fail("expected a value");
+            }
+            return std::string(word);
+        }
+
+        std::string quoted()
+        {
+            char quote = next();
+            std::string s;
+            for (;;) {
+                if (atEnd() || peek() == '\n') {
+                    fail("unterminated string");
+                }
+                char c = next();
+                if (c == quote) {
+                    return s;
+                }
+                if (c == '\\' && quote == '"') {
+                    escape(s);
+                } else {
+                    s += c;
+                }
+            }
+        }
+
+        void escape(std::string &s)
+        {
+            if (atEnd()) {
+                fail("unterminated string");
+            }
+            char c = next();
+            switch (c) {
+                case 'b': s += '\b'; break;
+                case 't': s += '\t'; break;
+                case 'n': s += '\n'; break;
+                case 'f': s += '\f'; break;
+                case 'r': s += '\r'; break;
+                case '"': s += '"'; break;
+                case '\\': s += '\\'; break;
+                case 'u':
+                case 'U': {
+                    std::size_t digits = c == 'u' ? 4 : 8;
+                    if (text_.size() - pos_ < digits) {
+                        fail("bad unicode escape");
+                    }
+                    std::uint32_t code = 0;
+                    for (std::size_t i = 0; i < digits; ++i) {
+                        char h = next();
+                        code <<= 4;
+                        if (h >= '0' && h <= '9') {
+                            code |= h - '0';
+                        } else if (h >= 'a' && h <= 'f') {
+                            code |= h - 'a' + 10;
+                        } else if (h >= 'A' && h <= 'F') {
+                            code |= h - 'A' + 10;
+                        } else {
+                            fail("bad unicode escape");
+                        }
+                    }
+                    appendUtf8(s, code);
+                    break;
+                }
+                default:
+                    fail(std::string("unknown escape \\") + c);
+            }
+        }
+
+        static void appendUtf8(std::string &s, std::uint32_t code)
+        {
+            if (code < 0x80) {
+                s += static_cast<char>(code);
+            } else if (code < 0x800) {
+                s += static_cast<char>(0xc0 | (code >> 6));
+                s += static_cast<char>(0x80 | (code & 0x3f));
+            } else if (code < 0x10000) {
+                s += static_cast<char>(0xe0 | (code >> 12));
+                s += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                s += static_cast<char>(0x80 | (code & 0x3f));
+            } else {
+                s += static_cast<char>(0xf0 | (code >> 18));
+                s += static_cast<char>(0x80 | ((code >> 12) & 0x3f));
+                s += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+                s += static_cast<char>(0x80 | (code & 0x3f));
+            }
+        }
+    };
+}
+}
+#endif //LIB_TOML_H
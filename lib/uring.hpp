@@ -0,0 +1,490 @@
+#ifndef LIB_URING_H
+#define LIB_URING_H
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+// Sparse file and buffer tables came with Linux 5.13 headers
+#if defined(IORING_RSRC_REGISTER_SPARSE)
+#define WEBSERVER_HAS_IO_URING 1
+
+#include "file_cache.hpp"
+#include <cerrno>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <boost/asio.hpp>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace webServer {
+
+    /*
+     * An io_uring owned by one io_context thread.
+     *
+     * Operations prepared while the io_context runs its handlers are
+     * submitted together by one io_uring_enter posted behind them, so
+     * the sessions of a thread share a syscall per turn of the loop.
+     * More of them than fit in the ring wait in a backlog until the
+     * kernel has taken the ring in. Completions wake the io_context
+     * through an eventfd and are dispatched to the operation each SQE
+     * was prepared for; an operation the kernel refused completes with
+     * the error of io_uring_enter.
+     *
+     * The ring also keeps a table of fixed files for the files being
+     * served and a table of registered buffers the sessions read into.
+     */
+    class uring {
+    public:
+        /* Something waiting for a completion; the SQE's user_data points at it */
+        struct operation {
+            void (*complete)(operation *op, int result, unsigned flags);
+        };
+
+        static constexpr unsigned entries = 256;        // SQ size, the CQ is twice that
+        static constexpr unsigned fileSlots = 256;      // served files kept registered
+        static constexpr unsigned bufferSlots = 1024;   // registered read buffers
+
+        /*
+         * Sets up the ring and its tables
+         * @param: io_context the ring is driven from
+         * @throws: std::system_error when the kernel has no usable io_uring
+         */
+        explicit uring(boost::asio::io_context &io_context)
+            : io_context_(io_context), eventDescriptor_(io_context)
+        {
+            io_uring_params params{};
+            fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+            if (fd_ < 0) {
+                throw std::system_error(errno, std::system_category(), "io_uring_setup");
+            }
+            try {
+                mapRings(params);
+                registerTables();
+                int event = ::eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                if (event < 0) {
+                    throw std::system_error(errno, std::system_category(), "eventfd");
+                }
+                eventDescriptor_.assign(event);
+                if (registerWith(IORING_REGISTER_EVENTFD, &event, 1) < 0) {
+                    throw std::system_error(errno, std::system_category(), "IORING_REGISTER_EVENTFD");
+                }
+            }
+            catch (...) {
+                unmapRings();
+                ::close(fd_);
+                throw;
+            }
+            waitForCompletions();
+        }
+
+        uring(const uring &) = delete;
+        uring &operator=(const uring &) = delete;
+
+        ~uring()
+        {
+            boost::system::error_code ignored;
+            eventDescriptor_.close(ignored);
+            unmapRings();
+            ::close(fd_);
+        }
+
+        /*
+         * Takes the next submission queue entry and schedules the submit.
+         * The SQE must be filled in before the handler returns.
+         * @param: the operation completing it, nullptr to ignore the completion
+         * @return: a zeroed SQE whose user_data is set
+         */
+        io_uring_sqe *prepare(operation *op)
+        {
+            io_uring_sqe *sqe;
+            if (backlog_.empty() && sqTail_ - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) < sqEntries_) {
+                unsigned index = sqTail_ & sqMask_;
+                sqe = &sqes_[index];
+                sqArray_[index] = index;
+                ++sqTail_;
+            } else {
+                // Every entry of the ring still waits for the kernel
+                sqe = &backlog_.emplace_back();
+            }
+            std::memset(sqe, 0, sizeof(*sqe));
+            sqe->user_data = reinterpret_cast<std::uint64_t>(op);
+            if (!submitPosted_) {
+                submitPosted_ = true;
+                boost::asio::post(io_context_, [this]() { submit(); });
+            }
+            return sqe;
+        }
+
+        /*
+         * Registers a buffer that READ_FIXED can read into
+         * @param: the buffer, which must stay put until it is unregistered
+         * @return: its index, -1 if the table is full
+         */
+        int registerBuffer(void *data, std::size_t length)
+        {
+            if (freeBuffers_.empty()) {
+                return -1;
+            }
+            int slot = freeBuffers_.back();
+            iovec iov{data, length};
+            if (updateTable(IORING_REGISTER_BUFFERS_UPDATE, slot, &iov) < 0) {
+                return -1;
+            }
+            freeBuffers_.pop_back();
+            return slot;
+        }
+
+        void unregisterBuffer(int slot)
+        {
+            iovec iov{nullptr, 0};
+            updateTable(IORING_REGISTER_BUFFERS_UPDATE, slot, &iov);
+            freeBuffers_.push_back(slot);
+        }
+
+        /*
+         * Finds or makes the fixed file slot of a served file and pins it
+         * until releaseFileSlot(): SPLICE looks the slot up when the kernel
+         * issues it, so the slot must not be rebound meanwhile. When the
+         * table is full the unpinned slot that was filled longest ago is
+         * reused.
+         * @param: the file
+         * @return: the slot, -1 if the file can't be registered
+         */
+        int fileSlot(const std::shared_ptr<const cached_file> &file)
+        {
+            auto it = files_.find(file.get());
+            if (it != files_.end()) {
+                if (it->second.file.lock() == file) {
+                    ++slotPins_[it->second.slot];
+                    return it->second.slot;
+                }
+                // A new file at the address of one that is gone
+                dropFileSlot(it->second.slot);
+                files_.erase(it);
+            }
+            int slot = -1;
+            if (!freeFiles_.empty()) {
+                slot = freeFiles_.back();
+                freeFiles_.pop_back();
+            } else {
+                for (unsigned tried = 0; tried < fileSlots && slot < 0; ++tried) {
+                    if (slotPins_[nextEviction_] == 0) {
+                        slot = nextEviction_;
+                        files_.erase(slotFiles_[slot]);
+                    }
+                    nextEviction_ = (nextEviction_ + 1) % fileSlots;
+                }
+                if (slot < 0) {
+                    return -1;      // every slot is in use
+                }
+            }
+            int fd = file->fd();
+            if (updateTable(IORING_REGISTER_FILES_UPDATE2, slot, &fd) < 0) {
+                slotFiles_[slot] = nullptr;
+                freeFiles_.push_back(slot);
+                return -1;
+            }
+            slotFiles_[slot] = file.get();
+            files_[file.get()] = {file, slot};
+            ++slotPins_[slot];
+            return slot;
+        }
+
+        /*
+         * Unpins a slot fileSlot() returned, once the operation using it
+         * has completed
+         * @param: the slot
+         */
+        void releaseFileSlot(int slot)
+        {
+            if (--slotPins_[slot] == 0 && slotFiles_[slot] == nullptr) {
+                freeFiles_.push_back(slot);
+            }
+        }
+
+        /*
+         * Hands the prepared SQEs to the kernel and dispatches the
+         * completions that are already there
+         * @param: None
+         * @return: None
+         */
+        void submit()
+        {
+            submitPosted_ = false;
+            enterPending();
+            reap();
+        }
+
+    private:
+        boost::asio::io_context &io_context_;
+        int fd_ = -1;
+        boost::asio::posix::stream_descriptor eventDescriptor_;
+        std::uint64_t eventCount_ = 0;
+
+        void *sqRing_ = MAP_FAILED;
+        void *cqRing_ = MAP_FAILED;
+        std::size_t sqRingSize_ = 0;
+        std::size_t cqRingSize_ = 0;
+        io_uring_sqe *sqes_ = nullptr;
+        std::size_t sqesSize_ = 0;
+
+        unsigned *sqHead_ = nullptr;
+        unsigned *sqKernelTail_ = nullptr;
+        unsigned *sqArray_ = nullptr;
+        unsigned *sqFlags_ = nullptr;
+        unsigned sqMask_ = 0;
+        unsigned sqEntries_ = 0;
+        unsigned sqTail_ = 0;       // tail as far as prepare() got
+        unsigned submitted_ = 0;    // tail the kernel has consumed
+        bool submitPosted_ = false;
+        std::deque<io_uring_sqe> backlog_;  // prepared while the ring was full, in order
+
+        unsigned *cqHead_ = nullptr;
+        unsigned *cqTail_ = nullptr;
+        unsigned *cqFlags_ = nullptr;   // nullptr before Linux 5.8
+        unsigned cqMask_ = 0;
+        io_uring_cqe *cqes_ = nullptr;
+
+        struct file_entry {
+            std::weak_ptr<const cached_file> file;
+            int slot;
+        };
+        std::unordered_map<const cached_file *, file_entry> files_;
+        std::vector<const cached_file *> slotFiles_;
+        std::vector<unsigned> slotPins_;    // operations using each slot
+        std::vector<int> freeFiles_;
+        unsigned nextEviction_ = 0;
+        std::vector<int> freeBuffers_;
+
+        /*
+         * io_uring_enter for every SQE prepared so far, the backlog
+         * moving into the ring as the kernel takes it in. Operations that
+         * complete inline are reaped by the caller, so the eventfd is off
+         * meanwhile and they don't wake the reactor once more.
+         */
+        void enterPending()
+        {
+            notifyCompletions(false);
+            for (;;) {
+                unsigned head = __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE);
+                while (!backlog_.empty() && sqTail_ - head < sqEntries_) {
+                    unsigned index = sqTail_ & sqMask_;
+                    sqes_[index] = backlog_.front();
+                    sqArray_[index] = index;
+                    ++sqTail_;
+                    backlog_.pop_front();
+                }
+                __atomic_store_n(sqKernelTail_, sqTail_, __ATOMIC_RELEASE);
+                if (submitted_ == sqTail_) {
+                    break;
+                }
+                int n = enter(sqTail_ - submitted_);
+                if (n > 0) {
+                    submitted_ += n;
+                } else if (n == 0 || errno == EAGAIN || errno == EBUSY) {
+                    // The completion queue is full, try again once it is reaped
+                    if (!submitPosted_) {
+                        submitPosted_ = true;
+                        boost::asio::post(io_context_, [this]() { submit(); });
+                    }
+                    break;
+                } else if (errno != EINTR) {
+                    failPending(errno);
+                    break;
+                }
+            }
+            notifyCompletions(true);
+        }
+
+        /*
+         * Takes back the SQEs io_uring_enter refused and completes their
+         * operations with its error, as the kernel would have
+         * @param: the errno of io_uring_enter
+         */
+        void failPending(int error)
+        {
+            std::vector<operation *> failed;
+            for (unsigned i = submitted_; i != sqTail_; ++i) {
+                failed.push_back(reinterpret_cast<operation *>(sqes_[i & sqMask_].user_data));
+            }
+            for (auto &sqe : backlog_) {
+                failed.push_back(reinterpret_cast<operation *>(sqe.user_data));
+            }
+            backlog_.clear();
+            sqTail_ = submitted_;
+            __atomic_store_n(sqKernelTail_, sqTail_, __ATOMIC_RELEASE);
+            for (auto op : failed) {
+                if (op) {
+                    op->complete(op, -error, 0);
+                }
+            }
+        }
+
+        void notifyCompletions(bool on)
+        {
+            if (cqFlags_) {
+                __atomic_store_n(cqFlags_, on ? 0u : IORING_CQ_EVENTFD_DISABLED, __ATOMIC_RELEASE);
+            }
+        }
+
+        int enter(unsigned toSubmit, unsigned flags = 0)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_enter, fd_, toSubmit, 0, flags, nullptr, 0));
+        }
+
+        int registerWith(unsigned opcode, void *arg, unsigned count)
+        {
+            return static_cast<int>(::syscall(__NR_io_uring_register, fd_, opcode, arg, count));
+        }
+
+        int updateTable(unsigned opcode, int slot, void *data)
+        {
+            io_uring_rsrc_update2 update{};
+            update.offset = slot;
+            update.data = reinterpret_cast<std::uint64_t>(data);
+            update.nr = 1;
+            return registerWith(opcode, &update, sizeof(update));
+        }
+
+        void mapRings(const io_uring_params &params)
+        {
+            sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+            cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+            bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+            if (single) {
+                sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+            }
+            sqRing_ = ::mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+            if (sqRing_ == MAP_FAILED) {
+                throw std::system_error(errno, std::system_category(), "mmap SQ ring");
+            }
+            cqRing_ = single ? sqRing_ : ::mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE,
+                                                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+            if (cqRing_ == MAP_FAILED) {
+                throw std::system_error(errno, std::system_category(), "mmap CQ ring");
+            }
+            sqesSize_ = params.sq_entries * sizeof(io_uring_sqe);
+            void *sqes = ::mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+            if (sqes == MAP_FAILED) {
+                throw std::system_error(errno, std::system_category(), "mmap SQEs");
+            }
+            sqes_ = static_cast<io_uring_sqe *>(sqes);
+
+            auto sq = static_cast<char *>(sqRing_);
+            sqHead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+            sqKernelTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+            sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+            sqFlags_ = reinterpret_cast<unsigned *>(sq + params.sq_off.flags);
+            sqMask_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+            sqEntries_ = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_entries);
+            sqTail_ = submitted_ = *sqKernelTail_;
+
+            auto cq = static_cast<char *>(cqRing_);
+            cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+            cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+            cqMask_ = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+            cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+            if (params.cq_off.flags) {
+                cqFlags_ = reinterpret_cast<unsigned *>(cq + params.cq_off.flags);
+            }
+        }
+
+        void unmapRings()
+        {
+            if (sqes_) {
+                ::munmap(sqes_, sqesSize_);
+            }
+            if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+                ::munmap(cqRing_, cqRingSize_);
+            }
+            if (sqRing_ != MAP_FAILED) {
+                ::munmap(sqRing_, sqRingSize_);
+            }
+        }
+
+        /* Forgets the file of a slot, which is free once nothing uses it */
+        void dropFileSlot(int slot)
+        {
+            slotFiles_[slot] = nullptr;
+            if (slotPins_[slot] == 0) {
+                freeFiles_.push_back(slot);
+            }
+        }
+
+        void registerTables()
+        {
+            io_uring_rsrc_register files{};
+            files.nr = fileSlots;
+            files.flags = IORING_RSRC_REGISTER_SPARSE;
+            if (registerWith(IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+                throw std::system_error(errno, std::system_category(), "IORING_REGISTER_FILES2");
+            }
+            io_uring_rsrc_register buffers{};
+            buffers.nr = bufferSlots;
+            buffers.flags = IORING_RSRC_REGISTER_SPARSE;
+            if (registerWith(IORING_REGISTER_BUFFERS2, &buffers, sizeof(buffers)) < 0) {
+                throw std::system_error(errno, std::system_category(), "IORING_REGISTER_BUFFERS2");
+            }
+            slotFiles_.assign(fileSlots, nullptr);
+            slotPins_.assign(fileSlots, 0);
+            for (int i = fileSlots; i-- > 0;) {
+                freeFiles_.push_back(i);
+            }
+            for (int i = bufferSlots; i-- > 0;) {
+                freeBuffers_.push_back(i);
+            }
+        }
+
+        /*
+         * Dispatches every completion in the CQ ring. Completions that
+         * found the ring full wait in the kernel, which only moves them
+         * into the ring, without a word on the eventfd, when asked to.
+         */
+        void reap()
+        {
+            unsigned head = *cqHead_;
+            for (;;) {
+                while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+                    const io_uring_cqe &cqe = cqes_[head & cqMask_];
+                    auto op = reinterpret_cast<operation *>(cqe.user_data);
+                    int result = cqe.res;
+                    unsigned flags = cqe.flags;
+                    // Free the entry before the handler runs, it may prepare more
+                    __atomic_store_n(cqHead_, ++head, __ATOMIC_RELEASE);
+                    if (op) {
+                        op->complete(op, result, flags);
+                    }
+                }
+                if (!(__atomic_load_n(sqFlags_, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)
+                        || enter(0, IORING_ENTER_GETEVENTS) < 0) {
+                    break;
+                }
+            }
+        }
+
+        void waitForCompletions()
+        {
+            eventDescriptor_.async_read_some(boost::asio::buffer(&eventCount_, sizeof(eventCount_)),
+                    [this](const boost::system::error_code &ec, std::size_t) {
+                        if (ec == boost::asio::error::operation_aborted) {
+                            return;
+                        }
+                        reap();
+                        waitForCompletions();
+                    });
+        }
+    };
+}
+#endif // IORING_RSRC_REGISTER_SPARSE
+#endif //LIB_URING_H
@@ -0,0 +1,578 @@
+#ifndef LIB_URING_SESSION_H
+#define LIB_URING_SESSION_H
+
+#include "connection.hpp"
+#include "uring.hpp"
+
+#if defined(WEBSERVER_HAS_IO_URING)
+#include <deque>
+#include <functional>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+namespace webServer {
+
+    /*
+     * Session engine that does its socket I/O through the thread's
+     * uring instead of the epoll reactor. Requests are read with
+     * READ_FIXED into readBuf_, which stays registered with the ring for
+     * as long as the session lives. Responses leave with one SENDMSG
+     * gathering the header and the mapped file data, and large file
+     * ranges are spliced from the fixed file to the socket through a
+     * pipe, the io_uring counterpart of sendfile(2).
+     *
+     * When the client keeps the connection alive the read of its next
+     * request goes into the ring together with the response, so a
+     * keep-alive request costs one io_uring_enter. A session has at most
+     * a read and a write in the ring and keeps itself alive in inflight_
+     * until both have completed.
+     */
+    class uring_session : public connection, public std::enable_shared_from_this<uring_session> {
+        struct pending_operation : uring::operation {
+            uring_session *session;
+            void (uring_session::*next)(int result);
+        };
+
+        std::shared_ptr<uring> ring_;
+        pending_operation readOp_;
+        pending_operation writeOp_;
+        unsigned pending_ = 0;                      // operations in the ring
+        std::shared_ptr<uring_session> inflight_;  // set while pending_ > 0
+        bool reading_ = false;
+        bool writing_ = false;
+        bool readAhead_ = false;                    // the next request is read while this response is sent
+        int readBuffer_ = -1;                       // registered buffer slot of readBuf_
+        int fileSlot_ = -1;                         // fixed file slot pinned by the splice into the pipe
+        int pipe_[2] = {-1, -1};                    // file ranges are spliced through this
+        std::size_t pipeSize_ = 0;
+        std::size_t piped_ = 0;                     // bytes in the pipe not yet on the socket
+        std::array<iovec, buffer_chain::capacity> iov_;
+        msghdr msg_{};
+
+        /*
+         * Takes an SQE that completes into the given member
+         * @param: readOp_ or writeOp_, the member called with the result
+         * @return: the SQE to fill in
+         */
+        io_uring_sqe *prepare(pending_operation &op, void (uring_session::*next)(int))
+        {
+            op.next = next;
+            if (pending_++ == 0) {
+                inflight_ = shared_from_this();
+            }
+            return ring_->prepare(&op);
+        }
+
+        static void complete(uring::operation *op, int result, unsigned)
+        {
+            auto &pending = *static_cast<pending_operation *>(op);
+            auto session = pending.session;
+            std::shared_ptr<uring_session> self;
+            if (--session->pending_ == 0) {
+                self = std::move(session->inflight_);
+            }
+            (session->*pending.next)(result);
+        }
+
+        void doRead()
+        {
+            waitForRequest();
+            readSocket();
+        }
+
+        void readSocket()
+        {
+            reading_ = true;
+            auto sqe = prepare(readOp_, &uring_session::onReadDone);
+            sqe->fd = socket_.native_handle();
+            sqe->addr = reinterpret_cast<std::uint64_t>(readBuf_.data() + readLen_);
+            sqe->len = readBuf_.size() - readLen_;
+            if (readBuffer_ >= 0) {
+                sqe->opcode = IORING_OP_READ_FIXED;
+                sqe->buf_index = readBuffer_;
+            } else {
+                sqe->opcode = IORING_OP_RECV;
+            }
+        }
+
+        void onReadDone(int result)
+        {
+            reading_ = false;
+            if (result <= 0) {
+                // The client went away or the connection timed out
+                if (writing_) {
+                    keepAlive_ = false;
+                }
+                return;
+            }
+            readLen_ += result;
+            if (!writing_) {
+                onRead();
+            }
+        }
+
+        /*
+         * Feeds what has been read so far to the parser. Sends the
+         * response once the whole request header is in, reads more otherwise.
+         */
+        void onRead()
+        {
+            switch (parseRequest()) {
+                case http::parse_result::complete:
+                    keepAlive_ = wantsKeepAlive();
+                    prepareResponse();
+                    writing_ = true;
+                    send();
+                    if (keepAlive_ && readLen_ == parser_.consumed() && socket_.is_open()) {
+                        nextRequest();
+                        readAhead_ = true;
+                        readSocket();
+                    }
+                    break;
+                case http::parse_result::incomplete:
+                    if (headerTooLong()) {
+                        sendError(headerTooLarge, error_kind::header_too_large);
+                    } else {
+                        doRead();
+                    }
+                    break;
+                case http::parse_result::bad:
+                    sendError(badRequest, error_kind::bad_request);
+                    break;
+            }
+        }
+
+        void sendError(std::string_view response, error_kind kind)
+        {
+            prepareError(response, kind);
+            writing_ = true;
+            send();
+        }
+
+        bool splices(const buffer_chain::entry &e) const
+        {
+            return use_sendfile_ && e.isFile() && (e.length > smallBody || e.file->data() == nullptr);
+        }
+
+        /*
+         * Sends the next piece of the chain, at most a quantum and what
+         * the rate limits allow: a SENDMSG of everything that can be
+         * gathered, or a splice of the file range at the front. The
+         * completions of the ring already interleave the sessions, so
+         * the send_scheduler only comes in for the rate limits.
+         * @param: None
+         * @return: None
+         */
+        void send()
+        {
+            if (chain_.empty()) {
+                onResponseSent();
+                return;
+            }
+            std::size_t allowed = allowance(conf_->sendQuantum);
+            if (allowed == 0) {
+                throttle(shared_from_this());
+                return;
+            }
+            if (splices(chain_.front())) {
+                spliceToPipe(allowed);
+                return;
+            }
+            const std::size_t window = conf_->chunkSize;
+            auto bufs = chain_.gather(allowed, window, window * conf_->inflight,
+                    [this](const buffer_chain::entry &e) { return splices(e); });
+            std::size_t n = 0;
+            for (const auto &b : bufs) {
+                iov_[n].iov_base = const_cast<void *>(b.data());
+                iov_[n].iov_len = b.size();
+                ++n;
+            }
+            msg_ = msghdr{};
+            msg_.msg_iov = iov_.data();
+            msg_.msg_iovlen = n;
+            auto sqe = prepare(writeOp_, &uring_session::onSent);
+            sqe->opcode = IORING_OP_SENDMSG;
+            sqe->fd = socket_.native_handle();
+            sqe->addr = reinterpret_cast<std::uint64_t>(&msg_);
+            sqe->len = 1;
+            sqe->msg_flags = MSG_NOSIGNAL;
+        }
+
+        /* A rate limit lets the session go on */
+        static void resume(void *owner)
+        {
+            static_cast<uring_session *>(static_cast<connection *>(owner))->send();
+        }
+
+        void onSent(int result)
+        {
+            if (result < 0) {
+                fail();
+                return;
+            }
+            chain_.consume(result);
+            countSent(result);
+            send();
+        }
+
+        /*
+         * First half of a splice: moves up to a pipe full of the file range
+         * at the front of the chain into the pipe
+         * @param: most bytes to move
+         */
+        void spliceToPipe(std::size_t limit)
+        {
+            auto &range = chain_.front();
+            if (!openPipe() || (fileSlot_ = ring_->fileSlot(range.file)) < 0) {
+                sendFromMapping();
+                return;
+            }
+            auto sqe = prepare(writeOp_, &uring_session::onPiped);
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->fd = pipe_[1];
+            sqe->off = static_cast<std::uint64_t>(-1);
+            sqe->splice_fd_in = fileSlot_;
+            sqe->splice_off_in = range.offset;
+            sqe->len = std::min({range.length, conf_->chunkSize, pipeSize_, limit});
+            sqe->splice_flags = SPLICE_F_FD_IN_FIXED | SPLICE_F_MOVE;
+        }
+
+        void onPiped(int result)
+        {
+            ring_->releaseFileSlot(fileSlot_);
+            fileSlot_ = -1;
+            if (result == -EINVAL && piped_ == 0) {
+                sendFromMapping();  // the file system can't splice
+                return;
+            }
+            if (result <= 0) {
+                fail();             // an error, or the file shrunk underneath us
+                return;
+            }
+            piped_ = result;
+            spliceToSocket();
+        }
+
+        /*
+         * Second half of a splice: moves what is in the pipe to the socket
+         */
+        void spliceToSocket()
+        {
+            auto sqe = prepare(writeOp_, &uring_session::onSpliced);
+            sqe->opcode = IORING_OP_SPLICE;
+            sqe->fd = socket_.native_handle();
+            sqe->off = static_cast<std::uint64_t>(-1);
+            sqe->splice_fd_in = pipe_[0];
+            sqe->splice_off_in = static_cast<std::uint64_t>(-1);
+            sqe->len = piped_;
+            sqe->splice_flags = SPLICE_F_MOVE;
+        }
+
+        void onSpliced(int result)
+        {
+            if (result <= 0) {
+                fail();
+                return;
+            }
+            piped_ -= result;
+            chain_.consume(result);
+            countSent(result);
+            if (piped_ > 0) {
+                spliceToSocket();
+            } else {
+                send();
+            }
+        }
+
+        void sendFromMapping()
+        {
+            if (!chain_.front().file->data()) {
+                fail();
+                return;
+            }
+            use_sendfile_ = false;
+            send();
+        }
+
+        bool openPipe()
+        {
+            if (pipe_[0] >= 0) {
+                return true;
+            }
+            if (::pipe2(pipe_, O_CLOEXEC) != 0) {
+                pipe_[0] = pipe_[1] = -1;
+                return false;
+            }
+            // A bigger pipe moves a whole chunk per splice
+            int size = ::fcntl(pipe_[1], F_SETPIPE_SZ, static_cast<int>(std::min<std::size_t>(conf_->chunkSize, 1 << 20)));
+            pipeSize_ = size > 0 ? size : ::fcntl(pipe_[1], F_GETPIPE_SZ);
+            return true;
+        }
+
+        void closePipe()
+        {
+            if (pipe_[0] >= 0) {
+                ::close(pipe_[0]);
+                ::close(pipe_[1]);
+                pipe_[0] = pipe_[1] = -1;
+            }
+            piped_ = 0;
+        }
+
+        /*
+         * Gives up on the response. Bytes left in the pipe belong to it,
+         * so the pipe goes as well.
+         */
+        void fail()
+        {
+            if (piped_ > 0) {
+                closePipe();
+            }
+            abortResponse();
+        }
+
+        /*
+         * Closes the connection or gets ready for the next request,
+         * which may already be waiting in readBuf_ if the client pipelines.
+         */
+        void onResponseSent()
+        {
+            writing_ = false;
+            countResponse();
+            if (!keepAlive_ || !socket_.is_open()) {
+                boost::system::error_code ignored;
+                socket_.shutdown(tcp::socket::shutdown_send, ignored);
+                return;
+            }
+            if (readAhead_) {
+                readAhead_ = false;
+                if (reading_) {
+                    waitForRequest();
+                } else {
+                    onRead();       // the next request came in with the response
+                }
+                return;
+            }
+            nextRequest();
+            if (readLen_ > 0) {
+                onRead();
+            } else {
+                doRead();
+            }
+        }
+
+    public:
+        explicit uring_session(boost::asio::io_context &io_context)
+            : connection(io_context, &uring_session::resume)
+        {
+            readOp_.complete = writeOp_.complete = &uring_session::complete;
+            readOp_.session = writeOp_.session = this;
+        }
+
+        ~uring_session()
+        {
+            if (readBuffer_ >= 0) {
+                ring_->unregisterBuffer(readBuffer_);
+            }
+            closePipe();
+        }
+
+        /*
+         * Interface provided to accepted client
+         * @param: the connected socket, settings for the connection, the
+         *         ring of this thread
+         * @return: None
+         */
+        void start(tcp::socket socket, std::shared_ptr<const settings> conf, std::shared_ptr<uring> ring)
+        {
+            accept(std::move(socket), std::move(conf));
+            if (!ring_) {
+                ring_ = std::move(ring);
+                readBuffer_ = ring_->registerBuffer(readBuf_.data(), readBuf_.size());
+            }
+            doRead();
+        }
+
+        void recycle()
+        {
+            if (piped_ > 0) {
+                closePipe();
+            }
+            writing_ = readAhead_ = false;
+            connection::recycle();
+        }
+    };
+
+    /*
+     * Accepts connections on a listening socket through the ring, with
+     * one multishot ACCEPT where the kernel has it. Under a connection
+     * limit every ACCEPT is armed with a slot taken beforehand, so the
+     * multishot one isn't used then: when a limit is configured while
+     * it is armed it is cancelled at the next connection, and the
+     * connections it brings in past the limit are parked, unserved,
+     * until a slot comes free.
+     */
+    class uring_acceptor : uring::operation {
+    public:
+        using handler = std::function<void(tcp::socket)>;
+
+        uring_acceptor(boost::asio::io_context &io_context, std::shared_ptr<uring> ring,
+                       int listener, handler onAccept)
+            : io_context_(io_context), ring_(std::move(ring)), listener_(listener),
+              onAccept_(std::move(onAccept))
+        {
+            complete = &uring_acceptor::accepted;
+            arm();
+        }
+
+        /*
+         * Stops accepting. Shutting the listening socket down completes
+         * the ACCEPT in the ring; the acceptor must be kept until then.
+         * @param: None
+         * @return: None
+         */
+        void stop()
+        {
+            stopped_ = true;
+            ::shutdown(listener_, SHUT_RDWR);
+            for (int fd : parked_) {
+                ::close(fd);
+            }
+            parked_.clear();
+        }
+
+        /* @return: whether the acceptor is stopped and out of the ring */
+        bool done() const
+        {
+            return stopped_ && !armed_;
+        }
+
+    private:
+        boost::asio::io_context &io_context_;
+        std::shared_ptr<uring> ring_;
+        int listener_;
+        handler onAccept_;
+#if defined(IORING_ACCEPT_MULTISHOT)
+        bool multishotSupported_ = true;
+#else
+        bool multishotSupported_ = false;
+#endif
+        bool multishot_ = false;    // the pending ACCEPT is multishot
+        bool reserved_ = false;     // a connection_limit slot is taken for the pending ACCEPT
+        bool armed_ = false;        // an ACCEPT is in the ring
+        bool cancelling_ = false;   // the multishot ACCEPT is being cancelled
+        bool stopped_ = false;
+        std::deque<int> parked_;    // accepted past the limit, waiting for a slot
+
+        void arm()
+        {
+            if (stopped_) {
+                return;
+            }
+            auto &limit = connection_limit::instance();
+            // Connections parked by the multishot ACCEPT come first
+            while (!parked_.empty()) {
+                if (!limit.tryAcquire()) {
+                    waitForSlot();
+                    return;
+                }
+                int fd = parked_.front();
+                parked_.pop_front();
+                start(fd);
+            }
+            multishot_ = multishotSupported_ && !limit.limited();
+            if (!multishot_) {
+                if (!limit.tryAcquire()) {
+                    waitForSlot();
+                    return;
+                }
+                reserved_ = true;
+            }
+            armed_ = true;
+            auto sqe = ring_->prepare(this);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = listener_;
+            sqe->accept_flags = SOCK_CLOEXEC;
+#if defined(IORING_ACCEPT_MULTISHOT)
+            if (multishot_) {
+                sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            }
+#endif
+        }
+
+        void waitForSlot()
+        {
+            connection_limit::instance().wait([this]() {
+                boost::asio::post(io_context_, [this]() { arm(); });
+            });
+        }
+
+        /*
+         * Takes the multishot ACCEPT out of the ring, which completes it
+         * with -ECANCELED and arms a single one
+         */
+        void cancel()
+        {
+            if (cancelling_) {
+                return;
+            }
+            cancelling_ = true;
+            auto sqe = ring_->prepare(nullptr);
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = reinterpret_cast<std::uint64_t>(static_cast<uring::operation *>(this));
+        }
+
+        /* Hands an accepted socket, for which a slot is taken, to onAccept_ */
+        void start(int fd)
+        {
+            tcp::socket socket(io_context_);
+            boost::system::error_code ec;
+            socket.assign(tcp::v6(), fd, ec);
+            if (ec) {
+                ::close(fd);
+                connection_limit::instance().release();
+            } else {
+                onAccept_(std::move(socket));
+            }
+        }
+
+        static void accepted(uring::operation *op, int result, unsigned flags)
+        {
+            auto &self = *static_cast<uring_acceptor *>(op);
+            self.armed_ = false;
+#if defined(IORING_CQE_F_MORE)
+            self.armed_ = flags & IORING_CQE_F_MORE;
+#endif
+            if (!self.armed_) {
+                self.cancelling_ = false;
+            }
+            if (result == -EINVAL && self.multishot_ && !self.stopped_) {
+                self.multishotSupported_ = false;   // an older kernel
+                self.arm();
+                return;
+            }
+            if (result >= 0) {
+                if (self.reserved_ || connection_limit::instance().tryAcquire()) {
+                    self.start(result);
+                } else if (self.stopped_) {
+                    ::close(result);
+                } else {
+                    self.parked_.push_back(result);
+                }
+            } else if (self.reserved_) {
+                connection_limit::instance().release();
+            }
+            self.reserved_ = false;
+            if (self.armed_) {
+                // The multishot accept is still armed, it can't wait for slots
+                if (connection_limit::instance().limited()) {
+                    self.cancel();
+                }
+                return;
+            }
+            self.arm();
+        }
+    };
+}
+#endif // WEBSERVER_HAS_IO_URING
+#endif //LIB_URING_SESSION_H
@@ -2,31 +2,38 @@
 #define LIB_UTILITY_H
 
 #include "errors.hpp"
+#include "settings.hpp"
+#include "toml.hpp"
+#include <algorithm>
+#include <charconv>
 #include <fstream>
 #include <cstdlib>
+#include <initializer_list>
 #include <iostream>
-#include <regex>
-#include <list>
+#include <iterator>
+#include <memory>
+#include <set>
 #include <utility>
 #include <map>
-#include <boost/algorithm/string.hpp>
 
 namespace utility {
-    using MT1 = std::list<std::pair<std::string, std::string>>;
-    using MT2 = std::map<std::string, MT1>;
 
-    std::pair<std::ifstream, bool> getConfFile(int &ac, char *av[])
+    /*
+     * Checks the command line
+     * @param: argument count and values of main
+     * @return: path of the configuration file, empty if it can't be used
+     */
+    std::string getConfPath(int ac, char *av[])
     {
-        std::ifstream ifs;
         try {
             if (ac != 2) {
                 throw InvalidUsage {"Invalid use of the program\n"};
             }
-            ifs.open(av[1]);
+            std::ifstream ifs(av[1]);
             if (!ifs.is_open()) {
                 throw FileNotFound {"Supplied file can't be found\n", av[1]};
             }
-            return {std::move(ifs),true}; 
+            return av[1];
         }
         catch(FileNotFound &e) {
             std::cerr << e.getErrMsg() << '\n';
@@ -34,70 +41,218 @@ namespace utility {
         catch (InvalidUsage &e) {
             std::cerr << e.getErrMsg() << '\n';
         }
-        return {std::move(ifs), false};
+        return "";
     }
 
-    auto checkCommentOrList([](const std::string &s, const auto ch) {
-            auto it = std::begin(s);
-            const auto is_present (
-                    std::find_if(it, std::next(it, 1), [&ch] (auto c) {
-                        return c == ch;
-            }));
-            return (std::distance(it, is_present) == 0);
-    });
-
-    std::ifstream parseRest(std::ifstream &&ifs,
-            MT2 &confFileMetaData, std::string s)
-    {
-        std::string line;
-        MT1 dataPair;
-        auto keyValue ([](auto s) {
-                std::regex rgx ("(\\w+)\\s?=\\s?\\[\\s?(.*?)\\s?\\]", std::regex::icase);
-                std::smatch match;
-                if (!std::regex_search(s,match,rgx)) {
-                throw InvalidFile {"Unknown configuration file"};
+    /*
+     * Typed lookups in the parsed configuration file. Every key is
+     * written as a list, key = [ value ], and a single value means its
+     * first element; a plain key = value works as well. A value that
+     * doesn't have the expected type, or isn't one of the words a key
+     * takes, is an error naming the key and its line, not a silent default.
+     */
+    class conf_reader {
+    public:
+        explicit conf_reader(const toml::document &doc)
+            : doc_(doc)
+        {}
+
+        /*
+         * @param: table, key, value if the key isn't set
+         * @return: the first value, empty for an empty list
+         */
+        std::string text(const std::string &table, const std::string &key, const std::string &fallback)
+        {
+            auto v = find(table, key);
+            if (!v) {
+                return fallback;
+            }
+            return v->array ? (v->items.empty() ? "" : v->items.front().text) : v->text;
+        }
+
+        /*
+         * @param: table, key, value if the key isn't set, the values it may have
+         * @return: the first value
+         */
+        std::string choice(const std::string &table, const std::string &key, const std::string &fallback,
+                           std::initializer_list<const char *> allowed)
+        {
+            auto v = find(table, key);
+            if (!v || (v->array && v->items.empty())) {
+                return fallback;
+            }
+            const toml::value &item = v->array ? v->items.front() : *v;
+            std::string names;
+            for (auto name : allowed) {
+                if (item.text == name) {
+                    return item.text;
                 }
-                return std::pair<std::string, std::string>{match[1], match[2]};
-                });
-        while(std::getline(ifs, line)) {
-            if (line.empty()) {
-                break;
+                names += names.empty() ? "" : ", ";
+                names += name;
             }
-            dataPair.push_back({keyValue(line)});
+            throw InvalidFile{"Configuration line " + std::to_string(item.line) + ": [" + table + "] "
+                              + key + " must be one of " + names};
         }
-        confFileMetaData.insert({s, dataPair});
-        return std::move(ifs);
-    }
 
-    MT2 parseConfFile(std::ifstream &ifs)
-    {
-        std::string line;
-        MT2 confFileMetaData;
-        while (std::getline(ifs, line)) {
-            auto filtered (utility::checkCommentOrList(line, '#'));
-            if (!filtered)  {
-                auto header (utility::checkCommentOrList(line, '['));
-                if (header) {
-                    ifs = utility::parseRest(std::move(ifs),
-                                confFileMetaData, line);
+        std::uint64_t number(const std::string &table, const std::string &key, std::uint64_t fallback)
+        {
+            auto v = find(table, key);
+            if (!v || (v->array && v->items.empty())) {
+                return fallback;
+            }
+            return toNumber(table, key, v->array ? v->items.front() : *v);
+        }
+
+        std::chrono::seconds seconds(const std::string &table, const std::string &key, std::uint64_t fallback)
+        {
+            return std::chrono::seconds(number(table, key, fallback));
+        }
+
+        /* @return: every value of the key as a number */
+        std::vector<std::uint64_t> numbers(const std::string &table, const std::string &key)
+        {
+            std::vector<std::uint64_t> result;
+            auto v = find(table, key);
+            if (!v) {
+                return result;
+            }
+            if (!v->array) {
+                result.push_back(toNumber(table, key, *v));
+            }
+            for (auto &item : v->items) {
+                result.push_back(toNumber(table, key, item));
+            }
+            return result;
+        }
+
+        /* @return: "[table] key" of every key that was never looked up */
+        std::vector<std::string> unused() const
+        {
+            std::vector<std::string> keys;
+            for (auto &table : doc_) {
+                if (table.first == "metadata" || table.first == "dependencies") {
+                    continue;   // only there for people reading the file
                 }
+                for (auto &key : table.second) {
+                    if (!used_.count({table.first, key.first})) {
+                        keys.push_back('[' + table.first + "] " + key.first);
+                    }
+                }
+            }
+            return keys;
+        }
+
+    private:
+        const toml::document &doc_;
+        std::set<std::pair<std::string, std::string>> used_;
+
+        const toml::value *find(const std::string &table, const std::string &key)
+        {
+            used_.insert({table, key});
+            auto t = doc_.find(table);
+            if (t == doc_.end()) {
+                return nullptr;
             }
+            auto v = t->second.find(key);
+            return v == t->second.end() ? nullptr : &v->second;
         }
-        ifs.close();
-        return confFileMetaData;
+
+        static std::uint64_t toNumber(const std::string &table, const std::string &key, const toml::value &v)
+        {
+            std::string digits = v.text;
+            digits.erase(std::remove(digits.begin(), digits.end(), '_'), digits.end());
+            std::uint64_t n = 0;
+            auto end = digits.data() + digits.size();
+            auto result = std::from_chars(digits.data(), end, n);
+            if (v.array || digits.empty() || result.ec != std::errc() || result.ptr != end) {
+                throw InvalidFile{"Configuration line " + std::to_string(v.line) + ": [" + table + "] "
+                                  + key + " must be a whole number"};
+            }
+            return n;
+        }
+    };
+
+    /*
+     * Builds the run time settings from the parsed configuration file
+     * @param: parsed configuration
+     * @return: settings used by the server
+     */
+    webServer::settings loadSettings(const toml::document &doc)
+    {
+        conf_reader r(doc);
+        webServer::settings conf;
+        for (auto port : r.numbers("port", "port")) {
+            if (port > 65535) {
+                throw InvalidFile{"Configuration: [port] " + std::to_string(port) + " is not a port"};
+            }
+            conf.ports.push_back(static_cast<unsigned short>(port));
+        }
+        conf.threads = r.number("threads", "threads", 1);
+        conf.file = r.text("file", "file", "");
+        conf.root = r.text("file", "root", "");
+        conf.sendfile = r.choice("transfer", "mode", "sendfile", {"sendfile", "mmap"}) == "sendfile";
+        conf.chunkSize = std::max<std::size_t>(4096, r.number("transfer", "chunk", 1048576));
+        conf.inflight = std::max<std::size_t>(1, r.number("transfer", "inflight", 2));
+        conf.prefetchSegments = r.number("transfer", "prefetch", 2);
+        conf.idleTimeout = r.seconds("connection", "idle", 5);
+        conf.maxRequests = std::max<std::size_t>(1, r.number("connection", "max_requests", 100));
+        conf.maxConnections = r.number("limits", "max_connections", 10000);
+        conf.maxHeaderSize = std::max<std::size_t>(1024, r.number("limits", "header_size", 8192));
+        conf.headerTimeout = std::max(std::chrono::seconds(1), r.seconds("limits", "header_timeout", 10));
+        conf.sendTimeout = std::max(std::chrono::seconds(1), r.seconds("limits", "send_timeout", 30));
+        conf.minSendRate = r.number("limits", "min_send_rate", 1024);
+        conf.connectionRate = r.number("rate_limit", "connection", 0);
+        conf.totalRate = r.number("rate_limit", "total", 0);
+        conf.rateBurst = std::max<std::size_t>(4096, r.number("rate_limit", "burst", 262144));
+        conf.sendQuantum = std::max<std::size_t>(4096, r.number("scheduler", "quantum", 262144));
+        auto engine = r.choice("connection", "engine", "callbacks", {"callbacks", "coroutines", "uring"});
+        if (engine == "coroutines") {
+            conf.engine = webServer::session_engine::coroutines;
+        } else if (engine == "uring") {
+            conf.engine = webServer::session_engine::uring;
+        }
+        conf.compressionCache = r.text("compression", "cache", "");
+        conf.compressionCacheSize = r.number("compression", "cache_size", 268435456);
+        conf.compressionMinSize = r.number("compression", "min_size", 1024);
+        conf.digestIndex = r.text("caching", "index", "");
+        conf.cacheControl = r.text("caching", "cache_control", "");
+        conf.responseCacheSize = r.number("caching", "memory", 67108864);
+        conf.responseCacheObject = r.number("caching", "object_size", 65536);
+        conf.tlsCertificate = r.text("tls", "certificate", "");
+        conf.tlsKey = r.text("tls", "key", "");
+        conf.ktls = r.choice("tls", "ktls", "true", {"true", "false"}) == "true";
+        conf.metricsPath = r.text("metrics", "path", "/metrics");
+        conf.accessLog = r.text("log", "access", "");
+        conf.accessLogSize = r.number("log", "access_size", 104857600);
+        conf.accessLogKeep = r.number("log", "access_keep", 5);
+        auto level = r.choice("log", "level", "error", {"off", "error", "info", "debug"});
+        if (level == "off") {
+            conf.logLevel = webServer::log_level::off;
+        } else if (level == "info") {
+            conf.logLevel = webServer::log_level::info;
+        } else if (level == "debug") {
+            conf.logLevel = webServer::log_level::debug;
+        }
+        for (auto &key : r.unused()) {
+            std::cerr << "Unknown configuration key " << key << '\n';
+        }
+        return conf;
     }
 
-    std::string searchForKey(MT2& keyValue, const std::string s)
-    {       
-        std::list<std::string> results;
-        auto search = keyValue.find(s);
-        if (search != keyValue.end()) {
-            auto sec = search->second;
-            auto text = sec.front().second;
-            boost::split(results, text,
-                    [](char c){return c == ',';});
-        }
-        return results.front();
+    /*
+     * Reads and parses the configuration file
+     * @param: its path
+     * @return: the settings it holds
+     * @throws: FileNotFound, InvalidFile
+     */
+    std::shared_ptr<const webServer::settings> loadConfFile(const std::string &path)
+    {
+        std::ifstream ifs(path, std::ios::binary);
+        if (!ifs.is_open()) {
+            throw FileNotFound {"Supplied file can't be found\n", path};
+        }
+        std::string text{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()};
+        return std::make_shared<const webServer::settings>(loadSettings(toml::parser::parse(text)));
     }
 
 }
@@ -0,0 +1,127 @@
+#ifndef LIB_XXHASH_H
+#define LIB_XXHASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace webServer {
+
+    /*
+     * XXH64, the 64-bit xxHash of Yann Collet, computed incrementally.
+     * Four independent lanes eat 32 bytes per round, so it hashes about
+     * as fast as memory can be read. It isn't a cryptographic hash; it
+     * tells versions of a file apart, which is all an ETag has to do.
+     */
+    class xxh64 {
+    public:
+        explicit xxh64(std::uint64_t seed = 0)
+            : lanes_{seed + prime1 + prime2, seed + prime2, seed, seed - prime1}, seed_(seed)
+        {}
+
+        void update(const void *data, std::size_t len)
+        {
+            auto p = static_cast<const unsigned char *>(data);
+            total_ += len;
+            if (buffered_ + len < 32) {
+                std::memcpy(buffer_ + buffered_, p, len);
+                buffered_ += len;
+                return;
+            }
+            if (buffered_ > 0) {
+                std::size_t fill = 32 - buffered_;
+                std::memcpy(buffer_ + buffered_, p, fill);
+                stripe(buffer_);
+                p += fill;
+                len -= fill;
+                buffered_ = 0;
+            }
+            for (; len >= 32; p += 32, len -= 32) {
+                stripe(p);
+            }
+            std::memcpy(buffer_, p, len);
+            buffered_ = len;
+        }
+
+        std::uint64_t digest() const
+        {
+            std::uint64_t h;
+            if (total_ >= 32) {
+                h = rotl(lanes_[0], 1) + rotl(lanes_[1], 7) + rotl(lanes_[2], 12) + rotl(lanes_[3], 18);
+                for (auto lane : lanes_) {
+                    h = (h ^ round(0, lane)) * prime1 + prime4;
+                }
+            } else {
+                h = seed_ + prime5;
+            }
+            h += total_;
+            const unsigned char *p = buffer_;
+            std::size_t len = buffered_;
+            for (; len >= 8; p += 8, len -= 8) {
+                h = rotl(h ^ round(0, read64(p)), 27) * prime1 + prime4;
+            }
+            if (len >= 4) {
+                h = rotl(h ^ (read32(p) * prime1), 23) * prime2 + prime3;
+                p += 4;
+                len -= 4;
+            }
+            for (; len > 0; ++p, --len) {
+                h = rotl(h ^ (*p * prime5), 11) * prime1;
+            }
+            h ^= h >> 33;
+            h *= prime2;
+            h ^= h >> 29;
+            h *= prime3;
+            h ^= h >> 32;
+            return h;
+        }
+
+    private:
+        static constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ull;
+        static constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4Full;
+        static constexpr std::uint64_t prime3 = 0x165667B19E3779F9ull;
+        static constexpr std::uint64_t prime4 = 0x85EBCA77C2B2AE63ull;
+        static constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ull;
+
+        std::uint64_t lanes_[4];
+        std::uint64_t seed_;
+        std::uint64_t total_ = 0;
+        unsigned char buffer_[32];
+        std::size_t buffered_ = 0;
+
+        static std::uint64_t rotl(std::uint64_t x, int r)
+        {
+            return (x << r) | (x >> (64 - r));
+        }
+
+        // Little endian loads, like every target of this server
+        static std::uint64_t read64(const unsigned char *p)
+        {
+            std::uint64_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        static std::uint64_t read32(const unsigned char *p)
+        {
+            std::uint32_t v;
+            std::memcpy(&v, p, sizeof(v));
+            return v;
+        }
+
+        static std::uint64_t round(std::uint64_t acc, std::uint64_t input)
+        {
+            acc += input * prime2;
+            return rotl(acc, 31) * prime1;
+        }
+
+        void stripe(const unsigned char *p)
+        {
+            lanes_[0] = round(lanes_[0], read64(p));
+            lanes_[1] = round(lanes_[1], read64(p + 8));
+            lanes_[2] = round(lanes_[2], read64(p + 16));
+            lanes_[3] = round(lanes_[3], read64(p + 24));
+        }
+    };
+}
+#endif //LIB_XXHASH_H
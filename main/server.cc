@@ -1,31 +1,34 @@
-#include "../lib/server.hpp"
+#include "../lib/pool.hpp"
 #include "../lib/utility.hpp"
 
 int main(int ac, char *av[])
 {
-    using utility::MT2;
-
-    std::pair<std::ifstream, bool> ifs = utility::getConfFile(ac, av);
-    if (ifs.second) {
+    std::string path = utility::getConfPath(ac, av);
+    if (!path.empty()) {
         try {
-            MT2 keyValue;
-            keyValue = utility::parseConfFile(ifs.first);
-            std::string portNumber = utility::searchForKey(keyValue, "[port]");
-            boost::asio::io_context io;
-            webServer::server s{io, portNumber};
-            std::cout << "Server is running at " << portNumber << '\n';
-            io.run();
+            auto conf = utility::loadConfFile(path);
+#if !defined(BOOST_ASIO_HAS_CO_AWAIT)
+            if (conf->engine == webServer::session_engine::coroutines) {
+                std::cerr << "Built without coroutine support, using the callback engine" << '\n';
+            }
+#endif
+            webServer::io_context_pool pool{conf, [path]() { return utility::loadConfFile(path); }, path};
+            std::cout << "Server is running at " << pool.port()
+                << " on " << pool.size() << " thread(s)" << '\n';
+            pool.run();
         }
         catch (InvalidFile &e) {
             std::cout << e.what() << '\n'
                 << e.getErrMsg() << '\n';
+            return EXIT_FAILURE;
         }
         catch (std::exception& e) {
             std::cerr << "Exception: " << e.what() << "\n";
+            return EXIT_FAILURE;
         }
     }
     else {
         std::cout << "failed" << '\n';
         std::exit(EXIT_FAILURE);
     }
-}
\ No newline at end of file
+}
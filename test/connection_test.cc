@@ -0,0 +1,440 @@
+/*
+ * Behaviour of connection: how requests are turned down and which
+ * response is built for them. Nothing is sent, the tests look at the
+ * parser result and at what is queued in chain_ like an engine would.
+ */
+#include "../lib/connection.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <regex>
+#include <string>
+#include <thread>
+#include <sys/time.h>
+#include <gtest/gtest.h>
+#include <unistd.h>
+
+namespace {
+    /* A connection fed one request through its read buffer */
+    class test_connection : public webServer::connection {
+    public:
+        explicit test_connection(boost::asio::io_context &io)
+            : connection(io)
+        {
+            auto conf = std::make_shared<webServer::settings>();
+            conf->maxHeaderSize = 1024;
+            conf_ = conf;
+            stats_ = &webServer::metrics::local();
+        }
+
+        /* Appends bytes as if they had been read from the socket */
+        webServer::http::parse_result read(const std::string &bytes)
+        {
+            readLen_ += bytes.copy(readBuf_.data() + readLen_, readBuf_.size() - readLen_);
+            return parseRequest();
+        }
+
+        bool tooLong() const
+        {
+            return headerTooLong();
+        }
+
+        /*
+         * @param: a whole request, the file to serve instead of the
+         *         file_cache's, which may not have been hashed yet
+         * @return: the response queued for it, header and body
+         */
+        std::string respond(const std::string &request, std::shared_ptr<const webServer::cached_file> file = nullptr)
+        {
+            chain_.clear();
+            readLen_ = 0;
+            resetRequest();
+            if (read(request) != webServer::http::parse_result::complete) {
+                return {};
+            }
+            // Served in place of the file the file_cache has for the url
+            file_ = identity_ = std::move(file);
+            keepAlive_ = wantsKeepAlive();
+            prepareResponse();
+            std::string response;
+            chain_.copy(response, SIZE_MAX);
+            return response;
+        }
+    };
+
+    /*
+     * A file served at "/", 1000 bytes of 0123456789... last modified
+     * at 1000000000, and a later gzip copy of it next to it. The
+     * directory they are in is the document root and also holds a file
+     * of a few segments, /large, and an empty one, /empty.
+     */
+    class served_file : public ::testing::Test {
+    protected:
+        static constexpr std::size_t size = 1000;
+        static constexpr std::size_t largeSize = (5 << 20) / 2 + 7;
+        static inline std::string dir;
+        static inline std::string path;
+        static inline std::string content;
+        static inline std::string large;
+        static constexpr const char *compressed = "not really gzip";
+
+        static void SetUpTestSuite()
+        {
+            char name[] = "/tmp/connection_testXXXXXX";
+            ASSERT_NE(::mkdtemp(name), nullptr);
+            dir = name;
+            path = dir + "/file";
+            for (std::size_t i = 0; i < size; ++i) {
+                content += static_cast<char>('0' + i % 10);
+            }
+            for (std::size_t i = 0; i < largeSize; ++i) {
+                large += static_cast<char>(i * 7 % 251);
+            }
+            write(path, content);
+            write(path + ".gz", compressed);
+            write(dir + "/large", large);
+            write(dir + "/empty", "");
+            timeval times[2] = {{1000000000, 0}, {1000000000, 0}};
+            ::utimes(path.c_str(), times);
+            times[0].tv_sec = times[1].tv_sec = 1000000100;
+            ::utimes((path + ".gz").c_str(), times);
+            webServer::router::instance().rebuild(path, dir);
+        }
+
+        static void TearDownTestSuite()
+        {
+            for (const char *name : {"/file", "/file.gz", "/large", "/empty"}) {
+                ::unlink((dir + name).c_str());
+            }
+            ::rmdir(dir.c_str());
+        }
+
+        static void write(const std::string &to, const std::string &bytes)
+        {
+            FILE *file = std::fopen(to.c_str(), "w");
+            ASSERT_NE(file, nullptr);
+            std::fwrite(bytes.data(), 1, bytes.size(), file);
+            std::fclose(file);
+        }
+
+        /* @return: the quoted ETag of a file, once it has been hashed */
+        static std::string etag(const std::string &of = path)
+        {
+            auto file = webServer::file_cache::instance().get(of);
+            std::uint64_t digest = 0;
+            for (int i = 0; i < 500 && !file->digest(digest); ++i) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            char tag[19];
+            std::snprintf(tag, sizeof(tag), "\"%016llx\"", static_cast<unsigned long long>(digest));
+            return tag;
+        }
+
+        static std::string lastModified()
+        {
+            return webServer::file_cache::instance().get(path)->lastModified();
+        }
+
+        static std::string status(const std::string &response)
+        {
+            return response.substr(0, response.find("\r\n"));
+        }
+
+        /* @return: the value of a header of the response, empty if it has none */
+        static std::string header(const std::string &response, const std::string &name)
+        {
+            auto begin = response.find("\r\n" + name + ": ");
+            if (begin == std::string::npos) {
+                return {};
+            }
+            begin += name.size() + 4;
+            return response.substr(begin, response.find("\r\n", begin) - begin);
+        }
+
+        static std::string body(const std::string &response)
+        {
+            auto end = response.find("\r\n\r\n");
+            return end == std::string::npos ? std::string() : response.substr(end + 4);
+        }
+
+        boost::asio::io_context io;
+        test_connection c{io};
+    };
+}
+
+TEST(Connection, TurnsDownHeadersOverTheLimit)
+{
+    boost::asio::io_context io;
+    test_connection c(io);
+    std::string filler(1000, 'a');
+    EXPECT_EQ(c.read("GET / HTTP/1.1\r\nX-Filler: " + filler), webServer::http::parse_result::incomplete);
+    EXPECT_TRUE(c.tooLong());
+}
+
+TEST(Connection, TurnsDownCompleteHeadersOverTheLimit)
+{
+    boost::asio::io_context io;
+    test_connection c(io);
+    std::string filler(1000, 'a');
+    // Read in one go, the header is complete but still too long
+    EXPECT_EQ(c.read("GET / HTTP/1.1\r\nX-Filler: " + filler + "\r\n\r\n"),
+              webServer::http::parse_result::incomplete);
+    EXPECT_TRUE(c.tooLong());
+}
+
+TEST(Connection, AcceptsHeadersWithinTheLimit)
+{
+    boost::asio::io_context io;
+    test_connection c(io);
+    EXPECT_EQ(c.read("GET / HTTP/1.1\r\n"), webServer::http::parse_result::incomplete);
+    EXPECT_FALSE(c.tooLong());
+    EXPECT_EQ(c.read("Host: x\r\n\r\n"), webServer::http::parse_result::complete);
+}
+
+TEST_F(served_file, SendsOneRange)
+{
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: bytes=10-19\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 206 Partial Content");
+    EXPECT_NE(response.find("Content-Range: bytes 10-19/1000\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), content.substr(10, 10));
+}
+
+TEST_F(served_file, SendsSuffixAndOpenEndedRanges)
+{
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: bytes=-5\r\n\r\n");
+    EXPECT_NE(response.find("Content-Range: bytes 995-999/1000\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), content.substr(995));
+    response = c.respond("GET / HTTP/1.1\r\nRange: bytes=990-5000\r\n\r\n");
+    EXPECT_NE(response.find("Content-Range: bytes 990-999/1000\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), content.substr(990));
+}
+
+TEST_F(served_file, AnswersRangesPastTheEndWith416)
+{
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: bytes=1000-\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 416 Range Not Satisfiable");
+    EXPECT_NE(response.find("Content-Range: bytes */1000\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), "");
+}
+
+TEST_F(served_file, IgnoresMoreThanMaxRanges)
+{
+    std::string range = "bytes=0-0";
+    for (std::size_t i = 1; i <= 16; ++i) {
+        range += "," + std::to_string(i * 10) + "-" + std::to_string(i * 10);
+    }
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: " + range + "\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 200 OK");
+    EXPECT_EQ(body(response), content);
+}
+
+TEST_F(served_file, SendsOverlappingRangesOnce)
+{
+    std::string range = "bytes=0-";
+    for (std::size_t i = 1; i < 16; ++i) {
+        range += ",0-";
+    }
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: " + range + "\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 206 Partial Content");
+    EXPECT_NE(response.find("Content-Length: 1000\r\n"), std::string::npos);
+    EXPECT_EQ(body(response), content);
+}
+
+TEST_F(served_file, SendsMultipleRangesAsMultipart)
+{
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: bytes=900-909,0-4\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 206 Partial Content");
+    EXPECT_NE(response.find("Content-Type: multipart/byteranges; boundary="), std::string::npos);
+    // Sorted by offset
+    auto first = response.find("Content-Range: bytes 0-4/1000\r\n\r\n01234\r\n");
+    auto second = response.find("Content-Range: bytes 900-909/1000\r\n\r\n0123456789\r\n");
+    EXPECT_NE(first, std::string::npos);
+    EXPECT_NE(second, std::string::npos);
+    EXPECT_LT(first, second);
+}
+
+TEST_F(served_file, AppliesRangesWhenIfRangeMatches)
+{
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: bytes=0-9\r\nIf-Range: " + etag() + "\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 206 Partial Content");
+    response = c.respond("GET / HTTP/1.1\r\nRange: bytes=0-9\r\nIf-Range: " + lastModified() + "\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 206 Partial Content");
+    EXPECT_EQ(body(response), content.substr(0, 10));
+}
+
+TEST_F(served_file, SendsTheWholeFileWhenIfRangeDoesNot)
+{
+    for (std::string ifRange : {std::string("\"0000000000000000\""), "W/" + etag(),
+                                std::string("Sun, 06 Nov 1994 08:49:37 GMT"), std::string("yesterday")}) {
+        auto response = c.respond("GET / HTTP/1.1\r\nRange: bytes=0-9\r\nIf-Range: " + ifRange + "\r\n\r\n");
+        EXPECT_EQ(status(response), "HTTP/1.1 200 OK") << ifRange;
+        EXPECT_EQ(body(response), content) << ifRange;
+    }
+}
+
+TEST_F(served_file, SendsTheWholeFileWhenIfRangeDoesNotMatchAnUnsatisfiableRange)
+{
+    // If-Range is looked at first, a stale client gets the file rather than 416
+    auto response = c.respond("GET / HTTP/1.1\r\nRange: bytes=5000-\r\nIf-Range: \"0000000000000000\"\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 200 OK");
+}
+
+TEST_F(served_file, CachedResponsesLetGoOfTheFile)
+{
+    std::weak_ptr<const webServer::cached_file> file = webServer::file_cache::instance().get(path);
+    EXPECT_EQ(status(c.respond("GET / HTTP/1.1\r\n\r\n")), "HTTP/1.1 200 OK");
+    // The response stays cached, the file is dropped once the file_cache lets go of it
+    webServer::file_cache::instance().invalidate(path);
+    EXPECT_NE(webServer::file_cache::instance().get(path), file.lock());
+    c.respond("bad\r\n\r\n");
+    for (int i = 0; i < 500 && !file.expired(); ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT_TRUE(file.expired());
+    auto response = c.respond("GET / HTTP/1.1\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 200 OK");
+    EXPECT_EQ(body(response), content);
+}
+
+TEST_F(served_file, AnswersIfNoneMatchWith304)
+{
+    auto tag = etag();
+    for (std::string ifNoneMatch : {tag, "W/" + tag, std::string("*"), "\"0000000000000000\", " + tag}) {
+        auto response = c.respond("GET / HTTP/1.1\r\nIf-None-Match: " + ifNoneMatch + "\r\n\r\n");
+        EXPECT_EQ(status(response), "HTTP/1.1 304 Not Modified") << ifNoneMatch;
+        EXPECT_EQ(header(response, "ETag"), tag) << ifNoneMatch;
+        EXPECT_EQ(body(response), "") << ifNoneMatch;
+    }
+    auto response = c.respond("GET / HTTP/1.1\r\nIf-None-Match: \"0000000000000000\"\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 200 OK");
+    EXPECT_EQ(body(response), content);
+}
+
+TEST_F(served_file, AnswersIfModifiedSinceWith304)
+{
+    EXPECT_EQ(lastModified(), "Sun, 09 Sep 2001 01:46:40 GMT");
+    for (const char *since : {"Sun, 09 Sep 2001 01:46:40 GMT", "Mon, 10 Sep 2001 00:00:00 GMT"}) {
+        auto response = c.respond(std::string("GET / HTTP/1.1\r\nIf-Modified-Since: ") + since + "\r\n\r\n");
+        EXPECT_EQ(status(response), "HTTP/1.1 304 Not Modified") << since;
+    }
+    for (const char *since : {"Sun, 09 Sep 2001 01:46:39 GMT", "not a date"}) {
+        auto response = c.respond(std::string("GET / HTTP/1.1\r\nIf-Modified-Since: ") + since + "\r\n\r\n");
+        EXPECT_EQ(status(response), "HTTP/1.1 200 OK") << since;
+    }
+}
+
+TEST_F(served_file, LooksAtIfNoneMatchBeforeIfModifiedSince)
+{
+    auto response = c.respond("GET / HTTP/1.1\r\nIf-None-Match: \"0000000000000000\"\r\n"
+                              "If-Modified-Since: " + lastModified() + "\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 200 OK");
+    response = c.respond("GET / HTTP/1.1\r\nIf-None-Match: " + etag() + "\r\n"
+                         "If-Modified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 304 Not Modified");
+}
+
+TEST_F(served_file, DatesCompressedResponsesByTheFile)
+{
+    auto response = c.respond("GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\n\r\n");
+    EXPECT_EQ(header(response, "Content-Encoding"), "gzip");
+    EXPECT_EQ(body(response), compressed);
+    // Not the date of the copy, which changes whenever it is made again
+    EXPECT_EQ(header(response, "Last-Modified"), lastModified());
+    response = c.respond("GET / HTTP/1.1\r\nAccept-Encoding: gzip\r\nIf-Modified-Since: " + lastModified()
+                         + "\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 304 Not Modified");
+    EXPECT_EQ(header(response, "Last-Modified"), lastModified());
+}
+
+namespace {
+    /* A segment listed in a manifest */
+    struct segment {
+        std::size_t offset;
+        std::size_t length;
+        std::string xxh64;
+    };
+
+    std::vector<segment> segments(const std::string &manifest)
+    {
+        static const std::regex entry("\\{\"offset\":(\\d+),\"length\":(\\d+),\"xxh64\":\"([0-9a-f]{16})\"\\}");
+        std::vector<segment> found;
+        for (std::sregex_iterator it(manifest.begin(), manifest.end(), entry), end; it != end; ++it) {
+            found.push_back({std::stoul((*it)[1]), std::stoul((*it)[2]), (*it)[3]});
+        }
+        return found;
+    }
+
+    std::string xxh64(std::string_view bytes)
+    {
+        webServer::xxh64 h;
+        h.update(bytes.data(), bytes.size());
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(h.digest()));
+        return hex;
+    }
+}
+
+TEST(Manifest, SegmentsAreWholeMebibytesAndAtMost64)
+{
+    EXPECT_EQ(webServer::digest_index::segmentSize(0), 1u << 20);
+    EXPECT_EQ(webServer::digest_index::segmentSize(64u << 20), 1u << 20);
+    EXPECT_EQ(webServer::digest_index::segmentSize((64u << 20) + 1), 2u << 20);
+    EXPECT_EQ(webServer::digest_index::segmentSize(5ull << 30), 128u << 20);
+    // The reference value of XXH64 for no input, seed 0
+    EXPECT_EQ(xxh64(""), "ef46db3751d8e999");
+}
+
+TEST_F(served_file, AnswersManifestsWith503WhileHashing)
+{
+    // Opened on its own, it isn't hashed
+    auto response = c.respond("GET /large?manifest HTTP/1.1\r\n\r\n", webServer::cached_file::open(dir + "/large"));
+    EXPECT_EQ(status(response), "HTTP/1.1 503 Service Unavailable");
+    EXPECT_EQ(header(response, "Retry-After"), "1");
+    EXPECT_EQ(header(response, "Content-Length"), "0");
+    EXPECT_EQ(body(response), "");
+}
+
+TEST_F(served_file, ListsTheSegmentsOfTheFile)
+{
+    auto tag = etag(dir + "/large");
+    auto response = c.respond("GET /large?manifest HTTP/1.1\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 200 OK");
+    EXPECT_EQ(header(response, "Content-Type"), "application/json");
+    auto manifest = body(response);
+    EXPECT_EQ(header(response, "Content-Length"), std::to_string(manifest.size()));
+    EXPECT_NE(manifest.find("\"url\":\"/large\""), std::string::npos);
+    EXPECT_NE(manifest.find("\"size\":" + std::to_string(largeSize) + ","), std::string::npos);
+    EXPECT_NE(manifest.find("\"etag\":\"\\\"" + tag.substr(1, 16) + "\\\"\""), std::string::npos) << manifest;
+    const std::size_t segmentSize = webServer::digest_index::segmentSize(largeSize);
+    EXPECT_NE(manifest.find("\"segment_size\":" + std::to_string(segmentSize) + ","), std::string::npos);
+    auto listed = segments(manifest);
+    ASSERT_EQ(listed.size(), (largeSize + segmentSize - 1) / segmentSize);
+    for (std::size_t i = 0; i < listed.size(); ++i) {
+        EXPECT_EQ(listed[i].offset, i * segmentSize);
+        EXPECT_EQ(listed[i].length, std::min(segmentSize, largeSize - i * segmentSize));
+        EXPECT_EQ(listed[i].xxh64, xxh64(std::string_view(large).substr(listed[i].offset, listed[i].length))) << i;
+    }
+}
+
+TEST_F(served_file, AnswersManifestHeadRequestsWithoutTheBody)
+{
+    etag(dir + "/large");
+    auto get = c.respond("GET /large?manifest HTTP/1.1\r\n\r\n");
+    auto head = c.respond("HEAD /large?manifest HTTP/1.1\r\n\r\n");
+    EXPECT_EQ(status(head), "HTTP/1.1 200 OK");
+    EXPECT_EQ(header(head, "Content-Length"), std::to_string(body(get).size()));
+    EXPECT_EQ(body(head), "");
+}
+
+TEST_F(served_file, ListsNoSegmentsForAnEmptyFile)
+{
+    etag(dir + "/empty");
+    auto response = c.respond("GET /empty?manifest HTTP/1.1\r\n\r\n");
+    EXPECT_EQ(status(response), "HTTP/1.1 200 OK");
+    auto manifest = body(response);
+    EXPECT_NE(manifest.find("\"size\":0,"), std::string::npos) << manifest;
+    EXPECT_NE(manifest.find("\"segments\":[]}"), std::string::npos) << manifest;
+    EXPECT_EQ(segments(manifest).size(), 0u);
+}
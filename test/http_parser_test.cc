@@ -0,0 +1,208 @@
+/*
+ * Behaviour of the request parser and the Range header parser of
+ * http_parser.hpp, see bench/parser_bench.cc for their speed.
+ */
+#include "../lib/http_parser.hpp"
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+
+using namespace webServer::http;
+
+namespace {
+    /* Parses a whole request at once, req points into text */
+    parse_result parse(const std::string &text, request &req)
+    {
+        request_parser parser;
+        return parser.parse(text.data(), text.size(), req);
+    }
+
+    parse_result parse(const std::string &text)
+    {
+        request req;
+        return parse(text, req);
+    }
+}
+
+TEST(RequestParser, SplitsRequestLineAndHeaders)
+{
+    const std::string text = "GET /a.iso HTTP/1.1\r\nHost: x\r\nRange:  bytes=0-9 \r\n\r\n";
+    request req;
+    ASSERT_EQ(parse(text, req), parse_result::complete);
+    EXPECT_EQ(req.method, "GET");
+    EXPECT_EQ(req.url, "/a.iso");
+    EXPECT_EQ(req.version, "HTTP/1.1");
+    ASSERT_EQ(req.headerCount, 2u);
+    EXPECT_EQ(req.find("host"), "x");
+    EXPECT_EQ(req.find("RANGE"), "bytes=0-9");
+    EXPECT_EQ(req.find("Accept"), "");
+}
+
+TEST(RequestParser, AcceptsBareLineFeeds)
+{
+    const std::string text = "GET / HTTP/1.0\nHost: x\n\n";
+    request req;
+    ASSERT_EQ(parse(text, req), parse_result::complete);
+    EXPECT_EQ(req.version, "HTTP/1.0");
+    EXPECT_EQ(req.find("Host"), "x");
+}
+
+TEST(RequestParser, SkipsEmptyLinesBeforeTheRequestLine)
+{
+    const std::string text = "\r\n\r\nGET / HTTP/1.1\r\n\r\n";
+    request req;
+    ASSERT_EQ(parse(text, req), parse_result::complete);
+    EXPECT_EQ(req.method, "GET");
+}
+
+TEST(RequestParser, ResumesAcrossReads)
+{
+    const std::string text = "GET /x HTTP/1.1\r\nHost: y\r\n\r\nGET /next HTTP/1.1\r\n";
+    request_parser parser;
+    request req;
+    for (std::size_t len = 0; len < 28; ++len) {
+        ASSERT_EQ(parser.parse(text.data(), len, req), parse_result::incomplete) << len;
+    }
+    ASSERT_EQ(parser.parse(text.data(), text.size(), req), parse_result::complete);
+    EXPECT_EQ(req.url, "/x");
+    // The pipelined request after the blank line is left in the buffer
+    EXPECT_EQ(parser.consumed(), 28u);
+}
+
+TEST(RequestParser, RejectsMalformedRequestLines)
+{
+    for (const char *line : {"GET\r\n", "GET /\r\n", "GET / \r\n", " GET / HTTP/1.1\r\n",
+                             "GET  / HTTP/1.1\r\n", "GET / HTTP/1.1 extra\r\n"}) {
+        EXPECT_EQ(parse(std::string(line) + "\r\n"), parse_result::bad) << line;
+    }
+}
+
+TEST(RequestParser, RejectsHeadersWithoutName)
+{
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\nno colon here\r\n\r\n"), parse_result::bad);
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\n: value\r\n\r\n"), parse_result::bad);
+}
+
+TEST(RequestParser, RejectsWhitespaceBeforeTheColon)
+{
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\nHost : x\r\n\r\n"), parse_result::bad);
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\nHost\t: x\r\n\r\n"), parse_result::bad);
+}
+
+TEST(RequestParser, RejectsFoldedHeaders)
+{
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\nX-Long: a\r\n b\r\n\r\n"), parse_result::bad);
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\nX-Long: a\r\n\tb\r\n\r\n"), parse_result::bad);
+    // A folded line that looks like a header must not become one
+    EXPECT_EQ(parse("GET / HTTP/1.1\r\nHost: a\r\n Range: bytes=0-0\r\n\r\n"), parse_result::bad);
+}
+
+TEST(RequestParser, RejectsTooManyHeaders)
+{
+    std::string text = "GET / HTTP/1.1\r\n";
+    for (std::size_t i = 0; i < request::maxHeaders; ++i) {
+        text += "X-" + std::to_string(i) + ": v\r\n";
+    }
+    EXPECT_EQ(parse(text + "\r\n"), parse_result::complete);
+    EXPECT_EQ(parse(text + "X-One-More: v\r\n\r\n"), parse_result::bad);
+}
+
+namespace {
+    /* The ranges parseRanges() finds in a Range header for a file of size bytes */
+    struct parsed_ranges {
+        range_result result;
+        std::vector<std::pair<std::size_t, std::size_t>> ranges;
+    };
+
+    parsed_ranges ranges(std::string_view value, std::size_t size, std::size_t max = 16)
+    {
+        byte_range out[16];
+        std::size_t count = 0;
+        parsed_ranges parsed{parseRanges(value, size, out, max, count), {}};
+        for (std::size_t i = 0; i < count; ++i) {
+            parsed.ranges.emplace_back(out[i].first, out[i].last);
+        }
+        return parsed;
+    }
+
+    using span = std::vector<std::pair<std::size_t, std::size_t>>;
+}
+
+TEST(Ranges, FirstLast)
+{
+    auto parsed = ranges("bytes=0-9", 100);
+    EXPECT_EQ(parsed.result, range_result::satisfiable);
+    EXPECT_EQ(parsed.ranges, (span{{0, 9}}));
+    EXPECT_EQ(ranges("Bytes= 10-19 ", 100).ranges, (span{{10, 19}}));
+}
+
+TEST(Ranges, OpenEnded)
+{
+    EXPECT_EQ(ranges("bytes=90-", 100).ranges, (span{{90, 99}}));
+    EXPECT_EQ(ranges("bytes=0-", 100).ranges, (span{{0, 99}}));
+}
+
+TEST(Ranges, Suffix)
+{
+    EXPECT_EQ(ranges("bytes=-10", 100).ranges, (span{{90, 99}}));
+    // A suffix longer than the file is the whole file
+    EXPECT_EQ(ranges("bytes=-1000", 100).ranges, (span{{0, 99}}));
+    EXPECT_EQ(ranges("bytes=-0", 100).result, range_result::unsatisfiable);
+}
+
+TEST(Ranges, PastTheEndOfTheFile)
+{
+    EXPECT_EQ(ranges("bytes=50-1000", 100).ranges, (span{{50, 99}}));
+    EXPECT_EQ(ranges("bytes=100-200", 100).result, range_result::unsatisfiable);
+    EXPECT_EQ(ranges("bytes=100-", 100).result, range_result::unsatisfiable);
+    EXPECT_EQ(ranges("bytes=0-", 0).result, range_result::unsatisfiable);
+    EXPECT_EQ(ranges("bytes=-5", 0).result, range_result::unsatisfiable);
+    // Only the ranges past the end are dropped
+    auto parsed = ranges("bytes=200-300,0-0", 100);
+    EXPECT_EQ(parsed.result, range_result::satisfiable);
+    EXPECT_EQ(parsed.ranges, (span{{0, 0}}));
+}
+
+TEST(Ranges, IgnoresMalformedHeaders)
+{
+    for (const char *value : {"", "bytes=", "bytes=,", "items=0-1", "bytes=5-1", "bytes=a-b", "bytes=1-2-3",
+                              "bytes=1", "bytes=--1", "bytes=0-1;x", "bytes=99999999999999999999-"}) {
+        EXPECT_EQ(ranges(value, 100).result, range_result::none) << value;
+    }
+}
+
+TEST(Ranges, IgnoresMoreThanMaxRanges)
+{
+    std::string value = "bytes=";
+    for (std::size_t i = 0; i < 16; ++i) {
+        value += std::to_string(i * 10) + "-" + std::to_string(i * 10 + 1) + ",";
+    }
+    auto parsed = ranges(value, 1000);
+    EXPECT_EQ(parsed.result, range_result::satisfiable);
+    EXPECT_EQ(parsed.ranges.size(), 16u);
+    EXPECT_EQ(ranges(value + "500-501", 1000).result, range_result::none);
+    EXPECT_EQ(ranges("bytes=0-1,4-5,8-9", 100, 2).result, range_result::none);
+}
+
+TEST(Ranges, MergesOverlappingRanges)
+{
+    std::string value = "bytes=0-";
+    for (std::size_t i = 1; i < 16; ++i) {
+        value += ",0-";
+    }
+    // Sent as asked, this would be the file 16 times over
+    auto parsed = ranges(value, 1 << 30);
+    EXPECT_EQ(parsed.result, range_result::satisfiable);
+    EXPECT_EQ(parsed.ranges, (span{{0, (1 << 30) - 1}}));
+    EXPECT_EQ(ranges("bytes=0-49,-60", 100).ranges, (span{{0, 99}}));
+    EXPECT_EQ(ranges("bytes=10-20,12-15", 100).ranges, (span{{10, 20}}));
+}
+
+TEST(Ranges, MergesAdjacentRangesAndSortsThem)
+{
+    EXPECT_EQ(ranges("bytes=0-9,10-19", 100).ranges, (span{{0, 19}}));
+    EXPECT_EQ(ranges("bytes=50-59,0-9,5-20", 100).ranges, (span{{0, 20}, {50, 59}}));
+    EXPECT_EQ(ranges("bytes=-10,0-0", 100).ranges, (span{{0, 0}, {90, 99}}));
+}
@@ -0,0 +1,178 @@
+/*
+ * HTTPS end to end: a server with a self-signed certificate made for
+ * the test, and a client that handshakes, resumes its session and
+ * fetches a range. Also checks that a certificate that can't be loaded
+ * keeps the server from starting.
+ */
+#include "../lib/pool.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <boost/asio/ssl.hpp>
+#include <gtest/gtest.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+#include <unistd.h>
+
+namespace {
+    using tcp = boost::asio::ip::tcp;
+
+    /*
+     * Writes a P-256 key and a certificate for localhost signed with it
+     * @param: path of the PEM file holding both
+     * @return: false on an error
+     */
+    bool writeSelfSigned(const std::string &path)
+    {
+        EVP_PKEY *key = nullptr;
+        EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, nullptr);
+        bool ok = keyContext && EVP_PKEY_keygen_init(keyContext) == 1
+                && EVP_PKEY_CTX_set_ec_paramgen_curve_nid(keyContext, NID_X9_62_prime256v1) == 1
+                && EVP_PKEY_keygen(keyContext, &key) == 1;
+        EVP_PKEY_CTX_free(keyContext);
+        X509 *cert = ok ? X509_new() : nullptr;
+        if (cert) {
+            X509_set_version(cert, 2);
+            ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+            X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+            X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+            X509_set_pubkey(cert, key);
+            X509_NAME *name = X509_get_subject_name(cert);
+            X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                    reinterpret_cast<const unsigned char *>("localhost"), -1, -1, 0);
+            X509_set_issuer_name(cert, name);
+            ok = X509_sign(cert, key, EVP_sha256()) > 0;
+        }
+        FILE *out = ok ? std::fopen(path.c_str(), "w") : nullptr;
+        ok = out && PEM_write_PrivateKey(out, key, nullptr, nullptr, 0, nullptr, nullptr) == 1
+                && PEM_write_X509(out, cert) == 1;
+        if (out) {
+            std::fclose(out);
+        }
+        X509_free(cert);
+        EVP_PKEY_free(key);
+        return ok;
+    }
+
+    /* A server on a port of its own serving a file of 1000 bytes at "/" over TLS */
+    class https_server : public ::testing::Test {
+    protected:
+        static inline std::string dir;
+        static inline std::string content;
+        static inline webServer::io_context_pool *pool = nullptr;
+        static inline std::thread runner;
+
+        static void SetUpTestSuite()
+        {
+            char name[] = "/tmp/tls_testXXXXXX";
+            ASSERT_NE(::mkdtemp(name), nullptr);
+            dir = name;
+            ASSERT_TRUE(writeSelfSigned(dir + "/server.pem"));
+            for (std::size_t i = 0; i < 1000; ++i) {
+                content += static_cast<char>('0' + i % 10);
+            }
+            FILE *file = std::fopen((dir + "/file").c_str(), "w");
+            ASSERT_NE(file, nullptr);
+            std::fwrite(content.data(), 1, content.size(), file);
+            std::fclose(file);
+
+            auto conf = std::make_shared<webServer::settings>();
+            conf->file = dir + "/file";
+            conf->tlsCertificate = dir + "/server.pem";
+            conf->ktls = false;
+            // Kept until the process exits, the file_cache watches files on its io_context
+            pool = new webServer::io_context_pool(conf);
+            runner = std::thread([]() { pool->run(); });
+        }
+
+        static void TearDownTestSuite()
+        {
+            if (pool) {
+                pool->stop();
+                runner.join();
+            }
+            std::system(("rm -rf " + dir).c_str());
+        }
+
+        /*
+         * Sends a request over a new TLS connection and reads the response
+         * @param: the request, session to resume (nullptr for a full
+         *         handshake), whether the handshake resumed it
+         * @return: the response, the session to resume next time
+         */
+        static std::string fetch(const std::string &request, SSL_SESSION *&session, bool &resumed)
+        {
+            boost::asio::io_context io;
+            boost::asio::ssl::context context(boost::asio::ssl::context::tls_client);
+            boost::asio::ssl::stream<tcp::socket> stream(io, context);
+            stream.next_layer().connect(tcp::endpoint(boost::asio::ip::address_v6::loopback(), pool->port()));
+            if (session) {
+                SSL_set_session(stream.native_handle(), session);
+                SSL_SESSION_free(session);
+                session = nullptr;
+            }
+            stream.handshake(boost::asio::ssl::stream_base::client);
+            resumed = SSL_session_reused(stream.native_handle()) == 1;
+            boost::asio::write(stream, boost::asio::buffer(request));
+            std::string response;
+            boost::system::error_code ec;
+            char buf[4096];
+            while (!ec && !complete(response)) {
+                std::size_t n = stream.read_some(boost::asio::buffer(buf), ec);
+                response.append(buf, n);
+            }
+            // TLS 1.3 tickets come after the handshake, so the session is
+            // taken once read from. OpenSSL won't resume it unless the
+            // connection is shut down properly.
+            session = SSL_get1_session(stream.native_handle());
+            stream.shutdown(ec);
+            return response;
+        }
+
+        /* @return: whether the header and all of the body are in */
+        static bool complete(const std::string &response)
+        {
+            auto end = response.find("\r\n\r\n");
+            auto length = response.find("Content-Length: ");
+            if (end == std::string::npos || length == std::string::npos) {
+                return false;
+            }
+            return response.size() - end - 4 >= std::stoul(response.substr(length + 16));
+        }
+    };
+}
+
+TEST_F(https_server, ResumesSessionsAndServesRanges)
+{
+    SSL_SESSION *session = nullptr;
+    bool resumed = true;
+    auto response = fetch("GET / HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n", session, resumed);
+    EXPECT_FALSE(resumed);
+    EXPECT_EQ(response.substr(0, response.find("\r\n")), "HTTP/1.1 200 OK");
+    EXPECT_EQ(response.substr(response.find("\r\n\r\n") + 4), content);
+    ASSERT_NE(session, nullptr);
+
+    response = fetch("GET / HTTP/1.1\r\nHost: localhost\r\nRange: bytes=10-19\r\nConnection: close\r\n\r\n",
+                     session, resumed);
+    EXPECT_TRUE(resumed);
+    EXPECT_EQ(response.substr(0, response.find("\r\n")), "HTTP/1.1 206 Partial Content");
+    EXPECT_NE(response.find("Content-Range: bytes 10-19/1000\r\n"), std::string::npos);
+    EXPECT_EQ(response.substr(response.find("\r\n\r\n") + 4), content.substr(10, 10));
+    SSL_SESSION_free(session);
+}
+
+TEST_F(https_server, KeepsTheContextWhenTheCertificateCantBeLoaded)
+{
+    auto running = webServer::tls_context::instance().current();
+    EXPECT_THROW(webServer::tls_context::instance().configure(dir + "/missing.pem", "", false), std::runtime_error);
+    EXPECT_EQ(webServer::tls_context::instance().current(), running);
+}
+
+TEST(TlsStartup, RefusesToStartWithoutTheCertificate)
+{
+    auto conf = std::make_shared<webServer::settings>();
+    conf->tlsCertificate = "/nonexistent/server.pem";
+    EXPECT_THROW(webServer::io_context_pool pool(conf), std::runtime_error);
+}
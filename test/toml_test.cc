@@ -0,0 +1,150 @@
+/*
+ * Behaviour of the configuration parser of toml.hpp and of the typed
+ * lookups loadSettings() makes with it in utility.hpp.
+ */
+#include "../lib/utility.hpp"
+#include <string>
+#include <gtest/gtest.h>
+
+using namespace utility;
+
+namespace {
+    /* @return: the message of the InvalidFile parsing text throws, empty if it parses */
+    std::string parseError(const std::string &text)
+    {
+        try {
+            toml::parser::parse(text);
+        }
+        catch (InvalidFile &e) {
+            return e.what();
+        }
+        return "";
+    }
+
+    std::string settingsError(const std::string &text)
+    {
+        try {
+            loadSettings(toml::parser::parse(text));
+        }
+        catch (InvalidFile &e) {
+            return e.what();
+        }
+        return "";
+    }
+
+    std::vector<std::string> texts(const toml::value &v)
+    {
+        std::vector<std::string> result;
+        for (auto &item : v.items) {
+            result.push_back(item.text);
+        }
+        return result;
+    }
+}
+
+TEST(Toml, ReadsTablesAndKeys)
+{
+    auto doc = toml::parser::parse("top = 1\n[port]\nport = [ 8080 ]\n\n[file]\nfile = \"a.iso\"\n");
+    EXPECT_EQ(doc[""]["top"].text, "1");
+    EXPECT_TRUE(doc["port"]["port"].array);
+    EXPECT_EQ(texts(doc["port"]["port"]), (std::vector<std::string>{"8080"}));
+    EXPECT_EQ(doc["file"]["file"].text, "a.iso");
+    EXPECT_EQ(doc["file"]["file"].line, 6u);
+}
+
+TEST(Toml, ReadsArraysOverSeveralLines)
+{
+    auto doc = toml::parser::parse("[port]\nport = [\n  8080,   # first\n\n  8081,\n  'x'\n]\nnext = 2\n");
+    auto &port = doc["port"]["port"];
+    EXPECT_EQ(texts(port), (std::vector<std::string>{"8080", "8081", "x"}));
+    EXPECT_EQ(port.line, 2u);
+    EXPECT_EQ(port.items[1].line, 5u);
+    EXPECT_EQ(doc["port"]["next"].line, 8u);
+    EXPECT_EQ(texts(toml::parser::parse("a = [ ]\n")[""]["a"]), std::vector<std::string>{});
+    EXPECT_EQ(texts(toml::parser::parse("a = [ 1, 2, ]\n")[""]["a"]), (std::vector<std::string>{"1", "2"}));
+}
+
+TEST(Toml, ResolvesEscapesInBasicStrings)
+{
+    auto doc = toml::parser::parse(R"(a = "tab\there \"quoted\" back\\slash\n"
+b = "\u00e9\u20AC\U0001F600"
+c = 'C:\no\escapes'
+)");
+    EXPECT_EQ(doc[""]["a"].text, "tab\there \"quoted\" back\\slash\n");
+    EXPECT_EQ(doc[""]["b"].text, "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80");
+    EXPECT_EQ(doc[""]["c"].text, "C:\\no\\escapes");
+    EXPECT_NE(parseError(R"(a = "\q")"), "");
+    EXPECT_NE(parseError(R"(a = "\u12")"), "");
+    EXPECT_NE(parseError(R"(a = "\u12g4")"), "");
+}
+
+TEST(Toml, IgnoresCommentsOutsideStrings)
+{
+    auto doc = toml::parser::parse("# heading\n[log] # the log\nlevel = [ info ] # more\npath = \"a#b\"\n");
+    EXPECT_EQ(texts(doc["log"]["level"]), (std::vector<std::string>{"info"}));
+    EXPECT_EQ(doc["log"]["path"].text, "a#b");
+}
+
+TEST(Toml, TakesBareWordsAsStrings)
+{
+    auto doc = toml::parser::parse("[file]\nroot = [ ./some_directory ]\nfile = [ ./the file.iso ]\nmode = mmap \n");
+    EXPECT_EQ(texts(doc["file"]["root"]), (std::vector<std::string>{"./some_directory"}));
+    EXPECT_EQ(texts(doc["file"]["file"]), (std::vector<std::string>{"./the file.iso"}));
+    EXPECT_EQ(doc["file"]["mode"].text, "mmap");
+}
+
+TEST(Toml, RejectsKeysAndTablesDefinedTwice)
+{
+    EXPECT_EQ(parseError("[a]\nx = 1\nx = 2\n"), "Configuration line 3: x is set twice");
+    EXPECT_EQ(parseError("[a]\nx = 1\n[b]\n[a]\ny = 2\n"), "Configuration line 4: table [a] is defined twice");
+    // The same key in different tables is fine
+    EXPECT_EQ(parseError("[a]\nx = 1\n[b]\nx = 2\n"), "");
+}
+
+TEST(Toml, NamesTheLineOfAnError)
+{
+    EXPECT_EQ(parseError("[a]\n\nx 1\n"), "Configuration line 3: expected = after x");
+    EXPECT_EQ(parseError("[a\n"), "Configuration line 1: expected ] after the table name");
+    EXPECT_EQ(parseError("[a]\nx\ny = 1\n"), "Configuration line 2: expected = after x");
+    EXPECT_EQ(parseError("a = [ 1,\n 2\n 3 ]\n"), "Configuration line 3: expected , or ] in the array");
+    EXPECT_EQ(parseError("a = [ 1,\n 2,\n"), "Configuration line 3: unterminated array");
+    EXPECT_EQ(parseError("a = 1\nb = \"open\nc = 2\n"), "Configuration line 2: unterminated string");
+    EXPECT_EQ(parseError("a = 'x' y\n"), "Configuration line 1: unexpected text after the value");
+    EXPECT_EQ(parseError("a =\n"), "Configuration line 1: expected a value");
+}
+
+TEST(Settings, ReadsWordsFromTheirSets)
+{
+    auto conf = loadSettings(toml::parser::parse(
+            "[transfer]\nmode = [ mmap ]\n[connection]\nengine = [ uring ]\n[tls]\nktls = [ false ]\n"
+            "[log]\nlevel = [ debug ]\n"));
+    EXPECT_FALSE(conf.sendfile);
+    EXPECT_EQ(conf.engine, webServer::session_engine::uring);
+    EXPECT_FALSE(conf.ktls);
+    EXPECT_EQ(conf.logLevel, webServer::log_level::debug);
+    // Unset and empty keys keep their defaults
+    conf = loadSettings(toml::parser::parse("[connection]\nengine = [ ]\n"));
+    EXPECT_TRUE(conf.sendfile);
+    EXPECT_EQ(conf.engine, webServer::session_engine::callbacks);
+    EXPECT_TRUE(conf.ktls);
+    EXPECT_EQ(conf.logLevel, webServer::log_level::error);
+}
+
+TEST(Settings, RejectsMisspelledWords)
+{
+    EXPECT_EQ(settingsError("[connection]\nengine = [ urnig ]\n"),
+              "Configuration line 2: [connection] engine must be one of callbacks, coroutines, uring");
+    EXPECT_EQ(settingsError("[log]\n\nlevel = [ warn ]\n"),
+              "Configuration line 3: [log] level must be one of off, error, info, debug");
+    EXPECT_EQ(settingsError("[transfer]\nmode = [ send_file ]\n"),
+              "Configuration line 2: [transfer] mode must be one of sendfile, mmap");
+    EXPECT_EQ(settingsError("[tls]\nktls = [ yes ]\n"),
+              "Configuration line 2: [tls] ktls must be one of true, false");
+}
+
+TEST(Settings, RejectsNumbersThatArent)
+{
+    EXPECT_EQ(settingsError("[threads]\nthreads = [ two ]\n"),
+              "Configuration line 2: [threads] threads must be a whole number");
+    EXPECT_EQ(settingsError("[port]\nport = [ 70000 ]\n"), "Configuration: [port] 70000 is not a port");
+}